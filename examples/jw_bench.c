@@ -0,0 +1,210 @@
+// Google BSD license https://developers.google.com/google-bsd-license
+
+//
+// A json_writer benchmark, which renders a 1000-page "/json" list both
+// the way we used to, via per-page asprintf'd strings of malloc'd escaped
+// values that are then concatenated, and via json_writer into one reused
+// buffer, and checks that both produce the same bytes.
+//
+// Usage: jw_bench [num_pages [num_loops]]
+//
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "char_buffer.h"
+#include "json_writer.h"
+
+struct page_struct {
+  int page_num;
+  char *app_id;
+  char *title;
+  char *url;
+};
+typedef struct page_struct *page_t;
+
+static const char *host = "localhost";
+static const int port = 9222;
+
+static double now_millis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// The old iwdp_escape_json_string_val, but with json_writer's escapes.
+static char *escape_json(const char *s) {
+  size_t len = strlen(s);
+  char *ret = (char *)malloc(len * 6 + 1);
+  if (!ret) {
+    return NULL;
+  }
+  char *tail = ret;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    unsigned char ch = (unsigned char)s[i];
+    char esc = 0;
+    switch (ch) {
+      case '"': esc = '"'; break;
+      case '\\': esc = '\\'; break;
+      case '\b': esc = 'b'; break;
+      case '\f': esc = 'f'; break;
+      case '\n': esc = 'n'; break;
+      case '\r': esc = 'r'; break;
+      case '\t': esc = 't'; break;
+      default: break;
+    }
+    if (esc) {
+      *tail++ = '\\';
+      *tail++ = esc;
+    } else if (ch < 0x20) {
+      tail += sprintf(tail, "\\u%04x", ch);
+    } else {
+      *tail++ = ch;
+    }
+  }
+  *tail = '\0';
+  return ret;
+}
+
+// The old way.
+static char *render_asprintf(page_t pages, size_t n) {
+  char **items = (char **)calloc(n + 1, sizeof(char *));
+  if (!items) {
+    return NULL;
+  }
+  size_t sum_len = 0;
+  size_t i;
+  for (i = 0; i < n; i++) {
+    page_t p = pages + i;
+    char *url = escape_json(p->url);
+    char *title = escape_json(p->title);
+    char *escaped_host = escape_json(host);
+    char *app_id = escape_json(p->app_id);
+    int ret = (url && title && escaped_host && app_id ?
+        asprintf(items + i,
+        "%s{\n"
+        "   \"devtoolsFrontendUrl\": \"\",\n"
+        "   \"faviconUrl\": \"\",\n"
+        "   \"thumbnailUrl\": \"/thumb/%s\",\n"
+        "   \"title\": \"%s\",\n"
+        "   \"url\": \"%s\",\n"
+        "   \"webSocketDebuggerUrl\": \"ws://%s:%d/devtools/page/%d\",\n"
+        "   \"appId\": \"%s\"\n"
+        "}",
+        (i ? "," : ""), url, title, url, escaped_host, port, p->page_num,
+        app_id) : -1);
+    free(url);
+    free(title);
+    free(escaped_host);
+    free(app_id);
+    if (ret < 0) {
+      return NULL;
+    }
+    sum_len += strlen(items[i]);
+  }
+  char *ret = (char *)calloc(sum_len + 3, sizeof(char));
+  if (ret) {
+    char *tail = ret;
+    strcpy(tail++, "[");
+    for (i = 0; i < n; i++) {
+      strcpy(tail, items[i]);
+      tail += strlen(items[i]);
+      free(items[i]);
+    }
+    strcpy(tail, "]");
+  }
+  free(items);
+  return ret;
+}
+
+static int render_jw(cb_t out, page_t pages, size_t n) {
+  int ret = jw_puts(out, "[");
+  size_t i;
+  for (i = 0; !ret && i < n; i++) {
+    page_t p = pages + i;
+    ret = (jw_puts(out, (i ? ",{\n" : "{\n")) ||
+        jw_puts(out, "   \"devtoolsFrontendUrl\": \"\",\n"
+          "   \"faviconUrl\": \"\",\n"
+          "   \"thumbnailUrl\": \"/thumb/") ||
+        jw_escape_json(out, p->url) ||
+        jw_puts(out, "\",\n   \"title\": \"") ||
+        jw_escape_json(out, p->title) ||
+        jw_puts(out, "\",\n   \"url\": \"") ||
+        jw_escape_json(out, p->url) ||
+        jw_puts(out, "\",\n   \"webSocketDebuggerUrl\": \"ws://") ||
+        jw_escape_json(out, host) ||
+        jw_printf(out, ":%d/devtools/page/%d\",\n   \"appId\": \"",
+          port, p->page_num) ||
+        jw_escape_json(out, p->app_id) ||
+        jw_puts(out, "\"\n}"));
+  }
+  return (ret ? ret : jw_puts(out, "]"));
+}
+
+int main(int argc, char **argv) {
+  size_t n = (argc > 1 ? strtoul(argv[1], NULL, 0) : 1000);
+  size_t loops = (argc > 2 ? strtoul(argv[2], NULL, 0) : 100);
+  page_t pages = (page_t)calloc(n, sizeof(struct page_struct));
+  size_t i;
+  for (i = 0; i < n; i++) {
+    pages[i].page_num = i + 1;
+    if (asprintf(&pages[i].app_id, "PID:%zd", 100 + i % 7) < 0 ||
+        asprintf(&pages[i].title, (i % 10 ?
+            "Example page %zd - A typical title" :
+            "Example page %zd - A \"quoted\" title\twith a \\ and \x01"),
+          i) < 0 ||
+        asprintf(&pages[i].url,
+          "https://www.example.com/some/path/to/page%zd.html?q=%zd", i,
+          i * 31) < 0) {
+      return 1;
+    }
+  }
+
+  double start = now_millis();
+  char *s = NULL;
+  for (i = 0; i < loops; i++) {
+    free(s);
+    if (!(s = render_asprintf(pages, n))) {
+      return 1;
+    }
+  }
+  double asprintf_millis = (now_millis() - start) / loops;
+
+  cb_t out = cb_new();
+  start = now_millis();
+  for (i = 0; i < loops; i++) {
+    cb_clear(out);
+    if (render_jw(out, pages, n)) {
+      return 1;
+    }
+  }
+  double jw_millis = (now_millis() - start) / loops;
+
+  size_t length = strlen(s);
+  size_t jw_length = out->tail - out->head;
+  bool is_same = (length == jw_length && !memcmp(s, out->head, length));
+  printf("%zd pages, %zd loops\n", n, loops);
+  printf("asprintf:    %8.3f ms, %zd bytes\n", asprintf_millis, length);
+  printf("json_writer: %8.3f ms, %zd bytes\n", jw_millis, jw_length);
+  if (!is_same) {
+    fprintf(stderr, "The outputs differ\n");
+  }
+  free(s);
+  cb_free(out);
+  for (i = 0; i < n; i++) {
+    free(pages[i].app_id);
+    free(pages[i].title);
+    free(pages[i].url);
+  }
+  free(pages);
+  return (is_same ? 0 : 1);
+}
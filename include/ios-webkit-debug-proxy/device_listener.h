@@ -50,6 +50,12 @@ struct dl_struct {
     // input packet.
     dl_status (*on_recv)(dl_t self, const char *buf, ssize_t length);
 
+    // Optional, call before a recv to get the rest of the current packet's
+    // space in our input buffer, so the packet can be read in place and
+    // passed to on_recv.  Sets *to_buf to NULL if we don't know the packet
+    // length yet.
+    dl_status (*on_recv_buffer)(dl_t self, char **to_buf, size_t *to_length);
+
     void *state;
     bool *is_debug;
 
@@ -15,10 +15,27 @@ extern "C" {
 #include <stdint.h>
 #include <stddef.h>
 
+#include "websocket.h"
+
 typedef uint8_t iwdp_status;
 #define IWDP_ERROR 1
 #define IWDP_SUCCESS 0
 
+typedef uint8_t iwdp_send_flags;
+// A command response, which may skip ahead of queued events
+#define IWDP_SEND_PRIORITY 0x1
+// More of the same message follows, e.g. the next websocket fragment
+#define IWDP_SEND_MORE     0x2
+
+// An fd's input counters, see get_fd_stats
+struct iwdp_fd_stats {
+  size_t buffer_length;      // current recv buffer length
+  uint64_t recv_bytes;
+  uint64_t recv_calls;
+  uint64_t max_wait_millis;  // longest that the fd was ready but unread
+};
+typedef struct iwdp_fd_stats *iwdp_fd_stats_t;
+
 
 struct iwdp_private;
 typedef struct iwdp_private *iwdp_private_t;
@@ -49,12 +66,82 @@ struct iwdp_struct {
   iwdp_status (*on_recv)(iwdp_t self, int fd, void *value,
                          const char *buf, ssize_t length);
 
+  // Optionally supply the buffer for fd's next recv, so a device packet
+  // body can be read straight into place.
+  // @param to_buf set to a buffer for the next on_recv, or left NULL
+  iwdp_status (*on_recv_buffer)(iwdp_t self, int fd, void *value,
+                                char **to_buf, size_t *to_length);
+
   iwdp_status (*on_close)(iwdp_t self, int fd, void *value,
                           bool is_server);
 
+  // Handle a timer.
+  // @param value from our add_timer call
+  iwdp_status (*on_timer)(iwdp_t self, int timer_id, void *value);
+
   void *state;
   bool *is_debug;
 
+  // Optional permessage-deflate settings for our websocket clients
+  ws_deflate_t ws_deflate;
+
+  // Split device messages into websocket frames of at most this many bytes,
+  // or 0 to send each message as a single frame
+  size_t max_frame_length;
+
+  // Ping websocket clients that have been quiet for ping_interval seconds,
+  // and close them if they don't answer within ping_timeout seconds.
+  // 0 to never ping.
+  unsigned int ping_interval;
+  unsigned int ping_timeout;
+
+  // Close clients that haven't sent or received a message in this many
+  // seconds, or 0 to keep idle clients.
+  unsigned int idle_timeout;
+
+  // While a client has more than drop_watermark bytes waiting to be sent,
+  // drop events that a newer event supersedes, e.g. screencast frames,
+  // and only send one of every drop_sample_rate high-rate events, e.g.
+  // Network.dataReceived.  The client is then sent a
+  // "Proxy.eventsDropped" event.  0 to never drop.
+  size_t drop_watermark;
+  unsigned int drop_sample_rate;
+
+  // Hold events for "remote" clients, i.e. ones that connect with a
+  // "?remote" query or an "X-DevTools-Remote" header, for up to this many
+  // milliseconds, then send them in a single write.  Events that only
+  // update a node or stylesheet replace any held update for the same
+  // target.  0 to never hold events.
+  unsigned int batch_millis;
+
+  // Wait this many milliseconds before asking a device for an app's page
+  // listing, so a burst of app updates costs one request per app.  We
+  // also never have more than one unanswered request per app.  0 to ask
+  // immediately.
+  unsigned int listing_millis;
+
+  // Limit the memory of our buffers, send queues and page tables to this
+  // many bytes, or 0 for no limit.  Once we're over budget we refuse new
+  // clients, drop events as if every client had passed drop_watermark,
+  // and reject client frames that won't fit.  See "/json/memory".
+  size_t max_memory;
+
+  // Join device messages that are longer than this, e.g. heap snapshots,
+  // in a temp file instead of in memory, or 0 to always use memory.
+  size_t spill_length;
+
+  // Let several clients inspect a page at once, instead of a new client
+  // taking the page from the old one.  The clients share one session with
+  // the device: we give their commands our own ids, route each response
+  // back to its client, and send every event to every client.
+  bool multi_client;
+
+  // In multi_client mode, cache up to this many bytes of each domain's
+  // scripts, style sheets or execution contexts per page, to replay to a
+  // client that enables a domain after another client did, or 0 to not
+  // cache.  See replay_cache.h.
+  size_t replay_length;
+
 
   // Provide these callbacks:
 
@@ -88,7 +175,16 @@ struct iwdp_struct {
   int (*connect)(iwdp_t self, const char *hostname_with_port);
 
   // Send bytes to fd.
-  iwdp_status (*send)(iwdp_t self, int fd, const char *data, size_t length);
+  // @param flags IWDP_SEND_* flags
+  iwdp_status (*send)(iwdp_t self, int fd, const char *data, size_t length,
+      iwdp_send_flags flags);
+
+  // Get the number of bytes that we've sent to fd but that are still
+  // waiting for the fd to accept them.
+  size_t (*get_send_length)(iwdp_t self, int fd);
+
+  // Get an fd's input counters, e.g. for "/json/memory".
+  iwdp_status (*get_fd_stats)(iwdp_t self, int fd, iwdp_fd_stats_t to_stats);
 
   // Add a fd that was returned from attach/listen/connect.
   iwdp_status (*add_fd)(iwdp_t self, int fd, void *ssl_session, void *value,
@@ -96,6 +192,12 @@ struct iwdp_struct {
 
   iwdp_status (*remove_fd)(iwdp_t self, int fd);
 
+  // Call our on_timer after delay_millis.
+  // @result timer id > 0, or -1 for error
+  int (*add_timer)(iwdp_t self, unsigned int delay_millis, void *value);
+
+  iwdp_status (*remove_timer)(iwdp_t self, int timer_id);
+
 
   // For internal use only:
   iwdp_status (*on_error)(iwdp_t self, const char *format, ...);
@@ -21,15 +21,42 @@ int sm_listen(int port);
 // Connect to a server, return the file descriptor (or -1 for error).
 int sm_connect(const char *socket_addr);
 
+// Monotonic clock, in milliseconds, unaffected by changes to the time of
+// day.  Timer deadlines use this clock.
+uint64_t sm_now_millis();
+
 
 typedef uint8_t sm_status;
 #define SM_ERROR 1
 #define SM_SUCCESS 0
 
+typedef uint8_t sm_send_flags;
+// If the fd is blocked, queue this ahead of normal sends, but after the
+// message that's being sent, so it's not split
+#define SM_SEND_PRIORITY 0x1
+// The next send to this fd continues the same message, so nothing may be
+// queued between them
+#define SM_SEND_MORE     0x2
+
 
 struct sm_private;
 typedef struct sm_private *sm_private_t;
 
+// Per-fd counters, see get_fd_stats.
+struct sm_fd_stats {
+  // current recv buffer length
+  size_t buffer_length;
+  // bytes and on_recv calls so far, e.g. bytes / calls is the mean bytes
+  // per call
+  uint64_t recv_bytes;
+  uint64_t recv_calls;
+  // the longest that this fd has been ready before we read it
+  uint64_t max_wait_millis;
+  // bytes that we've accepted but not yet sent, i.e. corked or queued
+  size_t send_length;
+};
+typedef struct sm_fd_stats *sm_fd_stats_t;
+
 struct sm_struct;
 typedef struct sm_struct *sm_t;
 sm_t sm_new(size_t buffer_length);
@@ -46,17 +73,57 @@ struct sm_struct {
 
   sm_status (*remove_fd)(sm_t self, int fd);
 
-  // @param value a value for the on_sent callback
+  // @param flags SM_SEND_* flags.  A message's sends must be made
+  // together, e.g. all of a websocket message's frames.
+  // @param value a value for the on_sent callback.  If max_cork_millis is
+  // set, normal sends without a value are corked: copied to the fd's
+  // pending output, which is sent in one write at the end of our select
+  // pass.
   sm_status (*send)(sm_t self, int fd, const char *data, size_t length,
-      void* value);
+      sm_send_flags flags, void* value);
+
+  // Call on_timer once, after at least delay_millis.
+  // @param value a value for the on_timer callback
+  // @result timer id > 0, or -1 for error
+  int (*add_timer)(sm_t self, unsigned int delay_millis, void *value);
 
+  // Cancel a timer that hasn't fired yet.
+  sm_status (*remove_timer)(sm_t self, int timer_id);
+
+  // Wait up to timeout_secs (or until the next timer is due) for I/O, then
+  // dispatch callbacks for ready fds and due timers.
   int (*select)(sm_t self, int timeout_secs);
 
   sm_status (*cleanup)(sm_t self);
 
+  sm_status (*get_fd_stats)(sm_t self, int fd, sm_fd_stats_t to_stats);
+
   void *state;
   bool *is_debug;
 
+  // Each fd starts with our shared buffer_length (or a TLS record, for ssl
+  // fds), grows towards max_recv_length while its reads fill the buffer,
+  // and shrinks back when its reads are small or we're idle.  The grown
+  // buffers are limited to max_recv_memory in total.
+  size_t max_recv_length;
+  size_t max_recv_memory;
+
+  // Cork sends, but don't hold any fd's output for longer than this, or 0
+  // to send immediately.  An fd's output is also sent as soon as it would
+  // exceed max_cork_length.
+  unsigned int max_cork_millis;
+  size_t max_cork_length;
+
+  // Stop reading an fd once we've read this many bytes from it in one
+  // select pass, or 0 for no limit, so one busy fd can't starve the rest.
+  // We'll read the rest in our next pass, without waiting.
+  size_t max_recv_per_pass;
+
+  // Once an fd has this many bytes queued, queue the rest of its sends in
+  // a temp file, and send them from there, instead of holding them in
+  // memory.  0 to always queue in memory.
+  size_t spill_length;
+
   // Set these callbacks:
 
   // @param server_value specified in the add_fd call
@@ -71,8 +138,19 @@ struct sm_struct {
   sm_status (*on_recv)(sm_t self, int fd, void *value,
                        const char *buf, ssize_t length);
 
+  // Optional, called before each recv to let the fd's owner supply the
+  // buffer, e.g. to read a length-prefixed body straight into place.  The
+  // next on_recv will be passed this buffer.
+  // @param to_buf set to a buffer, or left NULL to use our shared buffer
+  // @param to_length set to the most bytes that we should read
+  sm_status (*on_recv_buffer)(sm_t self, int fd, void *value,
+                              char **to_buf, size_t *to_length);
+
   sm_status (*on_close)(sm_t self, int fd, void *value, bool is_server);
 
+  // @param value specified in the add_timer call
+  sm_status (*on_timer)(sm_t self, int timer_id, void *value);
+
   // For internal use only:
   sm_private_t private_state;
 };
@@ -21,6 +21,9 @@ typedef uint8_t wi_status;
 #define WI_ERROR 1
 #define WI_SUCCESS 0
 
+// Scratch space that send_bplist needs before and after the rpc
+#define WI_BPLIST_PADDING 64
+
 
 // Create a webinspector connection.
 //
@@ -55,17 +58,35 @@ struct wi_struct {
     // calls recv_packet when the buffer contains one or more packets.
     wi_status (*on_recv)(wi_t self, const char *buf, ssize_t length);
 
-    // Calls recv_plist if the packet is a full plist, otherwise appends
-    // the partial packet to our pending buffer.
+    // Optional, call before a recv to get the rest of the current packet's
+    // space in our input buffer, so the packet can be read in place and
+    // passed to on_recv.  Sets *to_buf to NULL if we don't know the packet
+    // length yet.
+    wi_status (*on_recv_buffer)(wi_t self, char **to_buf, size_t *to_length);
+
+    // Calls recv_bplist or recv_plist if the packet is a full plist,
+    // otherwise appends the partial packet to our pending buffer.
     wi_status (*recv_packet)(wi_t self, const char *packet, ssize_t length);
 
     // Calls send_packet with the serialized rpc packet(s).
     wi_status (*send_plist)(wi_t self, const plist_t rpc_dict);
 
+    // Like send_plist, but for an already-serialized rpc, which we'll
+    // frame in place.  The caller must provide WI_BPLIST_PADDING bytes of
+    // scratch space before and after rpc_bin.
+    wi_status (*send_bplist)(wi_t self, char *rpc_bin, size_t length);
+
+    // Get the bytes held by our buffers.
+    size_t (*get_memory)(wi_t self);
+
     // Optional state for use in your callbacks.
     void *state;
     bool *is_debug;
 
+    // Join partial messages in a temp file, instead of in memory, once
+    // they're longer than this, or 0 to always join them in memory.
+    size_t spill_length;
+
     //
     // Set these callbacks:
     //
@@ -76,6 +97,10 @@ struct wi_struct {
     // Receive a deserialized full rpc.
     wi_status (*recv_plist)(wi_t self, const plist_t rpc_dict);
 
+    // Optional, receive a serialized full rpc instead of calling recv_plist.
+    // The rpc_bin is only valid during this call.
+    wi_status (*recv_bplist)(wi_t self, const char *rpc_bin, size_t length);
+
     // For internal use only:
     wi_status (*on_error)(wi_t self, const char *format, ...);
     wi_private_t private_state;
@@ -35,6 +35,20 @@ typedef uint8_t ws_status;
 #define WS_SUCCESS 0
 
 
+// permessage-deflate (RFC 7692) settings, typically shared by all sockets.
+struct ws_deflate_struct {
+  // Accept a client's permessage-deflate offer
+  bool is_enabled;
+  // Our (server-to-client) LZ77 window, 9..15
+  int window_bits;
+  // Reset our compressor after every message, saves memory but not bytes
+  bool no_context_takeover;
+  // Send messages shorter than this uncompressed
+  size_t min_length;
+};
+typedef struct ws_deflate_struct *ws_deflate_t;
+
+
 struct ws_struct;
 typedef struct ws_struct *ws_t;
 ws_t ws_new();
@@ -64,9 +78,25 @@ struct ws_struct {
   ws_status (*send_close)(ws_t self, ws_close close_code,
           const char *reason);
 
+  // Whether whole messages may be sent out of order.  Not if we compress
+  // with context takeover, since each message's compression depends on
+  // the messages before it.
+  bool (*can_reorder)(ws_t self);
+
+  // Get the bytes held by our buffers and compression state.
+  size_t (*get_memory)(ws_t self);
+
   void *state;
   bool *is_debug;
 
+  // Optional, NULL to never negotiate compression
+  ws_deflate_t deflate;
+
+  // Call on_frame as each part of a data frame arrives, instead of once
+  // per frame.  The consumer can clear *to_keep to discard what it has
+  // seen, so a large message needn't be buffered.
+  bool is_streaming;
+
   //
   // Set these callbacks:
   //
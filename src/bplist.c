@@ -0,0 +1,440 @@
+// Google BSD license https://developers.google.com/google-bsd-license
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bplist.h"
+
+
+#define BP_MAGIC "bplist00"
+#define BP_MAGIC_LENGTH 8
+#define BP_TRAILER_LENGTH 32
+
+// object markers, see CFBinaryPList.c
+#define BP_FALSE  0x08
+#define BP_TRUE   0x09
+#define BP_INT    0x10
+#define BP_DATA   0x40
+#define BP_ASCII  0x50
+#define BP_UTF16  0x60
+#define BP_DICT   0xD0
+
+//
+// WRITE
+//
+
+bp_status bp_reserve(bp_t self, size_t needed) {
+  // cb_ensure_capacity may move our bytes, but not relative to out->head
+  return (cb_ensure_capacity(self->out, needed) ? BP_ERROR : BP_SUCCESS);
+}
+
+void bp_put_uint(char *to, uint64_t value, size_t num_bytes) {
+  size_t i;
+  for (i = num_bytes; i > 0; i--) {
+    to[i - 1] = (value & 0xFF);
+    value >>= 8;
+  }
+}
+
+// @result 1, 2, 4 or 8
+size_t bp_uint_size(uint64_t value) {
+  return (value <= 0xFF ? 1 : value <= 0xFFFF ? 2 :
+      value <= 0xFFFFFFFF ? 4 : 8);
+}
+
+// Start a new object, including its marker and length.
+// @result where the body should be written, or NULL for error
+char *bp_begin_object(bp_t self, uint8_t type, size_t length,
+    size_t body_length) {
+  if (self->num_objects >= BP_MAX_OBJECTS ||
+      bp_reserve(self, 10 + body_length)) {
+    return NULL;
+  }
+  self->offsets[self->num_objects++] = self->length;
+  char *tail = self->out->tail;
+  if (length < 15) {
+    *tail++ = (type | length);
+  } else {
+    // the length is an int object, e.g. 0x5F 0x10 0x2A for a 42-char string
+    size_t num_bytes = bp_uint_size(length);
+    *tail++ = (type | 0x0F);
+    *tail++ = (BP_INT | (num_bytes == 1 ? 0 : num_bytes == 2 ? 1 :
+          num_bytes == 4 ? 2 : 3));
+    bp_put_uint(tail, length, num_bytes);
+    tail += num_bytes;
+  }
+  self->length += (tail - self->out->tail);
+  self->out->tail = tail;
+  return tail;
+}
+
+void bp_end_object(bp_t self, size_t body_length) {
+  self->out->tail += body_length;
+  self->length += body_length;
+}
+
+bp_status bp_begin(bp_t self, const bp_t prefix) {
+  cb_t out = self->out;
+  size_t length = (prefix ? prefix->length : BP_MAGIC_LENGTH);
+  if (bp_reserve(self, length)) {
+    return BP_ERROR;
+  }
+  self->start = out->tail - out->head;
+  if (prefix) {
+    memcpy(out->tail, prefix->out->head + prefix->start, length);
+    memcpy(self->offsets, prefix->offsets,
+        prefix->num_objects * sizeof(size_t));
+    self->num_objects = prefix->num_objects;
+  } else {
+    memcpy(out->tail, BP_MAGIC, length);
+    self->num_objects = 0;
+  }
+  out->tail += length;
+  self->length = length;
+  return BP_SUCCESS;
+}
+
+bp_status bp_write_dict(bp_t self, size_t length, size_t first_ref) {
+  if (first_ref + 2 * length > BP_MAX_OBJECTS) {
+    return BP_ERROR;
+  }
+  char *body = bp_begin_object(self, BP_DICT, length, 2 * length);
+  if (!body) {
+    return BP_ERROR;
+  }
+  size_t i;
+  for (i = 0; i < 2 * length; i++) {
+    body[i] = (first_ref + i);
+  }
+  bp_end_object(self, 2 * length);
+  return BP_SUCCESS;
+}
+
+bp_status bp_write_string(bp_t self, const char *s) {
+  if (!s) {
+    return BP_ERROR;
+  }
+  const unsigned char *head = (const unsigned char *)s;
+  const unsigned char *tail = head;
+  size_t num_units = 0;  // in UTF-16
+  bool is_ascii = true;
+  while (*tail) {
+    unsigned char c = *tail;
+    size_t n = (c < 0x80 ? 1 : (c & 0xE0) == 0xC0 ? 2 :
+        (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 0);
+    if (!n) {
+      return BP_ERROR;
+    }
+    size_t i;
+    for (i = 1; i < n; i++) {
+      if ((tail[i] & 0xC0) != 0x80) {
+        return BP_ERROR;  // also catches a truncated '\0'
+      }
+    }
+    is_ascii &= (n == 1);
+    num_units += (n == 4 ? 2 : 1);
+    tail += n;
+  }
+  if (is_ascii) {
+    size_t length = tail - head;
+    char *body = bp_begin_object(self, BP_ASCII, length, length);
+    if (!body) {
+      return BP_ERROR;
+    }
+    memcpy(body, s, length);
+    bp_end_object(self, length);
+    return BP_SUCCESS;
+  }
+  char *body = bp_begin_object(self, BP_UTF16, num_units, 2 * num_units);
+  if (!body) {
+    return BP_ERROR;
+  }
+  char *to = body;
+  while (head < tail) {
+    uint32_t cp;
+    unsigned char c = *head;
+    if (c < 0x80) {
+      cp = c;
+      head += 1;
+    } else if ((c & 0xE0) == 0xC0) {
+      cp = ((c & 0x1F) << 6) | (head[1] & 0x3F);
+      head += 2;
+    } else if ((c & 0xF0) == 0xE0) {
+      cp = ((c & 0x0F) << 12) | ((head[1] & 0x3F) << 6) | (head[2] & 0x3F);
+      head += 3;
+    } else {
+      cp = ((c & 0x07) << 18) | ((head[1] & 0x3F) << 12) |
+        ((head[2] & 0x3F) << 6) | (head[3] & 0x3F);
+      head += 4;
+    }
+    if (cp >= 0x10000) {
+      // surrogate pair
+      cp -= 0x10000;
+      bp_put_uint(to, 0xD800 | (cp >> 10), 2);
+      bp_put_uint(to + 2, 0xDC00 | (cp & 0x3FF), 2);
+      to += 4;
+    } else {
+      bp_put_uint(to, cp, 2);
+      to += 2;
+    }
+  }
+  bp_end_object(self, 2 * num_units);
+  return BP_SUCCESS;
+}
+
+bp_status bp_write_uint(bp_t self, uint64_t value) {
+  if (self->num_objects >= BP_MAX_OBJECTS || bp_reserve(self, 9)) {
+    return BP_ERROR;
+  }
+  // 8-byte ints are signed, so larger values would need 16 bytes
+  if (value > INT64_MAX) {
+    return BP_ERROR;
+  }
+  self->offsets[self->num_objects++] = self->length;
+  size_t num_bytes = bp_uint_size(value);
+  char *tail = self->out->tail;
+  *tail++ = (BP_INT | (num_bytes == 1 ? 0 : num_bytes == 2 ? 1 :
+        num_bytes == 4 ? 2 : 3));
+  bp_put_uint(tail, value, num_bytes);
+  self->out->tail = tail + num_bytes;
+  self->length += 1 + num_bytes;
+  return BP_SUCCESS;
+}
+
+bp_status bp_write_bool(bp_t self, bool value) {
+  if (self->num_objects >= BP_MAX_OBJECTS || bp_reserve(self, 1)) {
+    return BP_ERROR;
+  }
+  self->offsets[self->num_objects++] = self->length;
+  *self->out->tail++ = (value ? BP_TRUE : BP_FALSE);
+  self->length++;
+  return BP_SUCCESS;
+}
+
+bp_status bp_write_data(bp_t self, const char *data, size_t length) {
+  char *body = bp_begin_object(self, BP_DATA, length, (data ? length : 0));
+  if (!body) {
+    return BP_ERROR;
+  }
+  if (data) {
+    memcpy(body, data, length);
+    bp_end_object(self, length);
+  } else {
+    self->length += length;
+  }
+  return BP_SUCCESS;
+}
+
+bp_status bp_end(bp_t self, size_t top_ref) {
+  size_t num_objects = self->num_objects;
+  if (top_ref >= num_objects) {
+    return BP_ERROR;
+  }
+  size_t table_offset = self->length;
+  size_t offset_size = bp_uint_size(table_offset);
+  size_t length = num_objects * offset_size + BP_TRAILER_LENGTH;
+  if (bp_reserve(self, length)) {
+    return BP_ERROR;
+  }
+  char *tail = self->out->tail;
+  size_t i;
+  for (i = 0; i < num_objects; i++) {
+    bp_put_uint(tail, self->offsets[i], offset_size);
+    tail += offset_size;
+  }
+  memset(tail, 0, 6);  // unused, sort version
+  tail[6] = offset_size;
+  tail[7] = 1;  // object ref size
+  bp_put_uint(tail + 8, num_objects, 8);
+  bp_put_uint(tail + 16, top_ref, 8);
+  bp_put_uint(tail + 24, table_offset, 8);
+  self->out->tail = tail + BP_TRAILER_LENGTH;
+  self->length += length;
+  return BP_SUCCESS;
+}
+
+//
+// READ
+//
+
+uint64_t bp_get_uint(const char *from, size_t num_bytes) {
+  uint64_t ret = 0;
+  size_t i;
+  for (i = 0; i < num_bytes; i++) {
+    ret = (ret << 8) | (unsigned char)from[i];
+  }
+  return ret;
+}
+
+bp_status bp_read(bp_reader_t self, const char *buf, size_t length) {
+  memset(self, 0, sizeof(struct bp_reader_struct));
+  if (!buf || length < BP_MAGIC_LENGTH + BP_TRAILER_LENGTH ||
+      memcmp(buf, BP_MAGIC, BP_MAGIC_LENGTH - 1)) {  // any "bplist0?"
+    return BP_ERROR;
+  }
+  const char *trailer = buf + length - BP_TRAILER_LENGTH;
+  uint8_t offset_size = trailer[6];
+  uint8_t ref_size = trailer[7];
+  uint64_t num_objects = bp_get_uint(trailer + 8, 8);
+  uint64_t top_ref = bp_get_uint(trailer + 16, 8);
+  uint64_t table_offset = bp_get_uint(trailer + 24, 8);
+  size_t max_table_offset = length - BP_TRAILER_LENGTH;
+  if (offset_size < 1 || offset_size > 8 ||
+      ref_size < 1 || ref_size > 8 ||
+      top_ref >= num_objects ||
+      table_offset < BP_MAGIC_LENGTH || table_offset > max_table_offset ||
+      num_objects > (max_table_offset - table_offset) / offset_size) {
+    return BP_ERROR;
+  }
+  self->buf = buf;
+  self->length = length;
+  self->top_ref = top_ref;
+  self->offset_size = offset_size;
+  self->ref_size = ref_size;
+  self->num_objects = num_objects;
+  self->table_offset = table_offset;
+  return BP_SUCCESS;
+}
+
+// Find an object's marker, length and body.
+// @param to_length the count from the marker, e.g. number of dict entries
+bp_status bp_read_object(bp_reader_t self, uint64_t ref,
+    uint8_t *to_type, uint64_t *to_length, const char **to_body) {
+  if (ref >= self->num_objects) {
+    return BP_ERROR;
+  }
+  uint64_t offset = bp_get_uint(self->buf + self->table_offset +
+      ref * self->offset_size, self->offset_size);
+  if (offset < BP_MAGIC_LENGTH || offset >= self->table_offset) {
+    return BP_ERROR;
+  }
+  const char *head = self->buf + offset;
+  const char *tail = self->buf + self->table_offset;
+  uint8_t marker = *head++;
+  uint64_t length = (marker & 0x0F);
+  if (length == 0x0F && (marker & 0xF0) != BP_INT) {
+    // the length is an int object
+    if (head >= tail || (*head & 0xF0) != BP_INT || (*head & 0x0F) > 3) {
+      return BP_ERROR;
+    }
+    size_t num_bytes = (1 << (*head++ & 0x0F));
+    if (num_bytes > (size_t)(tail - head)) {
+      return BP_ERROR;
+    }
+    length = bp_get_uint(head, num_bytes);
+    head += num_bytes;
+  }
+  *to_type = (marker & 0xF0);
+  *to_length = length;
+  *to_body = head;
+  return BP_SUCCESS;
+}
+
+// Get a string or data object's bytes.
+bp_status bp_read_bytes(bp_reader_t self, uint64_t ref, uint8_t type,
+    const char **to_bytes, size_t *to_length) {
+  uint8_t t;
+  uint64_t length;
+  const char *body;
+  if (bp_read_object(self, ref, &t, &length, &body) || t != type) {
+    return BP_ERROR;
+  }
+  uint64_t num_bytes = (type == BP_UTF16 ? 2 * length : length);
+  if (length > self->length ||
+      num_bytes > (uint64_t)(self->buf + self->table_offset - body)) {
+    return BP_ERROR;
+  }
+  *to_bytes = body;
+  *to_length = (size_t)num_bytes;
+  return BP_SUCCESS;
+}
+
+bool bp_is_key(bp_reader_t self, uint64_t ref, const char *key,
+    size_t key_length) {
+  const char *s;
+  size_t length;
+  if (!bp_read_bytes(self, ref, BP_ASCII, &s, &length)) {
+    return (length == key_length && !memcmp(s, key, length));
+  }
+  // the device could, in theory, write an ASCII key as UTF-16
+  if (!bp_read_bytes(self, ref, BP_UTF16, &s, &length) &&
+      length == 2 * key_length) {
+    size_t i;
+    for (i = 0; i < key_length; i++) {
+      if (s[2 * i] || s[2 * i + 1] != key[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+  return false;
+}
+
+bp_status bp_read_dict_item(bp_reader_t self, uint64_t dict_ref,
+    const char *key, uint64_t *to_ref) {
+  uint8_t type;
+  uint64_t length;
+  const char *body;
+  if (!key || !to_ref ||
+      bp_read_object(self, dict_ref, &type, &length, &body) ||
+      type != BP_DICT ||
+      length > (uint64_t)(self->buf + self->table_offset - body) /
+        (2 * self->ref_size)) {
+    return BP_ERROR;
+  }
+  size_t key_length = strlen(key);
+  size_t ref_size = self->ref_size;
+  const char *value_refs = body + length * ref_size;
+  uint64_t i;
+  for (i = 0; i < length; i++) {
+    uint64_t key_ref = bp_get_uint(body + i * ref_size, ref_size);
+    if (bp_is_key(self, key_ref, key, key_length)) {
+      *to_ref = bp_get_uint(value_refs + i * ref_size, ref_size);
+      return BP_SUCCESS;
+    }
+  }
+  return BP_ERROR;
+}
+
+bp_status bp_read_ascii(bp_reader_t self, uint64_t ref,
+    const char **to_s, size_t *to_length) {
+  return bp_read_bytes(self, ref, BP_ASCII, to_s, to_length);
+}
+
+bp_status bp_read_data(bp_reader_t self, uint64_t ref,
+    const char **to_data, size_t *to_length) {
+  return bp_read_bytes(self, ref, BP_DATA, to_data, to_length);
+}
+
+//
+// STRUCTS
+//
+
+void bp_free(bp_t self) {
+  if (self) {
+    cb_free(self->out);
+    memset(self, 0, sizeof(struct bp_struct));
+    free(self);
+  }
+}
+
+bp_t bp_new() {
+  bp_t self = (bp_t)malloc(sizeof(struct bp_struct));
+  if (!self) {
+    return NULL;
+  }
+  memset(self, 0, sizeof(struct bp_struct));
+  self->out = cb_new();
+  if (!self->out) {
+    bp_free(self);
+    return NULL;
+  }
+  self->out->tag = MB_RPC;
+  return self;
+}
@@ -0,0 +1,126 @@
+// Google BSD license https://developers.google.com/google-bsd-license
+
+//
+// A binary plist ("bplist00") writer for our small, fixed-shape RPC
+// messages, which lets us serialize straight into an output buffer
+// instead of building a plist_t tree and calling plist_to_bin.
+//
+// Also a lazy reader, which finds objects via the offset table on demand
+// and returns strings and data as slices of the input buffer, so we can
+// pick a few fields out of a message without plist_from_bin.
+//
+// Objects are numbered in the order that they're written, starting at 0,
+// and a dict refers to its keys and values by number, so the caller
+// decides the numbering up front, e.g. to write {"a": 1, "b": true}:
+//    bp_begin(bp, NULL);
+//    bp_write_dict(bp, 2, 1);    // 0: keys are #1..2, values are #3..4
+//    bp_write_string(bp, "a");   // 1
+//    bp_write_string(bp, "b");   // 2
+//    bp_write_uint(bp, 1);       // 3
+//    bp_write_bool(bp, true);    // 4
+//    bp_end(bp, 0);
+//
+
+#ifndef BPLIST_H
+#define	BPLIST_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "char_buffer.h"
+
+
+typedef uint8_t bp_status;
+#define BP_ERROR 1
+#define BP_SUCCESS 0
+
+// We only write one-byte object refs
+#define BP_MAX_OBJECTS 255
+
+struct bp_struct;
+typedef struct bp_struct *bp_t;
+bp_t bp_new();
+void bp_free(bp_t self);
+
+struct bp_struct {
+  // Output buffer, which may hold other data before and after our bplist.
+  cb_t out;
+
+  // For internal use only:
+  size_t start;   // our "bplist00", relative to out->head
+  size_t length;  // our length so far, including external data
+  size_t num_objects;
+  size_t offsets[BP_MAX_OBJECTS];
+};
+
+// Start a new bplist at the end of our output buffer.
+// @param prefix optional unfinished bplist to copy, e.g. a cached
+//   message header
+bp_status bp_begin(bp_t self, const bp_t prefix);
+
+// Write a dict with keys #first_ref..(first_ref+length-1) and values
+// #(first_ref+length)..(first_ref+2*length-1).
+bp_status bp_write_dict(bp_t self, size_t length, size_t first_ref);
+
+// Write a UTF-8 string, as ASCII or UTF-16 as needed.
+bp_status bp_write_string(bp_t self, const char *s);
+
+bp_status bp_write_uint(bp_t self, uint64_t value);
+
+bp_status bp_write_bool(bp_t self, bool value);
+
+// Write a data object.
+// @param data the bytes to copy, or NULL to leave them out of our output
+//   buffer, in which case the caller must send them between the bytes
+//   written before and after this call.  External data must be the last
+//   object.
+bp_status bp_write_data(bp_t self, const char *data, size_t length);
+
+// Write the offset table and trailer.
+bp_status bp_end(bp_t self, size_t top_ref);
+
+
+// A lazy reader over a caller-owned buffer, typically on the stack.
+struct bp_reader_struct {
+  const char *buf;
+  size_t length;
+
+  // the root object
+  uint64_t top_ref;
+
+  // For internal use only:
+  uint8_t offset_size;
+  uint8_t ref_size;
+  uint64_t num_objects;
+  size_t table_offset;
+};
+typedef struct bp_reader_struct *bp_reader_t;
+
+// Check the header and trailer.  Nothing is copied, so buf must outlive
+// the reader.
+bp_status bp_read(bp_reader_t self, const char *buf, size_t length);
+
+// Find a dict's value.
+// @param key an ASCII key
+bp_status bp_read_dict_item(bp_reader_t self, uint64_t dict_ref,
+    const char *key, uint64_t *to_ref);
+
+// Get an ASCII string, which is not '\0'-terminated.  Fails for UTF-16
+// strings, in which case the caller can fall back to plist_from_bin.
+bp_status bp_read_ascii(bp_reader_t self, uint64_t ref,
+    const char **to_s, size_t *to_length);
+
+bp_status bp_read_data(bp_reader_t self, uint64_t ref,
+    const char **to_data, size_t *to_length);
+
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* BPLIST_H */
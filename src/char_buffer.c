@@ -25,6 +25,7 @@ cb_t cb_new() {
 void cb_free(cb_t self) {
   if (self) {
     if (self->begin) {
+      mb_remove(self->tag, self->end - self->begin);
       free(self->begin);
     }
     free(self);
@@ -47,6 +48,7 @@ int cb_ensure_capacity(cb_t self, size_t needed) {
     self->head = self->begin;
     self->tail = self->begin;
     self->end = self->begin + length;
+    mb_add(self->tag, length);
     return 0;
   }
   size_t used = self->tail - self->head;
@@ -77,6 +79,7 @@ int cb_ensure_capacity(cb_t self, size_t needed) {
         perror("Unable to resize buffer");
         return -1;
       }
+      mb_add(self->tag, new_length - length);
       self->begin = new_begin;
       self->head = new_begin;
       self->tail = new_begin + used;
@@ -86,10 +89,24 @@ int cb_ensure_capacity(cb_t self, size_t needed) {
   return 0;
 }
 
+size_t cb_get_capacity(cb_t self) {
+  return (self->begin ? self->end - self->begin : 0);
+}
+
 int cb_begin_input(cb_t self, const char *buf, ssize_t length) {
   if (!buf || length < 0) {
     return -1;
   }
+  if (self->begin && buf == self->tail) {
+    // the caller recv'd straight into our free space
+    if (length > self->end - self->tail) {
+      return -1;
+    }
+    self->tail += length;
+    self->in_head = self->head;
+    self->in_tail = self->tail;
+    return 0;
+  }
   // Instead of always doing a memcpy into our buffer, see if we can
   // use the buf as-is
   int can_share = (!self->begin || self->tail == self->head);
@@ -11,6 +11,7 @@ extern "C" {
 
 #include <stdlib.h>
 
+#include "memory_budget.h"
 
 struct cb_struct {
   char *begin;
@@ -20,6 +21,9 @@ struct cb_struct {
 
   const char *in_head;
   const char *in_tail;
+
+  // who to charge for our memory, set before our first use
+  mb_tag tag;
 };
 typedef struct cb_struct *cb_t;
 
@@ -31,12 +35,17 @@ void cb_clear(cb_t buffer);
 
 int cb_ensure_capacity(cb_t self, size_t needed);
 
+size_t cb_get_capacity(cb_t self);
+
 // Instead of copying our input into our my->in, e.g.:
 //    cb_ensure_capacity(my->in, length);
 //    memcpy(my->in->tail, buf, length);
 //    my->in->tail += length;
 // we'll avoid the memcpy, if possible.  The shared pointer is
 // "my->in_head".
+//
+// If buf is our tail, e.g. the caller did a cb_ensure_capacity and then
+// recv'd into my->in->tail, we'll simply take the bytes.
 int cb_begin_input(cb_t self, const char *buf, ssize_t length);
 
 int cb_end_input(cb_t self);
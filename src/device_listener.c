@@ -44,6 +44,10 @@
 #define TYPE_PLIST 8
 #define LIBUSBMUX_VERSION 3
 
+// usbmuxd's messages are small plists, so a longer length is a bad packet,
+// which we mustn't allocate for
+#define DL_MAX_BODY_LENGTH (1 << 20)
+
 struct dl_private {
   cb_t in;
   ht_t device_num_to_device_id;
@@ -292,6 +296,12 @@ dl_status dl_recv_loop(dl_t self) {
     if (!my->has_length && in_length >= 4) {
       // can read body_length now
       size_t len = dl_sscanf_uint32(in_head);
+      if (len > DL_MAX_BODY_LENGTH) {
+        fprintf(stderr, "device_listener: invalid packet length %zu\n",
+            len);
+        ret = DL_ERROR;
+        break;
+      }
       my->body_length = len;
       my->has_length = true;
       // don't advance in_head yet
@@ -331,6 +341,26 @@ dl_status dl_on_recv(dl_t self, const char *buf, ssize_t length) {
   return ret;
 }
 
+dl_status dl_on_recv_buffer(dl_t self, char **to_buf, size_t *to_length) {
+  dl_private_t my = self->private_state;
+  *to_buf = NULL;
+  *to_length = 0;
+  size_t in_length = my->in->tail - my->in->head;
+  if (!my->has_length || my->body_length <= in_length) {
+    return DL_SUCCESS;
+  }
+  if (my->body_length > DL_MAX_BODY_LENGTH) {
+    return DL_ERROR;
+  }
+  // the usbmuxd length includes the header, which is in our buffer
+  size_t needed = my->body_length - in_length;
+  if (cb_ensure_capacity(my->in, needed)) {
+    return DL_ERROR;
+  }
+  *to_buf = my->in->tail;
+  *to_length = needed;
+  return DL_SUCCESS;
+}
 
 dl_t dl_new() {
   dl_t self = (dl_t)malloc(sizeof(struct dl_struct));
@@ -347,6 +377,7 @@ dl_t dl_new() {
   memset(my, 0, sizeof(struct dl_private));
   self->start = dl_start;
   self->on_recv = dl_on_recv;
+  self->on_recv_buffer = dl_on_recv_buffer;
   self->private_state = my;
   my->in = in;
   my->device_num_to_device_id = d_ht;
@@ -2,7 +2,7 @@
 // Copyright 2012 Google Inc. wrightt@google.com
 
 //
-// A basic hash table, could be easily enhanced...
+// A basic chained hash table, which doubles its buckets as it fills.
 //
 
 #ifdef HAVE_CONFIG_H
@@ -14,8 +14,10 @@
 
 #include "hash_table.h"
 
-// constant for now, but we could easily resize & rehash
+// initial size, kept small since most of our tables hold a few keys
 #define NUM_BUCKETS 3
+// average chain length at which we grow
+#define MAX_LOAD 2
 
 struct ht_entry_struct {
   intptr_t hc;
@@ -26,15 +28,16 @@ struct ht_entry_struct {
 
 
 intptr_t on_strhash(ht_t ht, const void *key) {
-  int hc = 0;
-  char *s = (char *)key;
+  // unsigned, since signed overflow is undefined
+  uintptr_t hc = 0;
+  const unsigned char *s = (const unsigned char *)key;
   if (s) {
-    int ch;
+    unsigned char ch;
     while ((ch = *s++)) {
       hc = ((hc << 5) + hc) ^ ch;
     }
   }
-  return hc;
+  return (intptr_t)hc;
 }
 intptr_t on_strcmp(ht_t ht, const void *key1, const void *key2) {
   if (key1 == key2 || !key1 || !key2) {
@@ -89,7 +92,7 @@ size_t ht_size(ht_t self) {
 void ht_find(ht_t self, const void *key, intptr_t *to_hc,
     ht_entry_t **to_head, ht_entry_t *to_prev, ht_entry_t *to_curr) {
   intptr_t hc = (self->on_hash ? self->on_hash(self, key) : (intptr_t)key);
-  ht_entry_t *head = self->buckets + (hc % self->num_buckets);
+  ht_entry_t *head = self->buckets + ((uintptr_t)hc % self->num_buckets);
   ht_entry_t prev = NULL;
   ht_entry_t curr = *head;
   for (; curr && !(curr->hc == hc &&
@@ -153,6 +156,31 @@ void *ht_remove(ht_t self, const void *key) {
   return ret;
 }
 
+// Rehash into twice as many buckets, or leave the table as-is if we're
+// out of memory.
+void ht_grow(ht_t self) {
+  size_t num_buckets = 2 * self->num_buckets + 1;
+  ht_entry_t *buckets = (ht_entry_t *)calloc(num_buckets,
+      sizeof(ht_entry_t));
+  if (!buckets) {
+    return;
+  }
+  size_t i;
+  for (i = 0; i < self->num_buckets; i++) {
+    ht_entry_t curr = self->buckets[i];
+    while (curr) {
+      ht_entry_t next = curr->next;
+      ht_entry_t *head = buckets + ((uintptr_t)curr->hc % num_buckets);
+      curr->next = *head;
+      *head = curr;
+      curr = next;
+    }
+  }
+  free(self->buckets);
+  self->buckets = buckets;
+  self->num_buckets = num_buckets;
+}
+
 void *ht_put(ht_t self, void *key, void *value) {
   ht_entry_t *head;
   ht_entry_t prev;
@@ -182,6 +210,9 @@ void *ht_put(ht_t self, void *key, void *value) {
     curr->next = *head;
     *head = curr;
     self->num_keys++;
+    if (self->num_keys > MAX_LOAD * self->num_buckets) {
+      ht_grow(self);
+    }
   }
   return ret;
 }
@@ -6,6 +6,7 @@
 #endif
 
 #define _GNU_SOURCE
+#include <ctype.h>
 #include <errno.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -15,13 +16,22 @@
 #include <string.h>
 #include <sys/fcntl.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef WIN32
+#include <windows.h>
+#endif
 
 #include "char_buffer.h"
 #include "device_listener.h"
 #include "hash_table.h"
 #include "ios_webkit_debug_proxy.h"
+#include "json_scan.h"
+#include "json_writer.h"
+#include "replay_cache.h"
+#include "memory_budget.h"
 #include "rpc.h"
+#include "socket_manager.h"
 #include "webinspector.h"
 #include "websocket.h"
 #include "strndup.h"
@@ -49,6 +59,18 @@ struct iwdp_private {
 #define TYPE_IWS   4
 #define TYPE_IFS   5
 
+// Re-send a forwardGetListing that the device hasn't answered in this long
+#define IWDP_LISTING_TIMEOUT_MILLIS 3000
+
+// Give an idle client's close frame this long to go out before we close,
+// checking every IWDP_CLOSE_POLL_MILLIS
+#define IWDP_CLOSE_MILLIS 2000
+#define IWDP_CLOSE_POLL_MILLIS 50
+
+// The id of our own commands to the device, e.g. a dropped screencast
+// frame's ack, whose responses aren't for our clients
+#define IWDP_ACK_ID -1
+
 /*!
  * Struct type id, for iwdp_on_recv/etc "switch" use.
  *
@@ -75,6 +97,27 @@ void iwdp_idl_free(iwdp_idl_t idl);
 struct iwdp_iwi_struct;
 typedef struct iwdp_iwi_struct *iwdp_iwi_t;
 
+struct iwdp_iapp_struct;
+typedef struct iwdp_iapp_struct *iwdp_iapp_t;
+
+// Cache at most this many "/" and "/json" responses per port, e.g. for a
+// few different Host headers
+#define IWDP_MAX_LIST_CACHE 4
+
+/*!
+ * A rendered "/" or "/json" response, see iwdp_on_list_request.
+ */
+struct iwdp_list_cache_struct {
+  bool want_json;
+  char *host;        // our urls include the request's Host, which may be NULL
+  uint32_t version;  // iport->list_version when we rendered our content
+  cb_t content;      // NULL until rendered
+  char etag[32];
+  struct iwdp_list_cache_struct *next;
+};
+typedef struct iwdp_list_cache_struct *iwdp_list_cache_t;
+void iwdp_list_cache_free(iwdp_list_cache_t cache);
+
 /*!
  * browser listener.
  */
@@ -101,13 +144,28 @@ struct iwdp_iport_struct {
 
   // null if the device is detached
   iwdp_iwi_t iwi;
+
+  // our rendered page (or device) lists, most recently used first, which
+  // are stale unless their version matches our list_version, see
+  // iwdp_invalidate_list
+  iwdp_list_cache_t list_cache;
+  uint32_t list_version;
+
+  // how many of our clients are /json/stream subscribers, so we can skip
+  // rendering changes that nobody wants, see iwdp_on_stream_request
+  size_t num_streams;
 };
 
 typedef struct iwdp_iport_struct *iwdp_iport_t;
 iwdp_iport_t iwdp_iport_new();
 void iwdp_iport_free(iwdp_iport_t iport);
-char *iwdp_iports_to_text(iwdp_iport_t *iports, bool want_json,
+int iwdp_iports_to_text(cb_t out, iwdp_iport_t *iports, bool want_json,
     const char *host);
+int iwdp_iport_to_json(cb_t out, iwdp_iport_t iport, const char *host);
+char *iwdp_memory_to_json(iwdp_t self, iwdp_iport_t iport);
+void iwdp_invalidate_list(iwdp_iport_t iport);
+void iwdp_invalidate_devices(iwdp_t self);
+void iwdp_notify_device(iwdp_t self, const char *type, iwdp_iport_t iport);
 
 /*!
  * WebInpsector.
@@ -122,12 +180,16 @@ struct iwdp_iwi_struct {
   char *connection_id;
 
   rpc_t rpc;  // plist parser
-  rpc_app_t app;
 
   bool connected;
   uint32_t max_page_num; // > 0
-  ht_t app_id_to_true;   // set of app_ids
+  uint32_t max_listing_num;
+  ht_t app_id_to_iapp;  // key owned by iapp->app_id
+  iwdp_iapp_t last_iapp;  // most recently connected, or NULL
+  int listing_timer_id;   // pending iwdp_send_listings, or 0
+  uint64_t listing_due_millis;
   ht_t page_num_to_ipage;
+  ht_t sender_id_to_ipage;  // shared pages, key owned by ipage->sender_id
 };
 
 iwdp_iwi_t iwdp_iwi_new(bool partials_supported, bool *is_debug);
@@ -162,9 +224,48 @@ struct iwdp_iws_struct {
   // page away and set ipage == NULL, but we keep our page_num so we can report
   // a useful error.
   iwdp_ipage_t ipage; // owner is iwi->page_num_to_ipage
+  //
+  // In multi_client mode, we're instead one of ipage->clients.
+
+  // in multi_client mode, the domains that our client has enabled, e.g.
+  // "Debugger", see iwdp_ipage_send_command
+  ht_t enabled_domains;  // keys owned, each key is also its value
 
   // set if the resource is /devtools/<non-page>
   iwdp_ifs_t ifs;
+
+  // keepalive, see iwdp_iws_keepalive
+  bool is_websocket;        // upgraded, so we can ping
+  int timer_id;             // pending add_timer, or 0
+  uint64_t recv_millis;     // last input from the client
+  uint64_t message_millis;  // last message to or from the client
+  uint64_t ping_millis;     // our unanswered ping, or 0
+  uint64_t close_millis;    // deadline to flush our close frame, or 0
+
+  // for the frame that we're sending, see iwdp_iws_send_text
+  iwdp_send_flags send_flags;
+
+  // events that we've dropped for a slow client, see iwdp_iws_drop
+  size_t num_sampled;
+  size_t num_dropped;
+
+  // comma-separated event methods or "Domain.*" patterns that our client
+  // wants, or NULL for all events, see iwdp_iws_set_events
+  char *events;
+
+  // remote (e.g. VPN) client, whose events we hold for a moment and send
+  // together, see iwdp_iws_batch
+  bool is_remote;
+  struct iwdp_batch_struct *batch;  // held events, oldest first
+  size_t num_batch;
+  size_t max_batch;
+  size_t batch_length;  // bytes held
+  int batch_timer_id;   // pending flush, or 0
+  cb_t batch_out;       // framed output, set while we flush
+
+  // set if the resource is /json/stream, see iwdp_on_stream_request
+  bool is_stream;
+  char *stream_host;  // the request's Host, for our urls, or NULL
 };
 typedef struct iwdp_iws_struct *iwdp_iws_t;
 iwdp_iws_t iwdp_iws_new(bool *is_debug);
@@ -185,6 +286,25 @@ iwdp_ifs_t iwdp_ifs_new();
 void iwdp_ifs_free(iwdp_ifs_t ifs);
 
 
+/*!
+ * Inspectable app, e.g. Safari or a WebContent process.
+ */
+struct iwdp_iapp_struct {
+  char *app_id;
+
+  // forwardGetListing state, see iwdp_request_listing
+  bool is_listing_wanted;   // to send once iwi->listing_timer_id fires
+  uint64_t listing_millis;  // our unanswered request, or 0
+
+  // page_id to ipage, so a listing can find its pages without a scan.
+  // The ipages are owned by iwi->page_num_to_ipage.
+  ht_t page_id_to_ipage;
+};
+
+iwdp_iapp_t iwdp_iapp_new(const char *app_id);
+void iwdp_iapp_free(iwdp_iapp_t iapp);
+
+
 // page info
 struct iwdp_ipage_struct {
   // browser
@@ -198,15 +318,64 @@ struct iwdp_ipage_struct {
   char *url;
   char *sender_id;
 
+  // the last listing that included this page, see
+  // iwdp_on_applicationSentListing
+  uint32_t listing_num;
+
   // set if being inspected, limit one client per page
   // owner is iport->ws_id_to_iws
   iwdp_iws_t iws;
+
+  // or, in multi_client mode, our clients, which share our sender_id's
+  // session with the device, see iwdp_join_devtools
+  iwdp_iws_t *clients;
+  size_t num_clients;
+  size_t max_clients;
+
+  // the ids that we've given our clients' commands, to the client and id
+  // to answer, see iwdp_ipage_send_command
+  uint32_t max_command_id;
+  ht_t command_id_to_route;
+
+  // the session's scripts, etc, for a client that joins later, or NULL
+  rc_t replay;
+
+  // screencast frames that the device wants acked once, after all of the
+  // clients that we sent them to have acked or dropped them, see
+  // iwdp_ipage_on_frame_ack
+  ht_t session_id_to_frame;
+};
+
+/*!
+ * A shared page's command, whose response goes back to one client.
+ */
+struct iwdp_route_struct {
+  iwdp_iws_t iws;
+  char *id;  // the client's id, as JSON, e.g. 5 or "abc"
+};
+typedef struct iwdp_route_struct *iwdp_route_t;
+void iwdp_route_free(iwdp_route_t route);
+
+/*!
+ * A shared page's unacked screencast frame.
+ */
+struct iwdp_frame_struct {
+  int session_id;
+  iwdp_iws_t *clients;  // yet to ack or drop it
+  size_t num_clients;
 };
+typedef struct iwdp_frame_struct *iwdp_frame_t;
+void iwdp_frame_free(iwdp_frame_t frame);
 
 iwdp_ipage_t iwdp_ipage_new();
 void iwdp_ipage_free(iwdp_ipage_t ipage);
+size_t iwdp_ipage_get_memory(iwdp_ipage_t ipage);
 int iwdp_ipage_cmp(const void *a, const void *b);
-char *iwdp_ipages_to_text(iwdp_ipage_t *ipages, bool want_json,
+int iwdp_ipage_to_json(cb_t out, iwdp_ipage_t ipage,
+    const char *frontend_url, const char *host, int port);
+void iwdp_notify_page(iwdp_iport_t iport, const char *type,
+    iwdp_ipage_t ipage);
+int iwdp_ipages_to_text(cb_t out, iwdp_ipage_t *ipages, bool want_json,
     const char *device_id, const char *device_name,
     const char *frontend_url, const char *host, int port);
 
@@ -226,7 +395,23 @@ iwdp_status iwdp_get_content_type(const char *path, bool is_local,
 
 ws_status iwdp_start_devtools(iwdp_ipage_t ipage, iwdp_iws_t iws);
 ws_status iwdp_stop_devtools(iwdp_ipage_t ipage);
-
+ws_status iwdp_join_devtools(iwdp_ipage_t ipage, iwdp_iws_t iws);
+void iwdp_leave_devtools(iwdp_ipage_t ipage, iwdp_iws_t iws);
+ws_status iwdp_ipage_send_command(iwdp_t self, iwdp_ipage_t ipage,
+    iwdp_iws_t iws, const char *data, size_t length);
+rpc_status iwdp_iws_send_data(iwdp_t self, iwdp_iws_t iws,
+    const char *data, size_t length, bool is_response,
+    const char *method, size_t method_length);
+
+iwdp_status iwdp_iws_keepalive(iwdp_t self, iwdp_iws_t iws);
+ws_status iwdp_iws_send_text(iwdp_t self, iwdp_iws_t iws,
+    const char *data, size_t length, bool is_priority);
+ws_status iwdp_iws_flush(iwdp_t self, iwdp_iws_t iws);
+iwdp_status iwdp_send_listings(iwdp_t self, iwdp_iwi_t iwi);
+bool iwdp_get_header(const char *headers, size_t headers_length,
+    const char *name, const char **to_value, size_t *to_length);
+
+// @result 1 if changed, 0 if the same, or -1 if out of memory
 int iwdp_update_string(char **old_value, const char *new_value);
 
 //
@@ -336,6 +521,7 @@ dl_status iwdp_listen(iwdp_t self, const char *device_id) {
   if (!device_id) {
     iwdp_log_connect(iport);
   }
+  iwdp_invalidate_devices(self);
   return DL_SUCCESS;
 }
 
@@ -344,6 +530,7 @@ iwdp_status iwdp_start(iwdp_t self) {
   if (my->idl) {
     return self->on_error(self, "Already started?");
   }
+  mb_set_limit(self->max_memory);
 
   if (iwdp_listen(self, NULL)) {
     // Okay, keep going
@@ -378,7 +565,7 @@ dl_status iwdp_send_to_dl(dl_t dl, const char *buf, size_t length) {
   iwdp_idl_t idl = (iwdp_idl_t)dl->state;
   iwdp_t self = idl->self;
   int dl_fd = idl->dl_fd;
-  return self->send(self, dl_fd, buf, length);
+  return self->send(self, dl_fd, buf, length, 0);
 }
 
 dl_status iwdp_on_attach(dl_t dl, const char *device_id, int device_num) {
@@ -437,7 +624,11 @@ dl_status iwdp_on_attach(dl_t dl, const char *device_id, int device_num) {
   iwdp_iwi_t iwi = iwdp_iwi_new(!is_sim && device_os_version < 0xb0000,
       self->is_debug);
   iwi->iport = iport;
+  iwi->wi->spill_length = self->spill_length;
   iport->iwi = iwi;
+  iwdp_invalidate_list(iport);
+  iwdp_invalidate_devices(self);
+  iwdp_notify_device(self, "add", iport);
   if (self->add_fd(self, wi_fd, ssl_session, iwi, false)) {
     self->remove_fd(self, iport->s_fd);
     return self->on_error(self, "add_fd wi_fd=%d failed", wi_fd);
@@ -477,12 +668,18 @@ dl_status iwdp_on_detach(dl_t dl, const char *device_id, int device_num) {
 iwdp_status iwdp_iport_accept(iwdp_t self, iwdp_iport_t iport, int ws_fd,
     iwdp_iws_t *to_iws) {
   iwdp_iws_t iws = iwdp_iws_new(self->is_debug);
+  if (!iws) {
+    return self->on_error(self, "Out of memory");
+  }
+  iws->ws->deflate = self->ws_deflate;
   iws->iport = iport;
   iws->ws_fd = ws_fd;
   rpc_new_uuid(&iws->ws_id);
   ht_put(iport->ws_id_to_iws, iws->ws_id, iws);
   *to_iws = iws;
-  return IWDP_SUCCESS;
+  iws->recv_millis = sm_now_millis();
+  iws->message_millis = iws->recv_millis;
+  return iwdp_iws_keepalive(self, iws);
 }
 
 iwdp_status iwdp_on_accept(iwdp_t self, int s_fd, void *value,
@@ -496,6 +693,26 @@ iwdp_status iwdp_on_accept(iwdp_t self, int s_fd, void *value,
   }
 }
 
+iwdp_status iwdp_on_recv_buffer(iwdp_t self, int fd, void *value,
+    char **to_buf, size_t *to_length) {
+  int type = ((iwdp_type_t)value)->type;
+  switch (type) {
+    case TYPE_IDL:
+      {
+        dl_t dl = ((iwdp_idl_t)value)->dl;
+        return dl->on_recv_buffer(dl, to_buf, to_length);
+      }
+    case TYPE_IWI:
+      {
+        wi_t wi = ((iwdp_iwi_t)value)->wi;
+        return wi->on_recv_buffer(wi, to_buf, to_length);
+      }
+    default:
+      // websocket and static file data is streamed, use the shared buffer
+      return IWDP_SUCCESS;
+  }
+}
+
 iwdp_status iwdp_on_recv(iwdp_t self, int fd, void *value,
     const char *buf, ssize_t length) {
   int type = ((iwdp_type_t)value)->type;
@@ -512,13 +729,20 @@ iwdp_status iwdp_on_recv(iwdp_t self, int fd, void *value,
       }
     case TYPE_IWS:
       {
-        ws_t ws = ((iwdp_iws_t)value)->ws;
-        return ws->on_recv(ws, buf, length);
+        iwdp_iws_t iws = (iwdp_iws_t)value;
+        // any input, even a partial frame, shows that the client is alive
+        iws->recv_millis = sm_now_millis();
+        if (!iws->is_websocket) {
+          iws->message_millis = iws->recv_millis;  // http request
+        }
+        return iws->ws->on_recv(iws->ws, buf, length);
       }
     case TYPE_IFS:
       {
-        int ws_fd = ((iwdp_ifs_t)value)->iws->ws_fd;
-        iwdp_status ret = self->send(self, ws_fd, buf, length);
+        iwdp_iws_t iws = ((iwdp_ifs_t)value)->iws;
+        iws->message_millis = sm_now_millis();
+        int ws_fd = iws->ws_fd;
+        iwdp_status ret = self->send(self, ws_fd, buf, length, 0);
         if (ret) {
           self->remove_fd(self, ws_fd);
         }
@@ -554,6 +778,7 @@ iwdp_status iwdp_iport_close(iwdp_t self, iwdp_iport_t iport) {
     iwdp_log_disconnect(iport);
     iwi->iport = NULL;
     iport->iwi = NULL;
+    iwdp_notify_device(self, "remove", iport);
     if (iwi->wi_fd > 0) {
       self->remove_fd(self, iwi->wi_fd);
     }
@@ -561,22 +786,38 @@ iwdp_status iwdp_iport_close(iwdp_t self, iwdp_iport_t iport) {
   if (iport->is_sticky) {
     // keep iport so we can restore the port if this device is reattached
     iport->s_fd = -1;
+    iwdp_invalidate_list(iport);
   } else {
     ht_remove(iport_ht, device_id);
     iwdp_iport_free(iport);
   }
+  iwdp_invalidate_devices(self);
   return IWDP_SUCCESS;
 }
 
 iwdp_status iwdp_iws_close(iwdp_t self, iwdp_iws_t iws) {
+  if (iws->timer_id) {
+    self->remove_timer(self, iws->timer_id);
+    iws->timer_id = 0;
+  }
+  if (iws->batch_timer_id) {
+    self->remove_timer(self, iws->batch_timer_id);
+    iws->batch_timer_id = 0;
+  }
   // clear pointer to this iws
   iwdp_ipage_t ipage = iws->ipage;
   if (ipage) {
-    if (ipage->sender_id && ipage->iws == iws) {
+    if (ipage->num_clients) {
+      iwdp_leave_devtools(ipage, iws);
+    } else if (ipage->sender_id && ipage->iws == iws) {
       iwdp_stop_devtools(ipage);
+      iwdp_notify_page(iws->iport, "update", ipage);
     } // else internal error?
   }
   iwdp_iport_t iport = iws->iport;
+  if (iport && iws->is_stream) {
+    iport->num_streams--;
+  }
   if (iport) {
     ht_t iws_ht = iport->ws_id_to_iws;
     char *ws_id = iws->ws_id;
@@ -603,7 +844,14 @@ iwdp_status iwdp_iwi_close(iwdp_t self, iwdp_iwi_t iwi) {
     // clear pointer to this iwi
     if (iport->iwi) {
       iport->iwi = NULL;
+      iwdp_notify_device(self, "remove", iport);
     }
+    iwdp_invalidate_list(iport);
+    iwdp_invalidate_devices(self);
+  }
+  if (iwi->listing_timer_id) {
+    self->remove_timer(self, iwi->listing_timer_id);
+    iwi->listing_timer_id = 0;
   }
   // free pages
   ht_t ipage_ht = iwi->page_num_to_ipage;
@@ -611,7 +859,13 @@ iwdp_status iwdp_iwi_close(iwdp_t self, iwdp_iwi_t iwi) {
   ht_clear(ipage_ht);
   iwdp_ipage_t *ipp;
   for (ipp = ipages; *ipp; ipp++) {
-    iwdp_ipage_free((iwdp_ipage_t)*ipp);
+    iwdp_ipage_t ipage = *ipp;
+    // our clients are closed with our port, so they mustn't see the page
+    size_t i;
+    for (i = 0; i < ipage->num_clients; i++) {
+      ipage->clients[i]->ipage = NULL;
+    }
+    iwdp_ipage_free(ipage);
   }
   free(ipages);
   iwdp_iwi_free(iwi);
@@ -666,13 +920,24 @@ iwdp_status iwdp_on_close(iwdp_t self, int fd, void *value, bool is_server) {
 ws_status iwdp_send_data(ws_t ws, const char *data, size_t length) {
   iwdp_iws_t iws = (iwdp_iws_t)ws->state;
   iwdp_t self = iws->iport->self;
-  return (self->send(self, iws->ws_fd, data, length) ?
+  cb_t out = iws->batch_out;
+  if (out) {
+    if (cb_ensure_capacity(out, length)) {
+      return ws->on_error(ws, "Out of memory");
+    }
+    memcpy(out->tail, data, length);
+    out->tail += length;
+    return WS_SUCCESS;
+  }
+  return (self->send(self, iws->ws_fd, data, length, iws->send_flags) ?
       ws->on_error(ws, "Unable to send %zd bytes of data", length) :
       WS_SUCCESS);
 }
 
-ws_status iwdp_send_http(ws_t ws, bool is_head, const char *status,
-    const char *resource, const char *content) {
+// Send a response, with an ETag if the content is cacheable.
+ws_status iwdp_send_http_with_etag(ws_t ws, bool is_head, const char *status,
+    const char *resource, const char *content, size_t length,
+    const char *etag) {
   char *ctype;
   iwdp_get_content_type(resource, false, &ctype);
   char *data;
@@ -682,60 +947,388 @@ ws_status iwdp_send_http(ws_t ws, bool is_head, const char *status,
       "Connection: close\r\n"
       "Access-Control-Allow-Origin: *\r\n"
       "Access-Control-Allow-Methods: GET, HEAD"
-      "%s%s\r\n\r\n%s",
-      status, (content ? strlen(content) : 0),
+      "%s%s%s%s\r\n\r\n",
+      status, length,
       (ctype ? "\r\nContent-Type: " : ""), (ctype ? ctype : ""),
-      (content && !is_head ? content : "")) < 0) {
+      (etag ? "\r\nCache-Control: no-cache\r\nETag: " : ""),
+      (etag ? etag : "")) < 0) {
+    free(ctype);
     return ws->on_error(ws, "asprintf failed");
   }
   free(ctype);
   ws_status ret = ws->send_data(ws, data, strlen(data));
   free(data);
+  if (!ret && length && !is_head) {
+    ret = ws->send_data(ws, content, length);
+  }
   return ret;
 }
 
-ws_status iwdp_on_list_request(ws_t ws, bool is_head, bool want_json,
+ws_status iwdp_send_http(ws_t ws, bool is_head, const char *status,
+    const char *resource, const char *content) {
+  return iwdp_send_http_with_etag(ws, is_head, status, resource, content,
+      (content ? strlen(content) : 0), NULL);
+}
+
+// Drop our cached "/" and "/json" responses for this port, e.g. because a
+// page was added or a client took a page.
+void iwdp_invalidate_list(iwdp_iport_t iport) {
+  if (iport) {
+    iport->list_version++;
+  }
+}
+
+// Same, for our device-list port.
+void iwdp_invalidate_devices(iwdp_t self) {
+  iwdp_private_t my = self->private_state;
+  iwdp_invalidate_list((iwdp_iport_t)ht_get_value(my->device_id_to_iport,
+        NULL));
+}
+
+// Our content is a char_buffer, which charges MB_PAGES itself.
+size_t iwdp_list_cache_get_memory(iwdp_list_cache_t cache) {
+  return (sizeof(struct iwdp_list_cache_struct) +
+      (cache->host ? strlen(cache->host) + 1 : 0));
+}
+
+// Find our cached response for this Host, as our most recently used, or
+// reuse our least recently used if we have too many.
+iwdp_list_cache_t iwdp_get_list_cache(iwdp_iport_t iport, bool want_json,
+    const char *host) {
+  iwdp_list_cache_t *prev = &iport->list_cache;
+  iwdp_list_cache_t cache = *prev;
+  size_t n = 0;
+  for (; cache; prev = &cache->next, cache = cache->next, n++) {
+    if (cache->want_json == want_json && (cache->host && host ?
+          !strcmp(cache->host, host) : cache->host == host)) {
+      break;
+    }
+    if (!cache->next && n + 1 >= IWDP_MAX_LIST_CACHE) {
+      // reuse our oldest
+      mb_remove(MB_PAGES, iwdp_list_cache_get_memory(cache));
+      cb_free(cache->content);
+      cache->content = NULL;
+      cache->want_json = want_json;
+      if (iwdp_update_string(&cache->host, host) < 0) {
+        // not iwdp_list_cache_free, since we've uncharged it
+        *prev = NULL;
+        free(cache->host);
+        free(cache);
+        return NULL;
+      }
+      mb_add(MB_PAGES, iwdp_list_cache_get_memory(cache));
+      break;
+    }
+  }
+  if (cache) {
+    *prev = cache->next;
+  } else {
+    cache = (iwdp_list_cache_t)malloc(sizeof(struct iwdp_list_cache_struct));
+    if (!cache) {
+      return NULL;
+    }
+    memset(cache, 0, sizeof(struct iwdp_list_cache_struct));
+    cache->want_json = want_json;
+    if (host && !(cache->host = strdup(host))) {
+      free(cache);
+      return NULL;
+    }
+    mb_add(MB_PAGES, iwdp_list_cache_get_memory(cache));
+  }
+  cache->next = iport->list_cache;
+  iport->list_cache = cache;
+  return cache;
+}
+
+// Take ownership of newly rendered content, and tag it by a hash.
+void iwdp_set_list_cache(iwdp_list_cache_t cache, cb_t content,
+    uint32_t version) {
+  cb_free(cache->content);
+  cache->content = content;
+  cache->version = version;
+  // FNV-1a
+  uint32_t hc = 2166136261u;
+  size_t length = content->tail - content->head;
+  const unsigned char *s = (const unsigned char *)content->head;
+  const unsigned char *tail = (const unsigned char *)content->tail;
+  for (; s < tail; s++) {
+    hc = (hc ^ *s) * 16777619u;
+  }
+  snprintf(cache->etag, sizeof(cache->etag), "\"%zx-%08x\"", length, hc);
+}
+
+// Check an If-None-Match header, e.g. '"1a-c0ffee42", "2b-..."' or '*'.
+bool iwdp_is_etag_match(const char *headers, size_t headers_length,
+    const char *etag) {
+  const char *value;
+  size_t length;
+  return (iwdp_get_header(headers, headers_length, "If-None-Match",
+        &value, &length) &&
+      ((length == 1 && *value == '*') ||
+       strnstr(value, etag, length)));
+}
+
+// Get the frontend url for our page links.
+// @param to_url set to the url, or NULL if we have no frontend
+iwdp_status iwdp_get_frontend_url(iwdp_t self, char **to_url) {
+  const char *fe_url = self->private_state->frontend;
+  *to_url = NULL;
+  if (fe_url && !strncasecmp(fe_url, "chrome-devtools://", 18)) {
+    // allow chrome-devtools links, even though Chrome's sandbox blocks them:
+    //   Not allowed to load local resource: chrome-devtools://...
+    // Maybe a future Chrome flag (TBD?) will permit this.
+    *to_url = strdup(fe_url);
+    return (*to_url ? IWDP_SUCCESS : IWDP_ERROR);
+  } else if (fe_url) {
+    const char *fe_proto = strstr(fe_url, "://");
+    const char *fe_path = (fe_proto ? fe_proto + 3 : fe_url);
+    const char *fe_sep = strrchr(fe_path, '/');
+    const char *fe_file = (fe_sep ? (strlen(fe_sep) > 1 ? fe_sep + 1 : NULL) :
+        fe_path);
+    if (!fe_file) {
+      self->on_error(self, "Ignoring invalid frontend: %s\n", fe_url);
+    }
+    if (asprintf(to_url, "/devtools/%s", fe_file) < 0) {
+      *to_url = NULL;
+      return IWDP_ERROR;
+    }
+  }
+  return IWDP_SUCCESS;
+}
+
+// Get our "/" or "/json" content for this Host, which we only render if
+// our cached copy is stale.
+// @result the cache entry, or NULL if out of memory
+iwdp_list_cache_t iwdp_get_list(iwdp_iport_t iport, bool want_json,
     const char *host) {
-  iwdp_iws_t iws = (iwdp_iws_t)ws->state;
-  iwdp_iport_t iport = iws->iport;
   iwdp_t self = iport->self;
   iwdp_private_t my = self->private_state;
-  char *content;
+  iwdp_list_cache_t cache = iwdp_get_list_cache(iport, want_json, host);
+  if (!cache) {
+    return NULL;
+  }
+  if (cache->content && cache->version == iport->list_version) {
+    return cache;
+  }
+  // render straight into the buffer that we'll cache and send
+  cb_t content = cb_new();
+  if (!content) {
+    return NULL;
+  }
+  content->tag = MB_PAGES;
+  int ret;
   if (iport->device_id) {
-    const char *fe_url = my->frontend;
-    char *frontend_url = NULL;
-    if (fe_url && !strncasecmp(fe_url, "chrome-devtools://", 18)) {
-      // allow chrome-devtools links, even though Chrome's sandbox blocks them:
-      //   Not allowed to load local resource: chrome-devtools://...
-      // Maybe a future Chrome flag (TBD?) will permit this.
-      frontend_url = strdup(fe_url);
-    } else if (fe_url) {
-      const char *fe_proto = strstr(fe_url, "://");
-      const char *fe_path = (fe_proto ? fe_proto + 3 : fe_url);
-      const char *fe_sep = strrchr(fe_path, '/');
-      const char *fe_file = (fe_sep ? (strlen(fe_sep) > 1 ? fe_sep + 1 : NULL) :
-          fe_path);
-      if (!fe_file) {
-        self->on_error(self, "Ignoring invalid frontend: %s\n", fe_url);
-      }
-      if (asprintf(&frontend_url, "/devtools/%s", fe_file) < 0) {
-        return self->on_error(self, "asprintf failed");
-      }
+    char *frontend_url;
+    if (iwdp_get_frontend_url(self, &frontend_url)) {
+      cb_free(content);
+      return NULL;
     }
     ht_t ipage_ht = (iport->iwi ? iport->iwi->page_num_to_ipage : NULL);
     iwdp_ipage_t *ipages = (iwdp_ipage_t *)ht_values(ipage_ht);
 
-    content = iwdp_ipages_to_text(ipages, want_json,
-        iport->device_id, iport->device_name, frontend_url, host, iport->port);
+    ret = (!ipages || iwdp_ipages_to_text(content, ipages, want_json,
+        iport->device_id, iport->device_name, frontend_url, host, iport->port));
     free(ipages);
     free(frontend_url);
   } else {
     iwdp_iport_t *iports = (iwdp_iport_t *)ht_values(my->device_id_to_iport);
-    content = iwdp_iports_to_text(iports, want_json, host);
+    ret = (!iports || iwdp_iports_to_text(content, iports, want_json, host));
     free(iports);
   }
-  ws_status ret = iwdp_send_http(ws, is_head, "200 OK",
-      (want_json ? ".json" : ".html"), content);
+  if (ret) {
+    cb_free(content);
+    return NULL;
+  }
+  iwdp_set_list_cache(cache, content, iport->list_version);
+  return cache;
+}
+
+ws_status iwdp_on_list_request(ws_t ws, bool is_head, bool want_json,
+    const char *host, const char *headers, size_t headers_length) {
+  iwdp_iws_t iws = (iwdp_iws_t)ws->state;
+  iwdp_iport_t iport = iws->iport;
+  iwdp_t self = iport->self;
+  const char *ext = (want_json ? ".json" : ".html");
+  iwdp_list_cache_t cache = iwdp_get_list(iport, want_json, host);
+  if (!cache) {
+    return self->on_error(self, "Out of memory");
+  }
+  return (iwdp_is_etag_match(headers, headers_length, cache->etag) ?
+      iwdp_send_http_with_etag(ws, is_head, "304 Not Modified", ext,
+        NULL, 0, cache->etag) :
+      iwdp_send_http_with_etag(ws, is_head, "200 OK", ext,
+        cache->content->head, cache->content->tail - cache->content->head,
+        cache->etag));
+}
+
+// Send a list change to a /json/stream client, as a Server-Sent Event:
+//   event: add
+//   data: {...}
+// or as a websocket message:
+//   {"event": "add", "data": {...}}
+ws_status iwdp_iws_send_stream(iwdp_t self, iwdp_iws_t iws,
+    const char *type, const char *json, size_t length) {
+  cb_t out = cb_new();
+  if (!out) {
+    return self->on_error(self, "Out of memory");
+  }
+  out->tag = MB_PAGES;
+  int ret;
+  if (iws->is_websocket) {
+    ret = (jw_printf(out, "{\"event\": \"%s\", \"data\": ", type) ||
+        jw_write(out, json, length) ||
+        jw_puts(out, "}"));
+  } else {
+    // each line of our data needs its own "data:" field
+    ret = jw_printf(out, "event: %s\n", type);
+    const char *head = json;
+    const char *end = json + length;
+    while (!ret && head < end) {
+      const char *tail = (const char *)memchr(head, '\n', end - head);
+      if (!tail) {
+        tail = end;
+      }
+      ret = (jw_puts(out, "data: ") ||
+          jw_write(out, head, tail - head) ||
+          jw_puts(out, "\n"));
+      head = tail + 1;
+    }
+    if (!ret) {
+      ret = jw_puts(out, "\n");
+    }
+  }
+  ws_status status;
+  if (ret) {
+    status = self->on_error(self, "Out of memory");
+  } else if (iws->is_websocket) {
+    status = iwdp_iws_send_text(self, iws, out->head, out->tail - out->head,
+        false);
+  } else {
+    status = iws->ws->send_data(iws->ws, out->head, out->tail - out->head);
+    iws->message_millis = sm_now_millis();
+  }
+  cb_free(out);
+  return status;
+}
+
+ws_status iwdp_iws_send_snapshot(iwdp_t self, iwdp_iws_t iws) {
+  iwdp_list_cache_t cache = iwdp_get_list(iws->iport, true,
+      iws->stream_host);
+  if (!cache) {
+    return self->on_error(self, "Out of memory");
+  }
+  return iwdp_iws_send_stream(self, iws, "snapshot", cache->content->head,
+      cache->content->tail - cache->content->head);
+}
+
+// Subscribe a client to our list's changes, as Server-Sent Events or, if
+// the client asked for an upgrade, as websocket messages.  We first send
+// our "/json" list as a "snapshot", then an "add", "update" or "remove"
+// with the "/json" item of each page (or device) that changes.  A removal
+// only has the item's "id" (or "deviceId").
+ws_status iwdp_on_stream_request(ws_t ws, bool is_head, bool is_websocket,
+    const char *host, bool *to_keep_alive) {
+  iwdp_iws_t iws = (iwdp_iws_t)ws->state;
+  iwdp_iport_t iport = iws->iport;
+  iwdp_t self = iport->self;
+  if (!is_websocket) {
+    const char *response =
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Type: text/event-stream\r\n"
+      "Cache-Control: no-cache\r\n"
+      "Access-Control-Allow-Origin: *\r\n"
+      "\r\n";
+    if (ws->send_data(ws, response, strlen(response)) || is_head) {
+      return (is_head ? WS_SUCCESS : WS_ERROR);
+    }
+    *to_keep_alive = true;
+  }
+  if (iwdp_update_string(&iws->stream_host, host) < 0) {
+    return self->on_error(self, "Out of memory");
+  }
+  if (!iws->is_stream) {
+    iws->is_stream = true;
+    iport->num_streams++;
+  }
+  if (is_websocket) {
+    return WS_SUCCESS;  // we'll send our snapshot once we've upgraded
+  }
+  // reschedule, since we're exempt from our idle timeout and will send
+  // heartbeats instead
+  if (iws->timer_id) {
+    self->remove_timer(self, iws->timer_id);
+    iws->timer_id = 0;
+  }
+  iwdp_status ret = iwdp_iws_keepalive(self, iws);
+  return (ret ? ret : iwdp_iws_send_snapshot(self, iws));
+}
+
+// Tell a port's /json/stream clients about a change to one of its pages
+// or, for our device-list port, one of our devices.
+static void iwdp_notify_streams(iwdp_iport_t iport, const char *type,
+    iwdp_ipage_t ipage, iwdp_iport_t device) {
+  if (!iport || !iport->num_streams) {
+    return;
+  }
+  iwdp_t self = iport->self;
+  bool is_remove = !strcmp(type, "remove");
+  char *frontend_url = NULL;
+  cb_t json = cb_new();
+  if (!json || (ipage && !is_remove &&
+        iwdp_get_frontend_url(self, &frontend_url))) {
+    cb_free(json);
+    self->on_error(self, "Out of memory");
+    return;
+  }
+  json->tag = MB_PAGES;
+  iwdp_iws_t *iwss = (iwdp_iws_t *)ht_values(iport->ws_id_to_iws);
+  iwdp_iws_t *iwsp;
+  for (iwsp = iwss; iwsp && *iwsp; iwsp++) {
+    iwdp_iws_t iws = *iwsp;
+    if (!iws->is_stream) {
+      continue;
+    }
+    // our urls depend on the client's Host
+    cb_clear(json);
+    int ret = (is_remove ?
+        (ipage ? jw_printf(json, "{\"id\": \"%d\"}", ipage->page_num) :
+         (jw_puts(json, "{\"deviceId\": \"") ||
+          jw_escape_json(json, device->device_id) ||
+          jw_puts(json, "\"}"))) :
+        (ipage ? iwdp_ipage_to_json(json, ipage, frontend_url,
+                   iws->stream_host, iport->port) :
+         iwdp_iport_to_json(json, device, iws->stream_host)));
+    if (ret || iwdp_iws_send_stream(self, iws, type, json->head,
+          json->tail - json->head)) {
+      self->remove_fd(self, iws->ws_fd);
+    }
+  }
+  free(iwss);
+  free(frontend_url);
+  cb_free(json);
+}
+
+// @param type "add", "update" or "remove"
+void iwdp_notify_page(iwdp_iport_t iport, const char *type,
+    iwdp_ipage_t ipage) {
+  iwdp_notify_streams(iport, type, ipage, NULL);
+}
+
+// @param type "add" or "remove"
+void iwdp_notify_device(iwdp_t self, const char *type, iwdp_iport_t iport) {
+  iwdp_private_t my = self->private_state;
+  iwdp_notify_streams((iwdp_iport_t)ht_get_value(my->device_id_to_iport,
+        NULL), type, NULL, iport);
+}
+
+ws_status iwdp_on_memory_request(ws_t ws, bool is_head) {
+  iwdp_iws_t iws = (iwdp_iws_t)ws->state;
+  iwdp_t self = iws->iport->self;
+  char *content = iwdp_memory_to_json(self, iws->iport);
+  if (!content) {
+    return self->on_error(self, "Out of memory");
+  }
+  ws_status ret = iwdp_send_http(ws, is_head, "200 OK", ".json", content);
   free(content);
   return ret;
 }
@@ -756,18 +1349,154 @@ ws_status iwdp_on_not_found(ws_t ws, bool is_head, const char *resource,
   return ret;
 }
 
-ws_status iwdp_on_devtools_request(ws_t ws, const char *resource) {
+// Find a "name=value" query parameter.
+// @param query the text after the '?'
+bool iwdp_get_query_param(const char *query, const char *name,
+    const char **to_value, size_t *to_length) {
+  size_t name_length = strlen(name);
+  const char *head = query;
+  while (head && *head) {
+    const char *tail = strchr(head, '&');
+    if (!tail) {
+      tail = head + strlen(head);
+    }
+    if (!strncmp(head, name, name_length) &&
+        (head + name_length == tail || head[name_length] == '=')) {
+      const char *value = head + name_length;
+      if (value < tail) {
+        value++;  // '='
+      }
+      *to_value = value;
+      *to_length = tail - value;
+      return true;
+    }
+    head = (*tail ? tail + 1 : NULL);
+  }
+  return false;
+}
+
+// Set the events that a client wants.
+// @param events comma-separated methods or "Domain.*" patterns, which may
+//   be URL-encoded or a JSON array of strings.  Empty for all events.
+iwdp_status iwdp_iws_set_events(iwdp_iws_t iws, const char *events,
+    size_t length) {
+  char *s = (char *)malloc(length + 1);
+  if (!s) {
+    return IWDP_ERROR;
+  }
+  char *t = s;
+  size_t i;
+  for (i = 0; i < length; i++) {
+    char ch = events[i];
+    if (ch == '%' && i + 2 < length &&
+        isxdigit((unsigned char)events[i + 1]) &&
+        isxdigit((unsigned char)events[i + 2])) {
+      char hex[3] = {events[i + 1], events[i + 2], '\0'};
+      ch = (char)strtol(hex, NULL, 16);
+      i += 2;
+    }
+    if (ch && !strchr("\"[] \t\r\n", ch)) {
+      *t++ = ch;
+    }
+  }
+  *t = '\0';
+  free(iws->events);
+  iws->events = NULL;
+  if (*s) {
+    iws->events = s;
+  } else {
+    free(s);
+  }
+  return IWDP_SUCCESS;
+}
+
+// Check a device event's method against our client's filter.
+bool iwdp_iws_wants_event(iwdp_iws_t iws, const char *method,
+    size_t method_length) {
+  const char *head = iws->events;
+  if (!head) {
+    return true;
+  }
+  while (*head) {
+    const char *tail = strchr(head, ',');
+    if (!tail) {
+      tail = head + strlen(head);
+    }
+    size_t n = tail - head;
+    if (n && head[n - 1] == '*' ?
+        (n - 1 <= method_length && !strncmp(head, method, n - 1)) :
+        (n == method_length && !strncmp(head, method, n))) {
+      return true;
+    }
+    head = (*tail ? tail + 1 : tail);
+  }
+  return false;
+}
+
+// Find a request header, e.g. "X-DevTools-Remote: 1".
+// @param to_value optional, set to the trimmed value, which is not
+//   '\0'-terminated
+bool iwdp_get_header(const char *headers, size_t headers_length,
+    const char *name, const char **to_value, size_t *to_length) {
+  size_t name_length = strlen(name);
+  const char *head = headers;
+  const char *end = headers + headers_length;
+  while (head < end) {
+    const char *tail = strnstr(head, "\r\n", end - head);
+    if (!tail) {
+      tail = end;
+    }
+    if (tail - head > name_length && head[name_length] == ':' &&
+        !strncasecmp(head, name, name_length)) {
+      const char *value = head + name_length + 1;
+      const char *value_end = tail;
+      while (value < value_end && (*value == ' ' || *value == '\t')) {
+        value++;
+      }
+      while (value_end > value &&
+          (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+        value_end--;
+      }
+      if (to_value) {
+        *to_value = value;
+        *to_length = value_end - value;
+      }
+      return true;
+    }
+    head = tail + 2;
+  }
+  return false;
+}
+
+ws_status iwdp_on_devtools_request(ws_t ws, const char *resource,
+    const char *headers, size_t headers_length) {
   iwdp_iws_t iws = (iwdp_iws_t)ws->state;
   if (!resource || strncmp(resource, "/devtools/page/", 15)) {
     return ws->on_error(ws, "Internal error: %s", resource);
   }
-  // parse page_num
+  // parse page_num, then our optional "?events=..." filter
   const char *s = resource + 15;
+  const char *query = strchr(s, '?');
   char *end = NULL;
   int page_num = strtol(s, &end, 0);
-  if (*end != '\0' || *s == '\0') {
+  if ((*end != '\0' && end != query) || end == s) {
     page_num = -1;
   }
+  const char *events;
+  size_t events_length;
+  if (query && iwdp_get_query_param(query + 1, "events",
+        &events, &events_length) &&
+      iwdp_iws_set_events(iws, events, events_length)) {
+    return ws->on_error(ws, "Out of memory");
+  }
+  // "?remote" or a header marks a client on a slow link
+  const char *remote;
+  size_t remote_length;
+  iws->is_remote = ((query && iwdp_get_query_param(query + 1, "remote",
+          &remote, &remote_length) &&
+        !(remote_length == 1 && *remote == '0')) ||
+      iwdp_get_header(headers, headers_length, "X-DevTools-Remote",
+        NULL, NULL));
   // find page
   iwdp_iwi_t iwi = iws->iport->iwi;
   iwdp_ipage_t p =
@@ -1004,7 +1733,7 @@ ws_status iwdp_on_static_request_for_http(ws_t ws, bool is_head,
   free(host);
   free(path);
   size_t length = strlen(data);
-  iwdp_status ret = self->send(self, fs_fd, data, length);
+  iwdp_status ret = self->send(self, fs_fd, data, length, 0);
   free(data);
   *to_keep_alive = true;
   return ret;
@@ -1055,8 +1784,24 @@ ws_status iwdp_on_http_request(ws_t ws,
   bool is_get = !strcmp(method, "GET");
   bool is_head = !is_get && !strcmp(method, "HEAD");
   if (is_websocket) {
+    // refuse new websockets, which could hold a lot of memory, but still
+    // answer plain requests, e.g. for /json/memory
+    if (!mb_has_room(0)) {
+      iwdp_iws_t iws = (iwdp_iws_t)ws->state;
+      iwdp_t self = iws->iport->self;
+      self->on_error(self, "Refusing websocket on port %d, %zu bytes"
+          " exceeds our %zu byte memory budget", iws->iport->port,
+          mb_get_total(), mb_get_limit());
+      iwdp_send_http(ws, false, "503 Service Unavailable", ".txt",
+          "Over memory budget");
+      // close, otherwise ws_recv_http_request would go on to upgrade
+      return WS_ERROR;
+    }
     if (is_get && !strncmp(resource, "/devtools/page/", 15)) {
-      return iwdp_on_devtools_request(ws, resource);
+      return iwdp_on_devtools_request(ws, resource, headers,
+          headers_length);
+    } else if (is_get && !strcmp(resource, "/json/stream")) {
+      return iwdp_on_stream_request(ws, false, true, host, to_keep_alive);
     }
   } else {
     if (!is_get && !is_head) {
@@ -1064,9 +1809,16 @@ ws_status iwdp_on_http_request(ws_t ws,
     }
 
     if (!strlen(resource) || !strcmp(resource, "/")) {
-      return iwdp_on_list_request(ws, is_head, false, host);
+      return iwdp_on_list_request(ws, is_head, false, host,
+          headers, headers_length);
     } else if (!strcmp(resource, "/json") || !strcmp(resource, "/json/list")) {
-      return iwdp_on_list_request(ws, is_head, true, host);
+      return iwdp_on_list_request(ws, is_head, true, host,
+          headers, headers_length);
+    } else if (!strcmp(resource, "/json/memory")) {
+      return iwdp_on_memory_request(ws, is_head);
+    } else if (!strcmp(resource, "/json/stream")) {
+      return iwdp_on_stream_request(ws, is_head, false, host,
+          to_keep_alive);
     } else if (!strncmp(resource, "/devtools/", 10)) {
       return iwdp_on_static_request(ws, is_head, resource,
           to_keep_alive);
@@ -1083,7 +1835,79 @@ ws_status iwdp_on_http_request(ws_t ws,
 ws_status iwdp_on_upgrade(ws_t ws,
     const char *resource, const char *protocol,
     int version, const char *sec_key) {
-  return ws->send_upgrade(ws);
+  if (ws->send_upgrade(ws)) {
+    return WS_ERROR;
+  }
+  iwdp_iws_t iws = (iwdp_iws_t)ws->state;
+  iwdp_t self = iws->iport->self;
+  iws->is_websocket = true;
+  iws->message_millis = iws->recv_millis;
+  // reschedule, since we can ping now
+  if (iws->timer_id) {
+    self->remove_timer(self, iws->timer_id);
+    iws->timer_id = 0;
+  }
+  iwdp_status ret = iwdp_iws_keepalive(self, iws);
+  return (ret || !iws->is_stream ? ret : iwdp_iws_send_snapshot(self, iws));
+}
+
+// Answer a client's "Proxy.*" command, which is for us, not the device.
+// @param to_is_handled set to false if this isn't a proxy command
+ws_status iwdp_iws_on_proxy_command(iwdp_t self, iwdp_iws_t iws,
+    const char *data, size_t length, bool *to_is_handled) {
+  static const char *method_key[] = {"method"};
+  static const char *id_key[] = {"id"};
+  static const char *params_key[] = {"params"};
+  static const char *events_key[] = {"events"};
+  const char *method;
+  size_t method_length;
+  *to_is_handled = false;
+  if (js_find_key(data, length, method_key, 1, &method, &method_length) ||
+      method_length < 6 || strncmp(method, "Proxy.", 6)) {
+    return WS_SUCCESS;
+  }
+  *to_is_handled = true;
+  const char *id;
+  size_t id_length;
+  if (js_find_key(data, length, id_key, 1, &id, &id_length)) {
+    id = "0";
+    id_length = 1;
+  } else if (id > data && id[-1] == '"') {
+    // keep a string id's quotes
+    id--;
+    id_length += 2;
+  }
+  const char *error = NULL;
+  if (method_length == 20 && !strncmp(method, "Proxy.setEventFilter", 20)) {
+    // {"events": ["Console.*", ...]}, or no events to clear our filter
+    const char *params;
+    size_t params_length;
+    const char *events = "";
+    size_t events_length = 0;
+    if (!js_find_key(data, length, params_key, 1, &params, &params_length)) {
+      js_find_key(params, params_length, events_key, 1, &events,
+          &events_length);
+    }
+    if (iwdp_iws_set_events(iws, events, events_length)) {
+      return iws->ws->on_error(iws->ws, "Out of memory");
+    }
+  } else {
+    error = "Unknown proxy method";
+  }
+  char *reply;
+  int ret = (error ?
+      asprintf(&reply,
+        "{\"id\":%.*s,\"error\":{\"code\":-32601,\"message\":\"%s\"}}",
+        (int)id_length, id, error) :
+      asprintf(&reply, "{\"id\":%.*s,\"result\":{}}",
+        (int)id_length, id));
+  if (ret < 0) {
+    return iws->ws->on_error(iws->ws, "asprintf failed");
+  }
+  ws_status status = iwdp_iws_send_text(self, iws, reply, strlen(reply),
+      true);
+  free(reply);
+  return status;
 }
 
 ws_status iwdp_on_frame(ws_t ws,
@@ -1095,7 +1919,7 @@ ws_status iwdp_on_frame(ws_t ws,
     case OPCODE_TEXT:
     case OPCODE_BINARY:
       if (!is_fin) {
-        // wait for full data
+        // wait for full data, since the inspector wants whole messages
         *to_keep = true;
         return WS_SUCCESS;
       }
@@ -1103,7 +1927,17 @@ ws_status iwdp_on_frame(ws_t ws,
         return ws->send_close(ws, CLOSE_PROTOCOL_ERROR,
             "Clients must mask");
       }
+      iws->message_millis = iws->recv_millis;
+      if (iws->is_stream) {
+        return WS_SUCCESS;  // our list changes only go one way
+      }
       iwdp_iport_t iport = iws->iport;
+      bool is_handled;
+      ws_status ret = iwdp_iws_on_proxy_command(iport->self, iws,
+          payload_data, payload_length, &is_handled);
+      if (ret || is_handled) {
+        return ret;
+      }
       iwdp_iwi_t iwi = iport->iwi;
       if (!iwi) {
         return ws->send_close(ws, CLOSE_GOING_AWAY, "inspector closed?");
@@ -1124,6 +1958,10 @@ ws_status iwdp_on_frame(ws_t ws,
         free(s);
         return ret;
       }
+      if (ipage->num_clients) {
+        return iwdp_ipage_send_command(iport->self, ipage, iws,
+            payload_data, payload_length);
+      }
       rpc_t rpc = iwi->rpc;
       return rpc->send_forwardSocketData(rpc,
           iwi->connection_id,
@@ -1148,6 +1986,126 @@ ws_status iwdp_on_frame(ws_t ws,
   }
 }
 
+//
+// keepalive
+//
+
+// Close the client if it's idle or hasn't answered our ping, otherwise
+// send a ping if the client has been quiet, then schedule the next check.
+//
+// A dead peer (e.g. a laptop that went to sleep) never sends a FIN, so
+// without this its iws and claimed page would linger until someone else
+// steals the page.
+iwdp_status iwdp_iws_keepalive(iwdp_t self, iwdp_iws_t iws) {
+  uint64_t now = sm_now_millis();
+  uint64_t next = UINT64_MAX;
+  if (iws->close_millis) {
+    // closing, once our close frame is out
+    if (now >= iws->close_millis ||
+        !self->get_send_length(self, iws->ws_fd)) {
+      return self->remove_fd(self, iws->ws_fd);
+    }
+    next = now + IWDP_CLOSE_POLL_MILLIS;
+  } else if (self->idle_timeout && !iws->is_stream) {
+    uint64_t idle_deadline = iws->message_millis +
+        (uint64_t)self->idle_timeout * 1000;
+    if (now >= idle_deadline) {
+      if (self->is_debug && *self->is_debug) {
+        printf("Closing idle client %s on port %d\n", iws->ws_id,
+            iws->iport->port);
+      }
+      if (!iws->is_websocket ||
+          iws->ws->send_close(iws->ws, CLOSE_GOING_AWAY, "Idle timeout")) {
+        return self->remove_fd(self, iws->ws_fd);
+      }
+      // the close frame is corked or queued, and removing our fd now
+      // would discard it, so wait for it to be sent
+      iws->close_millis = now + IWDP_CLOSE_MILLIS;
+      next = now;
+    } else {
+      next = idle_deadline;
+    }
+  }
+  if (self->ping_interval && iws->is_websocket && !iws->close_millis) {
+    uint64_t deadline;
+    if (iws->ping_millis && iws->recv_millis < iws->ping_millis) {
+      deadline = iws->ping_millis + (uint64_t)self->ping_timeout * 1000;
+      if (now >= deadline) {
+        self->on_error(self, "Closing unresponsive client %s on port %d",
+            iws->ws_id, iws->iport->port);
+        return self->remove_fd(self, iws->ws_fd);
+      }
+    } else {
+      iws->ping_millis = 0;
+      deadline = iws->recv_millis + (uint64_t)self->ping_interval * 1000;
+      if (now >= deadline) {
+        if (iws->ws->send_frame(iws->ws,
+              true, OPCODE_PING, false,
+              "", 0)) {
+          return self->remove_fd(self, iws->ws_fd);
+        }
+        iws->ping_millis = now;
+        deadline = now + (uint64_t)self->ping_timeout * 1000;
+      }
+    }
+    if (deadline < next) {
+      next = deadline;
+    }
+  }
+  if (self->ping_interval && iws->is_stream && !iws->is_websocket &&
+      !iws->close_millis) {
+    // an event-stream client can't answer a ping, but a comment will fail
+    // to send to a dead peer
+    uint64_t deadline = iws->message_millis +
+        (uint64_t)self->ping_interval * 1000;
+    if (now >= deadline) {
+      if (iws->ws->send_data(iws->ws, ":\n\n", 3)) {
+        return self->remove_fd(self, iws->ws_fd);
+      }
+      iws->message_millis = now;
+      deadline = now + (uint64_t)self->ping_interval * 1000;
+    }
+    if (deadline < next) {
+      next = deadline;
+    }
+  }
+  if (next == UINT64_MAX) {
+    return IWDP_SUCCESS;
+  }
+  int timer_id = self->add_timer(self, (unsigned int)(next - now), iws);
+  if (timer_id <= 0) {
+    return self->on_error(self, "Unable to add keepalive timer");
+  }
+  iws->timer_id = timer_id;
+  return IWDP_SUCCESS;
+}
+
+iwdp_status iwdp_on_timer(iwdp_t self, int timer_id, void *value) {
+  int type = ((iwdp_type_t)value)->type;
+  if (type == TYPE_IWS) {
+    iwdp_iws_t iws = (iwdp_iws_t)value;
+    if (iws->batch_timer_id && iws->batch_timer_id == timer_id) {
+      iws->batch_timer_id = 0;
+      return (iwdp_iws_flush(self, iws) ?
+          self->remove_fd(self, iws->ws_fd) : IWDP_SUCCESS);
+    }
+    if (iws->timer_id != timer_id) {
+      return self->on_error(self, "Internal timer mismatch?");
+    }
+    iws->timer_id = 0;
+    return iwdp_iws_keepalive(self, iws);
+  } else if (type == TYPE_IWI) {
+    iwdp_iwi_t iwi = (iwdp_iwi_t)value;
+    if (iwi->listing_timer_id != timer_id) {
+      return self->on_error(self, "Internal timer mismatch?");
+    }
+    iwi->listing_timer_id = 0;
+    return iwdp_send_listings(self, iwi);
+  } else {
+    return self->on_error(self, "Unexpected timer type %d", type);
+  }
+}
+
 //
 // webinspector
 //
@@ -1155,19 +2113,22 @@ ws_status iwdp_on_frame(ws_t ws,
 wi_status iwdp_send_packet(wi_t wi, const char *packet, size_t length) {
   iwdp_iwi_t iwi = (iwdp_iwi_t)wi->state;
   iwdp_t self = iwi->iport->self;
-  return (self->send(self, iwi->wi_fd, packet, length) ?
+  return (self->send(self, iwi->wi_fd, packet, length, 0) ?
       self->on_error(self, "Unable to send %zd bytes to inspector", length) :
       WI_SUCCESS);
 }
 
-wi_status iwdp_recv_plist(wi_t wi, const plist_t rpc_dict) {
+wi_status iwdp_recv_bplist(wi_t wi, const char *rpc_bin, size_t length) {
   rpc_t rpc = ((iwdp_iwi_t)wi->state)->rpc;
-  return rpc->recv_plist(rpc, rpc_dict);
+  return rpc->recv_bplist(rpc, rpc_bin, length);
 }
 
-rpc_status iwdp_send_plist(rpc_t rpc, const plist_t rpc_dict) {
+#if RPC_BPLIST_PADDING < WI_BPLIST_PADDING
+#error "rpc doesn't leave enough room for wi's packet framing"
+#endif
+rpc_status iwdp_send_bplist(rpc_t rpc, char *rpc_bin, size_t length) {
   wi_t wi = ((iwdp_iwi_t)rpc->state)->wi;
-  return wi->send_plist(wi, rpc_dict);
+  return wi->send_bplist(wi, rpc_bin, length);
 }
 
 rpc_status iwdp_on_reportSetup(rpc_t rpc) {
@@ -1177,26 +2138,94 @@ rpc_status iwdp_on_reportSetup(rpc_t rpc) {
   return RPC_SUCCESS;
 }
 
-rpc_status iwdp_add_app_id(rpc_t rpc, const char *app_id) {
-  iwdp_iwi_t iwi = (iwdp_iwi_t)rpc->state;
-  ht_t app_id_ht = iwi->app_id_to_true;
-  if (ht_get_value(app_id_ht, app_id)) {
-    return RPC_SUCCESS;
+// Call iwdp_send_listings after delay_millis, unless it's already due by
+// then.
+iwdp_status iwdp_schedule_listings(iwdp_t self, iwdp_iwi_t iwi,
+    uint64_t delay_millis) {
+  uint64_t due_millis = sm_now_millis() + delay_millis;
+  if (iwi->listing_timer_id) {
+    if (iwi->listing_due_millis <= due_millis) {
+      return IWDP_SUCCESS;
+    }
+    self->remove_timer(self, iwi->listing_timer_id);
+    iwi->listing_timer_id = 0;
   }
-  ht_put(app_id_ht, strdup(app_id), HT_VALUE(1));
-  return rpc->send_forwardGetListing(rpc, iwi->connection_id, app_id);
-}
-
-void rpc_set_app(rpc_t rpc, const rpc_app_t app) {
-    iwdp_iwi_t iwi = (iwdp_iwi_t)rpc->state;
-    rpc_app_t to_app = NULL;
-    rpc_copy_app(app, &to_app);
-    iwi->app = to_app;
+  int timer_id = self->add_timer(self, (unsigned int)delay_millis, iwi);
+  if (timer_id <= 0) {
+    return self->on_error(self, "Unable to add listing timer");
+  }
+  iwi->listing_timer_id = timer_id;
+  iwi->listing_due_millis = due_millis;
+  return IWDP_SUCCESS;
+}
+
+// Send the wanted forwardGetListings, except for apps with an unanswered
+// request, which we retry after IWDP_LISTING_TIMEOUT_MILLIS.
+iwdp_status iwdp_send_listings(iwdp_t self, iwdp_iwi_t iwi) {
+  rpc_t rpc = iwi->rpc;
+  uint64_t now = sm_now_millis();
+  uint64_t next = UINT64_MAX;
+  iwdp_status ret = IWDP_SUCCESS;
+  iwdp_iapp_t *iapps = (iwdp_iapp_t *)ht_values(iwi->app_id_to_iapp);
+  iwdp_iapp_t *iap;
+  for (iap = iapps; *iap; iap++) {
+    iwdp_iapp_t iapp = *iap;
+    if (!iapp->is_listing_wanted) {
+      continue;
+    }
+    if (iapp->listing_millis &&
+        now < iapp->listing_millis + IWDP_LISTING_TIMEOUT_MILLIS) {
+      if (iapp->listing_millis + IWDP_LISTING_TIMEOUT_MILLIS < next) {
+        next = iapp->listing_millis + IWDP_LISTING_TIMEOUT_MILLIS;
+      }
+      continue;
+    }
+    iapp->is_listing_wanted = false;
+    iapp->listing_millis = now;
+    if (rpc->send_forwardGetListing(rpc, iwi->connection_id,
+          iapp->app_id)) {
+      ret = IWDP_ERROR;
+    }
+  }
+  free(iapps);
+  if (next != UINT64_MAX && iwdp_schedule_listings(self, iwi, next - now)) {
+    ret = IWDP_ERROR;
+  }
+  return ret;
+}
+
+// Ask for an app's listing after self->listing_millis, so a storm of
+// requests, e.g. as WebContent processes come and go, is sent as one
+// forwardGetListing per app.
+rpc_status iwdp_request_listing(iwdp_iwi_t iwi, iwdp_iapp_t iapp) {
+  iwdp_t self = iwi->iport->self;
+  iapp->is_listing_wanted = true;
+  return ((self->listing_millis ?
+        iwdp_schedule_listings(self, iwi, self->listing_millis) :
+        iwdp_send_listings(self, iwi)) ? RPC_ERROR : RPC_SUCCESS);
+}
+
+// Add or update an app, and request its listing if it's new.
+// @param app the reported app, or NULL if we only have the app_id
+rpc_status iwdp_add_app(rpc_t rpc, const char *app_id, const rpc_app_t app) {
+  iwdp_iwi_t iwi = (iwdp_iwi_t)rpc->state;
+  iwdp_iapp_t iapp = (iwdp_iapp_t)ht_get_value(iwi->app_id_to_iapp, app_id);
+  bool is_new = !iapp;
+  if (is_new) {
+    iapp = iwdp_iapp_new(app_id);
+    if (!iapp) {
+      return RPC_ERROR;
+    }
+    ht_put(iwi->app_id_to_iapp, iapp->app_id, iapp);
+  }
+  if (app) {
+    iwi->last_iapp = iapp;
+  }
+  return (is_new ? iwdp_request_listing(iwi, iapp) : RPC_SUCCESS);
 }
 
 rpc_status iwdp_on_applicationConnected(rpc_t rpc, const rpc_app_t app) {
-  rpc_set_app(rpc, app);
-  return iwdp_add_app_id(rpc, app->app_id);
+  return iwdp_add_app(rpc, app->app_id, app);
 }
 
 ws_status iwdp_start_devtools(iwdp_ipage_t ipage, iwdp_iws_t iws) {
@@ -1209,6 +2238,9 @@ ws_status iwdp_start_devtools(iwdp_ipage_t ipage, iwdp_iws_t iws) {
   }
   iwdp_iport_t iport = iwi->iport;
   iwdp_t self = (iport ? iport->self : NULL);
+  if (self && self->multi_client) {
+    return iwdp_join_devtools(ipage, iws);
+  }
   iwdp_iws_t iws2 = ipage->iws;
   if (iws2) {
     // steal this page from our other client, as if the page went away
@@ -1220,6 +2252,8 @@ ws_status iwdp_start_devtools(iwdp_ipage_t ipage, iwdp_iws_t iws) {
   iws->ipage = ipage;
   iws->page_num = ipage->page_num;
   ipage->iws = iws;
+  iwdp_invalidate_list(iport);
+  iwdp_notify_page(iport, "update", ipage);
   ipage->sender_id = strdup(iws->ws_id);
   if (ipage->connection_id && iwi->connection_id &&
        strcmp(ipage->connection_id, iwi->connection_id)) {
@@ -1235,6 +2269,13 @@ ws_status iwdp_start_devtools(iwdp_ipage_t ipage, iwdp_iws_t iws) {
 }
 
 ws_status iwdp_stop_devtools(iwdp_ipage_t ipage) {
+  if (ipage->num_clients) {
+    // a shared page went away, so detach all of its clients
+    while (ipage->num_clients) {
+      iwdp_leave_devtools(ipage, ipage->clients[ipage->num_clients - 1]);
+    }
+    return WS_SUCCESS;
+  }
   iwdp_iws_t iws = ipage->iws;
   if (!iws) {
     return WS_SUCCESS;
@@ -1261,48 +2302,535 @@ ws_status iwdp_stop_devtools(iwdp_ipage_t ipage) {
         iwi->connection_id, ipage->app_id,
         ipage->page_id, ipage->sender_id);
   }
+  if (iwi) {
+    rpc_forget_sender(iwi->rpc, sender_id);
+  }
   // close the ws_fd?
   iws->ipage = NULL;
   iws->page_num = 0;
   ipage->iws = NULL;
+  iwdp_invalidate_list(iport);
   ipage->sender_id = NULL;
   free(sender_id);
   return WS_SUCCESS;
 }
 
-rpc_status iwdp_remove_app_id(rpc_t rpc, const char *app_id) {
-  iwdp_iwi_t iwi = (iwdp_iwi_t)rpc->state;
-  ht_t app_id_ht = iwi->app_id_to_true;
-  char *old_app_id = ht_get_key(app_id_ht, app_id);
-  if (!old_app_id) {
-    return RPC_SUCCESS;
+// Add a client to a page's shared session, which we set up with the
+// device when the first client joins.
+ws_status iwdp_join_devtools(iwdp_ipage_t ipage, iwdp_iws_t iws) {
+  iwdp_iport_t iport = iws->iport;
+  iwdp_iwi_t iwi = iport->iwi;
+  iwdp_t self = iport->self;
+  if (ipage->num_clients >= ipage->max_clients) {
+    size_t new_max = (ipage->max_clients ? 2 * ipage->max_clients : 4);
+    iwdp_iws_t *new_clients = (iwdp_iws_t *)realloc(ipage->clients,
+        new_max * sizeof(iwdp_iws_t));
+    if (!new_clients) {
+      return self->on_error(self, "Out of memory");
+    }
+    ipage->clients = new_clients;
+    ipage->max_clients = new_max;
+  }
+  if (!ipage->num_clients) {
+    if (!ipage->command_id_to_route &&
+        !(ipage->command_id_to_route = ht_new(HT_INT_KEYS))) {
+      return self->on_error(self, "Out of memory");
+    }
+    free(ipage->sender_id);
+    if (rpc_new_uuid(&ipage->sender_id)) {
+      return self->on_error(self, "Out of memory");
+    }
+    ht_put(iwi->sender_id_to_ipage, ipage->sender_id, ipage);
+    // the device has no state for this new session
+    rc_free(ipage->replay);
+    ipage->replay = (self->replay_length ? rc_new(self->replay_length) :
+        NULL);
+  }
+  ipage->clients[ipage->num_clients++] = iws;
+  iws->ipage = ipage;
+  iws->page_num = ipage->page_num;
+  if (ipage->num_clients > 1) {
+    return WS_SUCCESS;
+  }
+  rpc_t rpc = iwi->rpc;
+  return rpc->send_forwardSocketSetup(rpc,
+      iwi->connection_id,
+      ipage->app_id, ipage->page_id, ipage->sender_id);
+}
+
+// Forget a shared page's pending commands, either all of them or just a
+// client's, whose responses we'll then drop.
+void iwdp_ipage_remove_routes(iwdp_ipage_t ipage, iwdp_iws_t iws) {
+  ht_t route_ht = ipage->command_id_to_route;
+  if (!route_ht || !ht_size(route_ht)) {
+    return;
+  }
+  void **keys = ht_keys(route_ht);
+  void **kp;
+  for (kp = keys; kp && *kp; kp++) {
+    iwdp_route_t route = (iwdp_route_t)ht_get_value(route_ht, *kp);
+    if (!iws || route->iws == iws) {
+      ht_remove(route_ht, *kp);
+      iwdp_route_free(route);
+    }
+  }
+  free(keys);
+}
+
+// @result a screencast frame's sessionId, else -1
+int iwdp_get_session_id(const char *data, size_t length) {
+  static const char *params_key[] = {"params"};
+  static const char *session_key[] = {"sessionId"};
+  const char *params;
+  size_t params_length;
+  const char *value;
+  size_t value_length;
+  if (js_find_key(data, length, params_key, 1, &params, &params_length) ||
+      js_find_key(params, params_length, session_key, 1,
+        &value, &value_length) ||
+      !value_length || !isdigit((unsigned char)*value)) {
+    return -1;
+  }
+  // the value is followed by a ',' or '}'
+  return (int)strtol(value, NULL, 10);
+}
+
+// Ack a screencast frame on our clients' behalf.  Our ack's response has
+// a negative id, which we then drop.
+ws_status iwdp_ipage_send_frame_ack(iwdp_iwi_t iwi, iwdp_ipage_t ipage,
+    int session_id) {
+  if (!iwi || !ipage->sender_id) {
+    return WS_SUCCESS;
+  }
+  char *s = NULL;
+  if (asprintf(&s, "{\"id\":%d,\"method\":\"Page.screencastFrameAck\","
+        "\"params\":{\"sessionId\":%d}}", IWDP_ACK_ID, session_id) < 0) {
+    return WS_ERROR;
+  }
+  rpc_t rpc = iwi->rpc;
+  ws_status ret = rpc->send_forwardSocketData(rpc,
+      iwi->connection_id,
+      ipage->app_id, ipage->page_id, ipage->sender_id,
+      s, strlen(s));
+  free(s);
+  return ret;
+}
+
+// Note that we're sending a screencast frame to all of a shared page's
+// clients.  If we're out of memory, each client that drops the frame will
+// instead ack it, as for an unshared page.
+void iwdp_ipage_add_frame(iwdp_ipage_t ipage, int session_id) {
+  if (!ipage->session_id_to_frame &&
+      !(ipage->session_id_to_frame = ht_new(HT_INT_KEYS))) {
+    return;
+  }
+  iwdp_frame_t frame = (iwdp_frame_t)malloc(sizeof(struct iwdp_frame_struct));
+  iwdp_iws_t *clients = (iwdp_iws_t *)malloc(
+      ipage->num_clients * sizeof(iwdp_iws_t));
+  if (!frame || !clients) {
+    free(frame);
+    free(clients);
+    return;
+  }
+  memcpy(clients, ipage->clients, ipage->num_clients * sizeof(iwdp_iws_t));
+  frame->session_id = session_id;
+  frame->clients = clients;
+  frame->num_clients = ipage->num_clients;
+  iwdp_frame_free((iwdp_frame_t)ht_put(ipage->session_id_to_frame,
+        HT_KEY(session_id), frame));
+}
+
+// Note that a client has acked or dropped a shared page's screencast
+// frame.
+// @param to_is_last set if it was the last of the frame's clients to do so,
+//   so the device should now get the frame's one ack
+// @result false if we aren't tracking this frame
+bool iwdp_ipage_on_frame_ack(iwdp_ipage_t ipage, iwdp_iws_t iws,
+    int session_id, bool *to_is_last) {
+  *to_is_last = false;
+  iwdp_frame_t frame = (ipage->session_id_to_frame ?
+      (iwdp_frame_t)ht_get_value(ipage->session_id_to_frame,
+        HT_KEY(session_id)) : NULL);
+  if (!frame) {
+    return false;
+  }
+  size_t i;
+  for (i = 0; i < frame->num_clients && frame->clients[i] != iws; i++) {
+  }
+  if (i < frame->num_clients) {
+    frame->clients[i] = frame->clients[--frame->num_clients];
+    if (!frame->num_clients) {
+      ht_remove(ipage->session_id_to_frame, HT_KEY(session_id));
+      iwdp_frame_free(frame);
+      *to_is_last = true;
+    }
+  }
+  return true;
+}
+
+// Forget a shared page's unacked frames, either all of them or just a
+// departed client's share of them, acking the frames that our remaining
+// clients are done with.
+void iwdp_ipage_remove_frames(iwdp_ipage_t ipage, iwdp_iws_t iws) {
+  ht_t frame_ht = ipage->session_id_to_frame;
+  if (!frame_ht || !ht_size(frame_ht)) {
+    return;
+  }
+  iwdp_frame_t *frames = (iwdp_frame_t *)ht_values(frame_ht);
+  iwdp_frame_t *fp;
+  for (fp = frames; fp && *fp; fp++) {
+    iwdp_frame_t frame = *fp;
+    int session_id = frame->session_id;
+    bool is_last = false;
+    if (!iws) {
+      ht_remove(frame_ht, HT_KEY(session_id));
+      iwdp_frame_free(frame);
+    } else if (iwdp_ipage_on_frame_ack(ipage, iws, session_id, &is_last) &&
+        is_last && ipage->num_clients) {
+      iwdp_ipage_send_frame_ack(iws->iport->iwi, ipage, session_id);
+    }
+  }
+  free(frames);
+}
+
+// @result true if any of a shared page's clients, other than iws, has
+// enabled this domain
+bool iwdp_ipage_is_enabled(iwdp_ipage_t ipage, iwdp_iws_t iws,
+    const char *domain) {
+  size_t i;
+  for (i = 0; i < ipage->num_clients; i++) {
+    iwdp_iws_t iws2 = ipage->clients[i];
+    if (iws2 != iws && iws2->enabled_domains &&
+        ht_get_value(iws2->enabled_domains, domain)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Disable a domain for a shared page's session, on behalf of a client
+// that left without disabling it, unless another client still uses it.
+ws_status iwdp_ipage_disable(iwdp_ipage_t ipage, iwdp_iws_t iws,
+    const char *domain) {
+  iwdp_iwi_t iwi = iws->iport->iwi;
+  if (!ipage->num_clients || !iwi || !iwi->connection_id ||
+      (ipage->connection_id &&
+       strcmp(ipage->connection_id, iwi->connection_id)) ||
+      iwdp_ipage_is_enabled(ipage, iws, domain)) {
+    return WS_SUCCESS;
+  }
+  char *s = NULL;
+  if (asprintf(&s, "{\"id\":%d,\"method\":\"%s.disable\"}",
+        IWDP_ACK_ID, domain) < 0) {
+    return WS_ERROR;
+  }
+  if (ipage->replay) {
+    rc_set_enabled(ipage->replay, domain, strlen(domain), false);
+  }
+  rpc_t rpc = iwi->rpc;
+  ws_status ret = rpc->send_forwardSocketData(rpc,
+      iwi->connection_id,
+      ipage->app_id, ipage->page_id, ipage->sender_id,
+      s, strlen(s));
+  free(s);
+  return ret;
+}
+
+// Forget the domains that a client enabled, disabling those that no other
+// client of its shared page has enabled.
+void iwdp_iws_clear_domains(iwdp_iws_t iws, iwdp_ipage_t ipage) {
+  if (!iws->enabled_domains) {
+    return;
+  }
+  char **domains = (char **)ht_keys(iws->enabled_domains);
+  char **dp;
+  for (dp = domains; dp && *dp; dp++) {
+    if (ipage) {
+      iwdp_ipage_disable(ipage, iws, *dp);
+    }
+    free(ht_remove(iws->enabled_domains, *dp));
   }
-  ht_remove(app_id_ht, app_id);
+  free(domains);
+  ht_free(iws->enabled_domains);
+  iws->enabled_domains = NULL;
+}
+
+// Remove a client from a page's shared session, which we close with the
+// device once the last client leaves.
+void iwdp_leave_devtools(iwdp_ipage_t ipage, iwdp_iws_t iws) {
+  size_t i;
+  for (i = 0; i < ipage->num_clients && ipage->clients[i] != iws; i++) {
+  }
+  if (i == ipage->num_clients) {
+    return; // internal error?
+  }
+  ipage->clients[i] = ipage->clients[--ipage->num_clients];
+  iws->ipage = NULL;
+  iwdp_ipage_remove_routes(ipage, iws);
+  iwdp_iws_clear_domains(iws, ipage);
+  iwdp_ipage_remove_frames(ipage, iws);
+  if (ipage->num_clients) {
+    return;
+  }
+  iwdp_ipage_remove_frames(ipage, NULL);
+  iwdp_iwi_t iwi = iws->iport->iwi;
+  if (iwi) {
+    if (iwi->connection_id && (!ipage->connection_id ||
+          !strcmp(ipage->connection_id, iwi->connection_id))) {
+      // as in iwdp_stop_devtools
+      rpc_t rpc = iwi->rpc;
+      rpc->send_forwardDidClose(rpc,
+          iwi->connection_id, ipage->app_id,
+          ipage->page_id, ipage->sender_id);
+    }
+    rpc_forget_sender(iwi->rpc, ipage->sender_id);
+    ht_remove(iwi->sender_id_to_ipage, ipage->sender_id);
+  }
+  free(ipage->sender_id);
+  ipage->sender_id = NULL;
+  rc_free(ipage->replay);
+  ipage->replay = NULL;
+}
+
+// Copy a message with one of its values replaced, e.g. a command's id.
+// @param value the value to replace, within data
+static char *iwdp_replace_value(const char *data, size_t length,
+    const char *value, size_t value_length,
+    const char *new_value, size_t new_length, size_t *to_length) {
+  size_t head_length = value - data;
+  size_t tail_length = length - head_length - value_length;
+  size_t n = head_length + new_length + tail_length;
+  char *s = (char *)malloc(n);
+  if (s) {
+    memcpy(s, data, head_length);
+    memcpy(s + head_length, new_value, new_length);
+    memcpy(s + head_length + new_length, value + value_length, tail_length);
+    *to_length = n;
+  }
+  return s;
+}
+
+// Send a cached event to a client that joined a shared page late.
+int iwdp_iws_on_replay(void *arg, const char *data, size_t length) {
+  static const char *method_key[] = {"method"};
+  iwdp_iws_t iws = (iwdp_iws_t)arg;
+  const char *method = NULL;
+  size_t method_length = 0;
+  js_find_key(data, length, method_key, 1, &method, &method_length);
+  return iwdp_iws_send_data(iws->iport->self, iws, data, length, false,
+      method, method_length);
+}
+
+// Tell a client that joined a shared page late that we couldn't cache a
+// domain's events, e.g. too many scripts, so its view will be incomplete.
+ws_status iwdp_iws_send_replay_full(iwdp_t self, iwdp_iws_t iws,
+    const char *domain) {
+  self->on_error(self, "Not replaying %s events to %s, which exceeded"
+      " the replay cache", domain, iws->ws_id);
+  char *s = NULL;
+  if (asprintf(&s, "{\"method\":\"Console.messageAdded\",\"params\":"
+        "{\"message\":{\"source\":\"other\",\"level\":\"warning\","
+        "\"text\":\"ios_webkit_debug_proxy: this page's %s events exceeded"
+        " the replay cache, so this client is missing them\"}}}",
+        domain) < 0) {
+    return WS_ERROR;
+  }
+  ws_status ret = iwdp_iws_send_data(self, iws, s, strlen(s), false,
+      "Console.messageAdded", 20);
+  free(s);
+  return ret;
+}
+
+// Note a client's "<domain>.enable" or "<domain>.disable" command.  The
+// device only knows about the shared session, so a domain is enabled
+// while any of the page's clients has it enabled, and a client that
+// enables it after another client is sent its cached events, once.
+// @param to_is_local set if another client still has the domain enabled,
+// so we should answer a disable ourselves instead of forwarding it
+ws_status iwdp_iws_on_enable(iwdp_t self, iwdp_iws_t iws,
+    iwdp_ipage_t ipage, const char *method, size_t method_length,
+    bool *to_is_local) {
+  *to_is_local = false;
+  const char *dot = (const char *)memchr(method, '.', method_length);
+  if (!dot) {
+    return WS_SUCCESS;
+  }
+  const char *command = dot + 1;
+  size_t command_length = method_length - (command - method);
+  bool is_enable = (command_length == 6 && !strncmp(command, "enable", 6));
+  if (!is_enable &&
+      !(command_length == 7 && !strncmp(command, "disable", 7))) {
+    return WS_SUCCESS;
+  }
+  size_t domain_length = dot - method;
+  char *domain = strndup(method, domain_length);
+  if (!domain) {
+    return self->on_error(self, "Out of memory");
+  }
+  bool is_mine = (iws->enabled_domains &&
+      ht_get_value(iws->enabled_domains, domain));
+  bool is_shared = iwdp_ipage_is_enabled(ipage, iws, domain);
+  rc_t replay = ipage->replay;
+  if (!is_enable) {
+    if (is_mine) {
+      free(ht_remove(iws->enabled_domains, domain));
+    }
+    *to_is_local = is_shared;
+    if (replay && !is_shared) {
+      rc_set_enabled(replay, domain, domain_length, false);
+    }
+    free(domain);
+    return WS_SUCCESS;
+  }
+  ws_status ret = WS_SUCCESS;
+  if (!replay || is_mine) {
+    // we've already given this client the domain's events
+  } else if (!is_shared) {
+    rc_set_enabled(replay, domain, domain_length, true);
+  } else if (rc_is_full(replay, domain, domain_length)) {
+    ret = iwdp_iws_send_replay_full(self, iws, domain);
+  } else {
+    ret = rc_replay(replay, domain, domain_length, iwdp_iws_on_replay, iws);
+  }
+  if (is_mine) {
+    free(domain);
+  } else if (!iws->enabled_domains &&
+      !(iws->enabled_domains = ht_new(HT_STRING_KEYS))) {
+    free(domain);
+    return self->on_error(self, "Out of memory");
+  } else {
+    ht_put(iws->enabled_domains, domain, domain);
+  }
+  return ret;
+}
+
+// Forward a client's command to a shared page under an id of our own, so
+// our clients' ids can't collide, and remember whom to answer.
+//
+// The device doesn't know that the session is shared, so a client's
+// "<domain>.disable" would disable the domain for all of our clients.  We
+// instead answer it ourselves until the domain's last client disables it.
+// Likewise, we only forward a screencast frame's last ack.
+ws_status iwdp_ipage_send_command(iwdp_t self, iwdp_ipage_t ipage,
+    iwdp_iws_t iws, const char *data, size_t length) {
+  static const char *id_key[] = {"id"};
+  static const char *method_key[] = {"method"};
+  iwdp_iwi_t iwi = iws->iport->iwi;
+  rpc_t rpc = iwi->rpc;
+  const char *method;
+  size_t method_length;
+  bool has_method = !js_find_key(data, length, method_key, 1,
+      &method, &method_length);
+  bool is_local = false;
+  if (has_method && iwdp_iws_on_enable(self, iws, ipage, method,
+        method_length, &is_local)) {
+    return WS_ERROR;
+  }
+  if (has_method && method_length == 23 &&
+      !strncmp(method, "Page.screencastFrameAck", 23)) {
+    // the device only wants the frame's last ack
+    int session_id = iwdp_get_session_id(data, length);
+    bool is_last = false;
+    is_local = (session_id >= 0 &&
+        iwdp_ipage_on_frame_ack(ipage, iws, session_id, &is_last) &&
+        !is_last);
+  }
+  const char *id;
+  size_t id_length;
+  bool has_id = !js_find_key(data, length, id_key, 1, &id, &id_length);
+  if (has_id && id > data && id[-1] == '"') {
+    // keep a string id's quotes
+    id--;
+    id_length += 2;
+  }
+  if (is_local) {
+    if (!has_id) {
+      return WS_SUCCESS;
+    }
+    char *s = NULL;
+    if (asprintf(&s, "{\"id\":%.*s,\"result\":{}}", (int)id_length,
+          id) < 0) {
+      return self->on_error(self, "Out of memory");
+    }
+    ws_status ret = iwdp_iws_send_data(self, iws, s, strlen(s), true,
+        NULL, 0);
+    free(s);
+    return ret;
+  }
+  if (!has_id) {
+    // no response to route
+    return rpc->send_forwardSocketData(rpc,
+        iwi->connection_id,
+        ipage->app_id, ipage->page_id, ipage->sender_id,
+        data, length);
+  }
+  iwdp_route_t route = (iwdp_route_t)malloc(sizeof(struct iwdp_route_struct));
+  if (!route || !(route->id = strndup(id, id_length))) {
+    free(route);
+    return self->on_error(self, "Out of memory");
+  }
+  route->iws = iws;
+  if (!++ipage->max_command_id) {
+    ++ipage->max_command_id;
+  }
+  uint32_t command_id = ipage->max_command_id;
+  char new_id[16];
+  int new_id_length = snprintf(new_id, sizeof(new_id), "%u", command_id);
+  size_t n;
+  char *s = iwdp_replace_value(data, length, id, id_length,
+      new_id, new_id_length, &n);
+  if (!s) {
+    iwdp_route_free(route);
+    return self->on_error(self, "Out of memory");
+  }
+  // a wrapped id replaces a route that was never answered
+  iwdp_route_free((iwdp_route_t)ht_put(ipage->command_id_to_route,
+        HT_KEY(command_id), route));
+  ws_status ret = rpc->send_forwardSocketData(rpc,
+      iwi->connection_id,
+      ipage->app_id, ipage->page_id, ipage->sender_id,
+      s, n);
+  free(s);
+  return ret;
+}
+
+void iwdp_remove_ipage(iwdp_iwi_t iwi, ht_t page_id_ht, iwdp_ipage_t ipage) {
+  iwdp_invalidate_list(iwi->iport);
+  iwdp_notify_page(iwi->iport, "remove", ipage);
+  iwdp_stop_devtools(ipage);
+  ht_remove(page_id_ht, HT_KEY(ipage->page_id));
+  ht_remove(iwi->page_num_to_ipage, HT_KEY(ipage->page_num));
+  iwdp_ipage_free(ipage);
+}
+
+void iwdp_remove_iapp(iwdp_iwi_t iwi, iwdp_iapp_t iapp) {
   // remove pages with this app_id
-  ht_t ipage_ht = iwi->page_num_to_ipage;
-  iwdp_ipage_t *ipages = (iwdp_ipage_t *)ht_values(ipage_ht);
+  ht_t page_id_ht = iapp->page_id_to_ipage;
+  iwdp_ipage_t *ipages = (iwdp_ipage_t *)ht_values(page_id_ht);
   iwdp_ipage_t *ipp;
   for (ipp = ipages; *ipp; ipp++) {
-    iwdp_ipage_t ipage = *ipp;
-    if (!strcmp(app_id, ipage->app_id)) {
-      iwdp_stop_devtools(ipage);
-      ht_remove(ipage_ht, HT_KEY(ipage->page_num));
-      iwdp_ipage_free(ipage);
-    }
+    iwdp_remove_ipage(iwi, page_id_ht, *ipp);
   }
   free(ipages);
-  // free this last, in case old_app_id == app_id
-  free(old_app_id);
-  return RPC_SUCCESS;
+  ht_remove(iwi->app_id_to_iapp, iapp->app_id);
+  if (iwi->last_iapp == iapp) {
+    iwi->last_iapp = NULL;
+  }
+  iwdp_iapp_free(iapp);
 }
 
 rpc_status iwdp_on_applicationDisconnected(rpc_t rpc, const rpc_app_t app) {
-  return iwdp_remove_app_id(rpc, app->app_id);
+  iwdp_iwi_t iwi = (iwdp_iwi_t)rpc->state;
+  iwdp_iapp_t iapp = (iwdp_iapp_t)ht_get_value(iwi->app_id_to_iapp,
+      app->app_id);
+  if (iapp) {
+    iwdp_remove_iapp(iwi, iapp);
+  }
+  return RPC_SUCCESS;
 }
 
 rpc_status iwdp_on_reportConnectedApplicationList(rpc_t rpc, const rpc_app_t *apps) {
   iwdp_iwi_t iwi = (iwdp_iwi_t)rpc->state;
-  ht_t app_id_ht = iwi->app_id_to_true;
 
   // rpc_reportSetup never comes from iOS >= 11.3
   if (!iwi->connected) {
@@ -1314,24 +2842,30 @@ rpc_status iwdp_on_reportConnectedApplicationList(rpc_t rpc, const rpc_app_t *ap
     return RPC_SUCCESS;
   }
 
+  // index the reported apps, so we can find the old ones without a scan
+  ht_t reported_ht = ht_new(HT_STRING_KEYS);
+  if (!reported_ht) {
+    return RPC_ERROR;
+  }
+  const rpc_app_t *a;
+  for (a = apps; *a; a++) {
+    ht_put(reported_ht, (*a)->app_id, *a);
+  }
+
   // remove old apps
-  char **old_app_ids = (char **)ht_keys(app_id_ht);
-  char **oa;
-  for (oa = old_app_ids; *oa; oa++) {
-    const rpc_app_t *a;
-    for (a = apps; *a && strcmp((*a)->app_id, *oa); a++) {
-    }
-    if (!*a) {
-      iwdp_remove_app_id(rpc, *oa);
+  iwdp_iapp_t *iapps = (iwdp_iapp_t *)ht_values(iwi->app_id_to_iapp);
+  iwdp_iapp_t *iap;
+  for (iap = iapps; *iap; iap++) {
+    if (!ht_get_value(reported_ht, (*iap)->app_id)) {
+      iwdp_remove_iapp(iwi, *iap);
     }
   }
-  free(old_app_ids);
+  free(iapps);
+  ht_free(reported_ht);
 
-  // add new apps
-  const rpc_app_t *a;
+  // add new apps and update the rest, which doesn't re-request listings
   for (a = apps; *a; a++) {
-    rpc_set_app(rpc, *a);
-    iwdp_add_app_id(rpc, (*a)->app_id);
+    iwdp_add_app(rpc, (*a)->app_id, *a);
   }
   return RPC_SUCCESS;
 }
@@ -1344,42 +2878,62 @@ rpc_status iwdp_on_applicationSentListing(rpc_t rpc,
   if (!self) {
     return RPC_ERROR;  // Inspector closed?
   }
-  if (!ht_get_value(iwi->app_id_to_true, app_id)) {
-    iwdp_iwi_t iwi = (iwdp_iwi_t)rpc->state;
-    rpc_app_t app = iwi->app;
-    if (app) {
-      return rpc->send_forwardGetListing(rpc, iwi->connection_id, app->app_id);
+  iwdp_iapp_t iapp = (iwdp_iapp_t)ht_get_value(iwi->app_id_to_iapp, app_id);
+  if (!iapp) {
+    iwdp_iapp_t last_iapp = iwi->last_iapp;
+    if (last_iapp) {
+      return iwdp_request_listing(iwi, last_iapp);
     }
     return self->on_error(self, "Unknown app_id %s", app_id);
   }
-  ht_t ipage_ht = iwi->page_num_to_ipage;
-  iwdp_ipage_t *ipages = (iwdp_ipage_t *)ht_values(ipage_ht);
+  ht_t page_id_ht = iapp->page_id_to_ipage;
+
+  // our request was answered, so send any that came in since
+  iapp->listing_millis = 0;
+  if (iapp->is_listing_wanted) {
+    iwdp_request_listing(iwi, iapp);
+  }
 
-  // add new pages
+  // add new pages and update changed ones, marking each with this listing
+  uint32_t listing_num = ++iwi->max_listing_num;
+  size_t num_listed = 0;
   const rpc_page_t *pp;
   for (pp = pages; *pp; pp++) {
     const rpc_page_t page = *pp;
-    // find page with this app_id & page_id
-    iwdp_ipage_t ipage = NULL;
-    iwdp_ipage_t *ipp;
-    for (ipp = ipages; *ipp; ipp++) {
-      if ((*ipp)->page_id == page->page_id &&
-          !strcmp(app_id, (*ipp)->app_id)) {
-        ipage = *ipp;
-        break;
-      }
-    }
-    if (!ipage) {
+    iwdp_ipage_t ipage = (iwdp_ipage_t)ht_get_value(page_id_ht,
+        HT_KEY(page->page_id));
+    size_t old_memory = 0;
+    bool is_new = !ipage;
+    if (is_new) {
       // new page
       ipage = iwdp_ipage_new();
-      ipage->app_id = strdup(app_id);
+      if (!ipage || !(ipage->app_id = strdup(app_id))) {
+        iwdp_ipage_free(ipage);
+        return self->on_error(self, "Out of memory");
+      }
       ipage->page_id = page->page_id;
       ipage->page_num = ++iwi->max_page_num;
-      ht_put(ipage_ht, HT_KEY(ipage->page_num), ipage);
+      ht_put(page_id_ht, HT_KEY(ipage->page_id), ipage);
+      ht_put(iwi->page_num_to_ipage, HT_KEY(ipage->page_num), ipage);
+      iwdp_invalidate_list(iport);
+    } else if (ipage->listing_num == listing_num) {
+      continue;  // listed twice?
+    } else {
+      old_memory = iwdp_ipage_get_memory(ipage);
+    }
+    ipage->listing_num = listing_num;
+    num_listed++;
+    if ((iwdp_update_string(&ipage->title, page->title) |
+         iwdp_update_string(&ipage->url, page->url) |
+         iwdp_update_string(&ipage->connection_id, page->connection_id)) ||
+        !old_memory) {
+      iwdp_invalidate_list(iport);
+      mb_remove(MB_PAGES, old_memory);
+      mb_add(MB_PAGES, iwdp_ipage_get_memory(ipage));
+      iwdp_notify_page(iport, (is_new ? "add" : "update"), ipage);
     }
-    iwdp_update_string(&ipage->title, page->title);
-    iwdp_update_string(&ipage->url, page->url);
-    if (ipage->iws && page->connection_id && iwi->connection_id &&
+    if ((ipage->iws || ipage->num_clients) && page->connection_id &&
+        iwi->connection_id &&
         strcmp(iwi->connection_id, page->connection_id)) {
       // a remote inspector stole stole our page?
       char *s;
@@ -1389,49 +2943,440 @@ rpc_status iwdp_on_applicationSentListing(rpc_t rpc,
       }
       self->on_error(self, "%s", s);
       free(s);
-      ipage->iws->ipage = NULL;
+      if (ipage->iws) {
+        ipage->iws->ipage = NULL;
+        rpc_forget_sender(rpc, ipage->sender_id);
+      }
+      // detach a shared page's clients, without closing the remote's
+      // session, now that ipage->connection_id is the remote's
+      while (ipage->num_clients) {
+        iwdp_leave_devtools(ipage, ipage->clients[ipage->num_clients - 1]);
+      }
     }
-    iwdp_update_string(&ipage->connection_id, page->connection_id);
   }
 
-  // remove old pages
-  iwdp_ipage_t *ipp;
-  for (ipp = ipages; *ipp; ipp++) {
-    iwdp_ipage_t ipage = *ipp;
-    if (strcmp(ipage->app_id, app_id)) {
-      continue;
+  // remove old pages, which we only need to look for if this app has
+  // more pages than were listed
+  if (ht_size(page_id_ht) > num_listed) {
+    iwdp_ipage_t *ipages = (iwdp_ipage_t *)ht_values(page_id_ht);
+    iwdp_ipage_t *ipp;
+    for (ipp = ipages; *ipp; ipp++) {
+      if ((*ipp)->listing_num != listing_num) {
+        iwdp_remove_ipage(iwi, page_id_ht, *ipp);
+      }
     }
-    const rpc_page_t *pp;
-    for (pp = pages; *pp && (*pp)->page_id != ipage->page_id; pp++) {
+    free(ipages);
+  }
+
+  return RPC_SUCCESS;
+}
+
+// Send a device message to our client, fragmented so our ws buffer stays
+// small and the client can interleave control frames.
+// @param is_priority true for a command response, which may skip ahead of
+//   events that are queued for a slow client
+ws_status iwdp_iws_send_text(iwdp_t self, iwdp_iws_t iws,
+    const char *data, size_t length, bool is_priority) {
+  ws_t ws = iws->ws;
+  size_t max_length = self->max_frame_length;
+  iwdp_send_flags flags = (is_priority && ws->can_reorder(ws) ?
+      IWDP_SEND_PRIORITY : 0);
+  const char *head = data;
+  const char *tail = data + length;
+  ws_status ret = WS_SUCCESS;
+  do {
+    size_t n = tail - head;
+    if (max_length && n > max_length) {
+      n = max_length;
     }
-    if (!*pp) {
-      iwdp_stop_devtools(ipage);
-      ht_remove(ipage_ht, HT_KEY(ipage->page_num));
-      iwdp_ipage_free(ipage);
+    bool is_fin = (head + n == tail);
+    iws->send_flags = flags | (is_fin ? 0 : IWDP_SEND_MORE);
+    ret = ws->send_frame(ws,
+          is_fin, OPCODE_TEXT, false,
+          head, n);
+    head += n;
+  } while (!ret && head < tail);
+  iws->send_flags = 0;
+  iws->message_millis = sm_now_millis();
+  return ret;
+}
+
+// Events that a later event makes obsolete, which we can drop outright.
+// We drop every such event while our client is behind, and the client
+// resumes with the first one after it catches up.
+static const char *iwdp_superseded_methods[] = {
+  "Page.screencastFrame",
+  NULL
+};
+
+// High-rate events that we can thin out.
+static const char *iwdp_sampled_methods[] = {
+  "Network.dataReceived",
+  "Timeline.eventRecorded",
+  NULL
+};
+
+static bool iwdp_is_method(const char **methods,
+    const char *method, size_t method_length) {
+  const char **m;
+  for (m = methods; *m; m++) {
+    if (strlen(*m) == method_length &&
+        !strncmp(*m, method, method_length)) {
+      return true;
     }
   }
-  free(ipages);
+  return false;
+}
+
+// Decide if we should drop a device event because our client is too far
+// behind, or we're over our memory budget.
+bool iwdp_iws_drop(iwdp_t self, iwdp_iws_t iws,
+    const char *method, size_t method_length) {
+  if ((!self->drop_watermark ||
+       self->get_send_length(self, iws->ws_fd) <= self->drop_watermark) &&
+      mb_has_room(0)) {
+    return false;
+  }
+  if (iwdp_is_method(iwdp_superseded_methods, method, method_length)) {
+    return true;
+  }
+  if (iwdp_is_method(iwdp_sampled_methods, method, method_length)) {
+    unsigned int rate = self->drop_sample_rate;
+    return (rate > 1 && (iws->num_sampled++ % rate) != 0);
+  }
+  return false;
+}
+
+// Ack a screencast frame that we dropped, as our client would have, so
+// the device doesn't stop sending frames.  A shared page's frame is only
+// acked once all of the clients that we sent it to are done with it.
+ws_status iwdp_iws_ack_frame(iwdp_t self, iwdp_iws_t iws,
+    const char *data, size_t length) {
+  iwdp_ipage_t ipage = iws->ipage;
+  int session_id = iwdp_get_session_id(data, length);
+  bool is_last = false;
+  if (!ipage || session_id < 0 || (ipage->num_clients &&
+        iwdp_ipage_on_frame_ack(ipage, iws, session_id, &is_last) &&
+        !is_last)) {
+    return WS_SUCCESS;
+  }
+  return iwdp_ipage_send_frame_ack(iws->iport->iwi, ipage, session_id);
+}
+
+// Tell our client how many events we've dropped since our last notice.
+ws_status iwdp_iws_send_dropped(iwdp_t self, iwdp_iws_t iws) {
+  char *data = NULL;
+  if (asprintf(&data,
+        "{\"method\":\"Proxy.eventsDropped\",\"params\":{\"count\":%zu}}",
+        iws->num_dropped) < 0) {
+    return WS_ERROR;
+  }
+  iws->num_dropped = 0;
+  ws_status ret = iwdp_iws_send_text(self, iws, data, strlen(data), false);
+  free(data);
+  return ret;
+}
 
+// Idempotent update events, where a later event for the same target makes
+// an earlier one redundant: {method, params key, optional params key}.
+static const char *iwdp_coalesced_methods[][3] = {
+  {"DOM.attributeModified", "nodeId", "name"},
+  {"DOM.characterDataModified", "nodeId", NULL},
+  {"DOM.childNodeCountUpdated", "nodeId", NULL},
+  {"CSS.styleSheetChanged", "styleSheetId", NULL},
+  {NULL, NULL, NULL}
+};
+
+// A held event, see iwdp_iws_batch.
+struct iwdp_batch_struct {
+  char *data;
+  size_t length;
+  // e.g. "DOM.attributeModified 12 class" if a later event can replace
+  // this one, otherwise NULL
+  char *key;
+};
+
+// Get an event's coalescing key.
+// @param to_key set to a new string, or NULL if the event can't be
+//   coalesced
+iwdp_status iwdp_get_coalesce_key(const char *data, size_t length,
+    const char *method, size_t method_length, char **to_key) {
+  static const char *params_key[] = {"params"};
+  *to_key = NULL;
+  size_t i;
+  for (i = 0; iwdp_coalesced_methods[i][0]; i++) {
+    const char **m = iwdp_coalesced_methods[i];
+    if (strlen(m[0]) == method_length &&
+        !strncmp(m[0], method, method_length)) {
+      break;
+    }
+  }
+  const char **m = iwdp_coalesced_methods[i];
+  const char *params;
+  size_t params_length;
+  if (!m[0] ||
+      js_find_key(data, length, params_key, 1, &params, &params_length)) {
+    return IWDP_SUCCESS;
+  }
+  const char *v1 = "";
+  const char *v2 = "";
+  size_t v1_length = 0;
+  size_t v2_length = 0;
+  if (js_find_key(params, params_length, m + 1, 1, &v1, &v1_length) ||
+      (m[2] && js_find_key(params, params_length, m + 2, 1, &v2,
+          &v2_length))) {
+    return IWDP_SUCCESS;
+  }
+  if (asprintf(to_key, "%s %.*s %.*s", m[0], (int)v1_length, v1,
+        (int)v2_length, v2) < 0) {
+    *to_key = NULL;
+    return IWDP_ERROR;
+  }
+  return IWDP_SUCCESS;
+}
+
+// Send our held events in a single write.  Each event is still its own
+// websocket message, since that's what devtools clients expect.
+ws_status iwdp_iws_flush(iwdp_t self, iwdp_iws_t iws) {
+  if (iws->batch_timer_id) {
+    self->remove_timer(self, iws->batch_timer_id);
+    iws->batch_timer_id = 0;
+  }
+  if (!iws->num_batch) {
+    return WS_SUCCESS;
+  }
+  if (!iws->batch_out) {
+    iws->batch_out = cb_new();
+    if (!iws->batch_out) {
+      return iws->ws->on_error(iws->ws, "Out of memory");
+    }
+    iws->batch_out->tag = MB_WEBSOCKET;
+  }
+  cb_t out = iws->batch_out;
+  ws_status ret = WS_SUCCESS;
+  size_t i;
+  for (i = 0; i < iws->num_batch; i++) {
+    struct iwdp_batch_struct *b = iws->batch + i;
+    if (!ret) {
+      ret = iwdp_iws_send_text(self, iws, b->data, b->length, false);
+    }
+    mb_remove(MB_WEBSOCKET, b->length);
+    free(b->data);
+    free(b->key);
+  }
+  iws->num_batch = 0;
+  iws->batch_length = 0;
+  iws->batch_out = NULL;
+  if (!ret && out->tail > out->head &&
+      self->send(self, iws->ws_fd, out->head, out->tail - out->head, 0)) {
+    ret = iws->ws->on_error(iws->ws, "Unable to send %zd bytes of data",
+        out->tail - out->head);
+  }
+  cb_clear(out);
+  iws->batch_out = out;
+  return ret;
+}
+
+// Hold a device event for a remote client, replacing any held event that
+// it makes redundant, and flush after batch_millis or once we're holding
+// max_frame_length bytes, so a burst of events costs one write instead of
+// one per event.
+ws_status iwdp_iws_batch(iwdp_t self, iwdp_iws_t iws,
+    const char *data, size_t length,
+    const char *method, size_t method_length) {
+  char *key;
+  if (iwdp_get_coalesce_key(data, length, method, method_length, &key)) {
+    return iws->ws->on_error(iws->ws, "Out of memory");
+  }
+  struct iwdp_batch_struct *b = NULL;
+  size_t i;
+  for (i = 0; key && i < iws->num_batch; i++) {
+    if (iws->batch[i].key && !strcmp(iws->batch[i].key, key)) {
+      b = iws->batch + i;
+      break;
+    }
+  }
+  if (b) {
+    // replace the held event where it is, so it keeps its order relative
+    // to the events that we've held since
+    char *new_data = (char *)malloc(length);
+    free(key);
+    if (!new_data) {
+      return iws->ws->on_error(iws->ws, "Out of memory");
+    }
+    memcpy(new_data, data, length);
+    iws->batch_length -= b->length;
+    mb_remove(MB_WEBSOCKET, b->length);
+    free(b->data);
+    b->data = new_data;
+    b->length = length;
+    mb_add(MB_WEBSOCKET, length);
+    iws->batch_length += length;
+  } else {
+    if (iws->num_batch >= iws->max_batch) {
+      size_t new_max = (iws->max_batch ? 2 * iws->max_batch : 16);
+      struct iwdp_batch_struct *new_batch = (struct iwdp_batch_struct *)
+        realloc(iws->batch, new_max * sizeof(struct iwdp_batch_struct));
+      if (!new_batch) {
+        free(key);
+        return iws->ws->on_error(iws->ws, "Out of memory");
+      }
+      iws->batch = new_batch;
+      iws->max_batch = new_max;
+    }
+    b = iws->batch + iws->num_batch;
+    b->data = (char *)malloc(length);
+    if (!b->data) {
+      free(key);
+      return iws->ws->on_error(iws->ws, "Out of memory");
+    }
+    memcpy(b->data, data, length);
+    mb_add(MB_WEBSOCKET, length);
+    b->length = length;
+    b->key = key;
+    iws->num_batch++;
+    iws->batch_length += length;
+  }
+
+  size_t max_length = (self->max_frame_length ? self->max_frame_length :
+      65536);
+  if (iws->batch_length >= max_length) {
+    return iwdp_iws_flush(self, iws);
+  }
+  if (!iws->batch_timer_id) {
+    int timer_id = self->add_timer(self, self->batch_millis, iws);
+    if (timer_id <= 0) {
+      return iwdp_iws_flush(self, iws);
+    }
+    iws->batch_timer_id = timer_id;
+  }
+  return WS_SUCCESS;
+}
+
+// Send a device message to a client, unless the client filters it out or
+// is too slow for it.
+// @param method an event's method, or NULL
+rpc_status iwdp_iws_send_data(iwdp_t self, iwdp_iws_t iws,
+    const char *data, size_t length, bool is_response,
+    const char *method, size_t method_length) {
+  bool is_wanted = (is_response || !method ||
+      iwdp_iws_wants_event(iws, method, method_length));
+  bool is_dropped = (is_wanted && !is_response && method &&
+      iwdp_iws_drop(self, iws, method, method_length));
+  if (!is_wanted || is_dropped) {
+    if (is_dropped) {
+      iws->num_dropped++;
+    }
+    if (method_length == 20 &&
+        !strncmp(method, "Page.screencastFrame", 20)) {
+      iwdp_iws_ack_frame(self, iws, data, length);
+    }
+    return RPC_SUCCESS;
+  }
+  bool is_batch = (iws->is_remote && self->batch_millis &&
+      !is_response && method);
+  if ((iws->num_dropped || !is_batch) && iwdp_iws_flush(self, iws)) {
+    return RPC_ERROR;
+  }
+  if (iws->num_dropped && iwdp_iws_send_dropped(self, iws)) {
+    return RPC_ERROR;
+  }
+  if (is_batch) {
+    return iwdp_iws_batch(self, iws, data, length, method, method_length);
+  }
+  return iwdp_iws_send_text(self, iws, data, length, is_response);
+}
+
+// Send a shared page's message to its clients: a command response to the
+// client that sent the command, with the client's own id, or an event to
+// every client.
+rpc_status iwdp_ipage_send_data(iwdp_t self, iwdp_ipage_t ipage,
+    const char *data, size_t length) {
+  static const char *keys[] = {"id", "method"};
+  const char *value = NULL;
+  size_t value_length = 0;
+  int key = js_find_key(data, length, keys, 2, &value, &value_length);
+  if (key == 0) {
+    uint32_t command_id = 0;
+    size_t i;
+    for (i = 0; i < value_length && isdigit((unsigned char)value[i]); i++) {
+      command_id = 10 * command_id + (value[i] - '0');
+    }
+    iwdp_route_t route = (ipage->command_id_to_route ?
+        (iwdp_route_t)ht_remove(ipage->command_id_to_route,
+          HT_KEY(command_id)) : NULL);
+    if (!route) {
+      return RPC_SUCCESS;  // its client left
+    }
+    iwdp_iws_t iws = route->iws;
+    size_t n;
+    char *s = iwdp_replace_value(data, length, value, value_length,
+        route->id, strlen(route->id), &n);
+    iwdp_route_free(route);
+    if (!s) {
+      return self->on_error(self, "Out of memory");
+    }
+    if (iwdp_iws_send_data(self, iws, s, n, true, NULL, 0)) {
+      self->remove_fd(self, iws->ws_fd);
+    }
+    free(s);
+    return RPC_SUCCESS;
+  }
+  // a failed client is closed, which removes it from our clients, so go
+  // backwards past the ones that might move
+  const char *method = (key == 1 ? value : NULL);
+  size_t method_length = (key == 1 ? value_length : 0);
+  if (ipage->replay && method) {
+    rc_on_event(ipage->replay, method, method_length, data, length);
+  }
+  if (method_length == 20 && !strncmp(method, "Page.screencastFrame", 20)) {
+    int session_id = iwdp_get_session_id(data, length);
+    if (session_id >= 0) {
+      iwdp_ipage_add_frame(ipage, session_id);
+    }
+  }
+  size_t i;
+  for (i = ipage->num_clients; i > 0; i--) {
+    iwdp_iws_t iws = ipage->clients[i - 1];
+    if (iwdp_iws_send_data(self, iws, data, length, false,
+          method, method_length)) {
+      self->remove_fd(self, iws->ws_fd);
+    }
+  }
   return RPC_SUCCESS;
 }
 
 rpc_status iwdp_on_applicationSentData(rpc_t rpc,
     const char *app_id, const char *dest_id,
     const char *data, const size_t length) {
-  iwdp_iport_t iport = ((iwdp_iwi_t)rpc->state)->iport;
+  iwdp_iwi_t iwi = (iwdp_iwi_t)rpc->state;
+  iwdp_iport_t iport = iwi->iport;
+  iwdp_t self = iport->self;
   iwdp_iws_t iws = ht_get_value(iport->ws_id_to_iws, dest_id);
   if (!iws) {
+    iwdp_ipage_t ipage = (iwdp_ipage_t)ht_get_value(iwi->sender_id_to_ipage,
+        dest_id);
+    if (ipage) {
+      return iwdp_ipage_send_data(self, ipage, data, length);
+    }
     return RPC_SUCCESS;  // error but don't kill the inspector!
   }
-  ws_t ws = iws->ws;
-  return ws->send_frame(ws,
-      true, OPCODE_TEXT, false,
-      data, length);
+  // Command responses have an "id", events have a "method" instead
+  static const char *keys[] = {"id", "method"};
+  const char *method = NULL;
+  size_t method_length = 0;
+  bool is_response = (js_find_key(data, length, keys, 2,
+        &method, &method_length) == 0);
+  if (is_response && method_length && *method == '-') {
+    return RPC_SUCCESS;  // our IWDP_ACK_ID
+  }
+  return iwdp_iws_send_data(self, iws, data, length, is_response,
+      is_response ? NULL : method, method_length);
 }
 
 rpc_status iwdp_on_applicationUpdated(rpc_t rpc,
     const char *app_id, const char *dest_id) {
-  return iwdp_add_app_id(rpc, dest_id);
+  return iwdp_add_app(rpc, dest_id, NULL);
 }
 
 //
@@ -1465,7 +3410,9 @@ iwdp_t iwdp_new(const char *frontend, const char *sim_wi_socket_addr) {
   self->start = iwdp_start;
   self->on_accept = iwdp_on_accept;
   self->on_recv = iwdp_on_recv;
+  self->on_recv_buffer = iwdp_on_recv_buffer;
   self->on_close = iwdp_on_close;
+  self->on_timer = iwdp_on_timer;
   self->on_error = iwdp_on_error;
   self->private_state = my;
   my->frontend = (frontend ? strdup(frontend) : NULL);
@@ -1503,8 +3450,21 @@ iwdp_idl_t iwdp_idl_new() {
   return idl;
 }
 
+void iwdp_list_cache_free(iwdp_list_cache_t cache) {
+  while (cache) {
+    iwdp_list_cache_t next = cache->next;
+    mb_remove(MB_PAGES, iwdp_list_cache_get_memory(cache));
+    free(cache->host);
+    cb_free(cache->content);
+    memset(cache, 0, sizeof(struct iwdp_list_cache_struct));
+    free(cache);
+    cache = next;
+  }
+}
+
 void iwdp_iport_free(iwdp_iport_t iport) {
   if (iport) {
+    iwdp_list_cache_free(iport->list_cache);
     free(iport->device_id);
     free(iport->device_name);
     ht_free(iport->ws_id_to_iws);
@@ -1539,31 +3499,23 @@ int iwdp_iport_cmp(const void *a, const void *b) {
   return (pa == pb ? 0 : pa < pb ? -1 : 1);
 }
 
-/*
- * Escape string value for json output
- */
-char *iwdp_escape_json_string_val(const char *str) {
-  int len = strlen(str);
-  char* res = (char*)malloc(len * 6 + 1);
-
-  int i, j;
-  for (i = 0, j = 0; i < len; i++, j++) {
-    if (str[i] >= 0 && str[i] < 32) {
-      sprintf(res + j, "\\u%04d", str[i]);
-      j += 5;
-    } else {
-      if (str[i] == '"' || str[i] == '\\') {
-        res[j++] = '\\';
-      }
-      res[j] = str[i];
-    }
-  }
-  res[j] = '\0';
-
-  return res;
+// Append a device's "/json" item.
+int iwdp_iport_to_json(cb_t out, iwdp_iport_t iport, const char *host) {
+  int os_version_major = (iport->device_os_version >> 16) & 0xff;
+  int os_version_minor = (iport->device_os_version >> 8) & 0xff;
+  int os_version_patch = iport->device_os_version & 0xff;
+  return (jw_puts(out, "{\n   \"deviceId\": \"") ||
+      jw_escape_json(out, iport->device_id) ||
+      jw_puts(out, "\",\n   \"deviceName\": \"") ||
+      jw_escape_json(out, iport->device_name) ||
+      jw_printf(out, "\",\n   \"deviceOSVersion\": \"%d.%d.%d\",\n",
+        os_version_major, os_version_minor, os_version_patch) ||
+      jw_puts(out, "   \"url\": \"") ||
+      jw_escape_json(out, (host ? host : "localhost")) ||
+      jw_printf(out, ":%d\"\n}", iport->port));
 }
 
-char *iwdp_iports_to_text(iwdp_iport_t *iports, bool want_json,
+int iwdp_iports_to_text(cb_t out, iwdp_iport_t *iports, bool want_json,
     const char *host) {
   // count ports
   size_t n = 0;
@@ -1575,109 +3527,190 @@ char *iwdp_iports_to_text(iwdp_iport_t *iports, bool want_json,
   // sort by port
   qsort(iports, n, sizeof(iwdp_iport_t), iwdp_iport_cmp);
 
-  // get each port as text
-  char **items = (char **)calloc(n+1, sizeof(char *));
-  if (!items) {
-    return NULL;
-  }
-  size_t sum_len = 0;
-  char **item = items;
-  for (ipp = iports; *ipp; ipp++) {
+  host = (host ? host : "localhost");
+  int ret = jw_puts(out, (want_json ? "[" :
+        "<html><head><title>iOS Devices</title></head>"
+        "<body>iOS Devices:<p><ol>\n"));
+  bool is_first = true;
+  for (ipp = iports; !ret && *ipp; ipp++) {
     iwdp_iport_t iport = *ipp;
     if (!iport->device_id) {
       continue; // skip registry port
     }
-    // Escape/encode device_id & device_name?
-    char *s = NULL;
     if (want_json) {
-      if (iport->iwi) {
-        char* escaped_device_id = iwdp_escape_json_string_val(
-            iport->device_id ? iport->device_id : "");
-        char* escaped_device_name = iwdp_escape_json_string_val(
-            iport->device_name ? iport->device_name : "");
-
-        int os_version_major = (iport->device_os_version >> 16) & 0xff;
-        int os_version_minor = (iport->device_os_version >> 8) & 0xff;
-        int os_version_patch = iport->device_os_version & 0xff;
-
-        int res = asprintf(&s,
-            "%s{\n"
-            "   \"deviceId\": \"%s\",\n"
-            "   \"deviceName\": \"%s\",\n"
-            "   \"deviceOSVersion\": \"%d.%d.%d\",\n"
-            "   \"url\": \"%s:%d\"\n"
-            "}",
-            (sum_len ? "," : ""), escaped_device_id, escaped_device_name,
-            os_version_major, os_version_minor, os_version_patch,
-            (host ? host : "localhost"), iport->port);
-
-        free(escaped_device_id);
-        free(escaped_device_name);
-
-        if (res < 0) {
-          free(items);
-          return NULL;  // asprintf failed
-        }
+      if (!iport->iwi) {
+        continue;
       }
+      ret = ((!is_first && jw_puts(out, ",")) ||
+          iwdp_iport_to_json(out, iport, host));
     } else {
       // TODO use relative urls instead of "localhost", see:
       //   http://stackoverflow.com/questions/6016120
-      char *href = NULL;
-      if (iport->iwi) {
-        if (asprintf(&href, " href=\"http://%s:%d/\"",
-            (host ? host : "localhost"), iport->port) < 0) {
-          free(items);
-          return NULL;  // asprintf failed
-        }
-      }
-      if (asprintf(&s,
-          "<li><a%s>%s:%d</a> - <a title=\"%s\">%s</a></li>\n",
-          (href ? href : ""), (host ? host : "localhost"),
-          iport->port, iport->device_id,
-          (iport->device_name ? iport->device_name : "?")) < 0) {
-        free(items);
-        return NULL;  // asprintf failed
-      }
-      free(href);
+      ret = (jw_puts(out, "<li><a") ||
+          (iport->iwi && (jw_puts(out, " href=\"http://") ||
+                          jw_escape_html(out, host) ||
+                          jw_printf(out, ":%d/\"", iport->port))) ||
+          jw_puts(out, ">") ||
+          jw_escape_html(out, host) ||
+          jw_printf(out, ":%d</a> - <a title=\"", iport->port) ||
+          jw_escape_html(out, iport->device_id) ||
+          jw_puts(out, "\">") ||
+          jw_escape_html(out, (iport->device_name ? iport->device_name :
+              "?")) ||
+          jw_puts(out, "</a></li>\n"));
     }
-    if (s) {
-      sum_len += strlen(s);
-      *item++ = s;
+    is_first = false;
+  }
+  return (ret ? ret : jw_puts(out, (want_json ? "]" : "</ol></body></html>")));
+}
+
+// Append an fd's read buffer and input counters, as JSON fields, each
+// with a trailing comma.
+static int iwdp_fd_stats_to_json(iwdp_t self, int fd, const char *indent,
+    cb_t out) {
+  struct iwdp_fd_stats stats;
+  memset(&stats, 0, sizeof(stats));
+  if (fd > 0 && self->get_fd_stats) {
+    self->get_fd_stats(self, fd, &stats);
+  }
+  return jw_printf(out,
+      "%s\"recvBuffer\": %zu,\n"
+      "%s\"recvBytes\": %llu,\n"
+      "%s\"recvCalls\": %llu,\n"
+      "%s\"maxWaitMillis\": %llu,\n",
+      indent, stats.buffer_length,
+      indent, (unsigned long long)stats.recv_bytes,
+      indent, (unsigned long long)stats.recv_calls,
+      indent, (unsigned long long)stats.max_wait_millis);
+}
+
+// Describe a device's memory and its clients' memory, as JSON.
+static int iwdp_iport_memory_to_json(iwdp_t self, iwdp_iport_t iport,
+    cb_t out) {
+  iwdp_iwi_t iwi = iport->iwi;
+  size_t num_pages = 0;
+  size_t pages_memory = 0;
+  if (iwi) {
+    iwdp_ipage_t *ipages = (iwdp_ipage_t *)ht_values(iwi->page_num_to_ipage);
+    iwdp_ipage_t *ipp;
+    for (ipp = ipages; ipp && *ipp; ipp++) {
+      num_pages++;
+      pages_memory += iwdp_ipage_get_memory(*ipp) +
+          rc_get_memory((*ipp)->replay);
     }
+    free(ipages);
   }
+  int ret = (jw_puts(out, "{\n   \"deviceId\": \"") ||
+      jw_escape_json(out, iport->device_id) ||
+      jw_puts(out, "\",\n   \"deviceName\": \"") ||
+      jw_escape_json(out, iport->device_name) ||
+      jw_printf(out,
+      "\",\n"
+      "   \"port\": %d,\n"
+      "   \"webinspector\": %zd,\n",
+      iport->port, (iwi ? iwi->wi->get_memory(iwi->wi) : 0)) ||
+      (iwi && iwdp_fd_stats_to_json(self, iwi->wi_fd, "   ", out)) ||
+      jw_printf(out,
+      "   \"numPages\": %zd,\n"
+      "   \"pages\": %zd,\n"
+      "   \"clients\": [",
+      num_pages, pages_memory));
 
-  const char *header =
-    (want_json ? "[" : "<html><head><title>iOS Devices</title></head>"
-     "<body>iOS Devices:<p><ol>\n");
-  const char *footer = (want_json ? "]" : "</ol></body></html>");
+  iwdp_iws_t *iwss = (iwdp_iws_t *)ht_values(iport->ws_id_to_iws);
+  iwdp_iws_t *iwsp;
+  for (iwsp = iwss; !ret && iwsp && *iwsp; iwsp++) {
+    iwdp_iws_t iws = *iwsp;
+    ret = (jw_printf(out,
+        "%s{\n"
+        "      \"id\": \"%s\",\n"
+        "      \"page\": %u,\n"
+        "      \"remote\": %s,\n"
+        "      \"websocket\": %zd,\n"
+        "      \"batch\": %zd,\n",
+        (iwsp == iwss ? "" : ", "), iws->ws_id, iws->page_num,
+        (iws->is_remote ? "true" : "false"), iws->ws->get_memory(iws->ws),
+        iws->batch_length) ||
+      iwdp_fd_stats_to_json(self, iws->ws_fd, "      ", out) ||
+      jw_printf(out,
+        "      \"sendQueue\": %zd\n"
+        "   }", self->get_send_length(self, iws->ws_fd)));
+  }
+  free(iwss);
+  return (ret ? ret : jw_printf(out, "]\n}"));
+}
 
-  // concat
-  size_t length = strlen(header) + sum_len + strlen(footer);
-  char *ret = (char *)calloc(length+1, sizeof(char));
-  if (ret) {
-    char *tail = ret;
-    strcpy(tail, header);
-    tail += strlen(header);
-    for (item = items; *item; item++) {
-      strcpy(tail, *item);
-      tail += strlen(*item);
-      free(*item);
+char *iwdp_memory_to_json(iwdp_t self, iwdp_iport_t iport) {
+  iwdp_private_t my = self->private_state;
+  cb_t out = cb_new();
+  if (!out) {
+    return NULL;
+  }
+  int ret = jw_printf(out,
+      "{\n"
+      "\"limit\": %zd,\n"
+      "\"total\": %zd,\n"
+      "\"subsystems\": {",
+      mb_get_limit(), mb_get_total());
+  mb_tag tag;
+  for (tag = 0; !ret && tag < MB_NUM_TAGS; tag++) {
+    ret = jw_printf(out, "%s\"%s\": %zd", (tag ? ", " : ""),
+        mb_get_name(tag), mb_get_usage(tag));
+  }
+  if (!ret) {
+    ret = jw_printf(out, "},\n\"devices\": [");
+  }
+
+  // the registry port lists all devices, a device port lists itself
+  iwdp_iport_t *iports;
+  size_t n = 0;
+  if (iport->device_id) {
+    iports = (iwdp_iport_t *)calloc(2, sizeof(iwdp_iport_t));
+    if (iports) {
+      iports[n++] = iport;
     }
-    strcpy(tail, footer);
+  } else {
+    iports = (iwdp_iport_t *)ht_values(my->device_id_to_iport);
+    for (; iports && iports[n]; n++) {
+    }
+    qsort(iports, n, sizeof(iwdp_iport_t), iwdp_iport_cmp);
   }
-  free(items);
-  return ret;
+  bool is_first = true;
+  size_t i;
+  for (i = 0; !ret && i < n; i++) {
+    if (!iports[i]->device_id) {
+      continue;  // skip registry port
+    }
+    ret = ((!is_first && jw_printf(out, ",")) ||
+        iwdp_iport_memory_to_json(self, iports[i], out));
+    is_first = false;
+  }
+  free(iports);
+  if (!ret) {
+    ret = jw_printf(out, "]\n}");
+  }
+  char *s = (ret ? NULL : strndup(out->head, out->tail - out->head));
+  cb_free(out);
+  return s;
 }
 
 void iwdp_iwi_free(iwdp_iwi_t iwi) {
   if (iwi) {
     wi_free(iwi->wi);
     rpc_free(iwi->rpc);
-    rpc_free_app(iwi->app);
-    // TODO free ht_values?
     free(iwi->connection_id);
-    ht_free(iwi->app_id_to_true);
+    if (iwi->app_id_to_iapp) {
+      // the pages themselves are freed by iwdp_iwi_close
+      iwdp_iapp_t *iapps = (iwdp_iapp_t *)ht_values(iwi->app_id_to_iapp);
+      ht_clear(iwi->app_id_to_iapp);
+      iwdp_iapp_t *iap;
+      for (iap = iapps; *iap; iap++) {
+        iwdp_iapp_free(*iap);
+      }
+      free(iapps);
+    }
+    ht_free(iwi->app_id_to_iapp);
     ht_free(iwi->page_num_to_ipage);
+    ht_free(iwi->sender_id_to_ipage);
     memset(iwi, 0, sizeof(struct iwdp_iwi_struct));
     free(iwi);
   }
@@ -1690,11 +3723,13 @@ iwdp_iwi_t iwdp_iwi_new(bool partials_supported, bool *is_debug) {
   }
   memset(iwi, 0, sizeof(struct iwdp_iwi_struct));
   iwi->type.type = TYPE_IWI;
-  iwi->app_id_to_true = ht_new(HT_STRING_KEYS);
+  iwi->app_id_to_iapp = ht_new(HT_STRING_KEYS);
   iwi->page_num_to_ipage = ht_new(HT_INT_KEYS);
+  iwi->sender_id_to_ipage = ht_new(HT_STRING_KEYS);
   rpc_t rpc = rpc_new();
   wi_t wi = wi_new(partials_supported);
-  if (!rpc || !wi || !iwi->page_num_to_ipage || !iwi->app_id_to_true) {
+  if (!rpc || !wi || !iwi->page_num_to_ipage || !iwi->app_id_to_iapp ||
+      !iwi->sender_id_to_ipage) {
     iwdp_iwi_free(iwi);
     return NULL;
   }
@@ -1706,11 +3741,11 @@ iwdp_iwi_t iwdp_iwi_new(bool partials_supported, bool *is_debug) {
   rpc->on_applicationSentListing = iwdp_on_applicationSentListing;
   rpc->on_applicationSentData = iwdp_on_applicationSentData;
   rpc->on_applicationUpdated = iwdp_on_applicationUpdated;
-  rpc->send_plist = iwdp_send_plist;
+  rpc->send_bplist = iwdp_send_bplist;
   rpc->state = iwi;
   iwi->rpc = rpc;
   wi->send_packet = iwdp_send_packet;
-  wi->recv_plist = iwdp_recv_plist;
+  wi->recv_bplist = iwdp_recv_bplist;
   wi->state = iwi;
   wi->is_debug = is_debug;
   iwi->wi = wi;
@@ -1721,6 +3756,17 @@ void iwdp_iws_free(iwdp_iws_t iws) {
   if (iws) {
     ws_free(iws->ws);
     free(iws->ws_id);
+    free(iws->events);
+    free(iws->stream_host);
+    iwdp_iws_clear_domains(iws, NULL);
+    size_t i;
+    for (i = 0; i < iws->num_batch; i++) {
+      mb_remove(MB_WEBSOCKET, iws->batch[i].length);
+      free(iws->batch[i].data);
+      free(iws->batch[i].key);
+    }
+    free(iws->batch);
+    cb_free(iws->batch_out);
     memset(iws, 0, sizeof(struct iwdp_iws_struct));
     free(iws);
   }
@@ -1767,18 +3813,65 @@ iwdp_ifs_t iwdp_ifs_new() {
   return ifs;
 }
 
+void iwdp_iapp_free(iwdp_iapp_t iapp) {
+  if (iapp) {
+    free(iapp->app_id);
+    ht_free(iapp->page_id_to_ipage);
+    memset(iapp, 0, sizeof(struct iwdp_iapp_struct));
+    free(iapp);
+  }
+}
+
+iwdp_iapp_t iwdp_iapp_new(const char *app_id) {
+  iwdp_iapp_t iapp = (iwdp_iapp_t)malloc(sizeof(struct iwdp_iapp_struct));
+  if (!iapp) {
+    return NULL;
+  }
+  memset(iapp, 0, sizeof(struct iwdp_iapp_struct));
+  iapp->app_id = strdup(app_id);
+  iapp->page_id_to_ipage = ht_new(HT_INT_KEYS);
+  if (!iapp->app_id || !iapp->page_id_to_ipage) {
+    iwdp_iapp_free(iapp);
+    return NULL;
+  }
+  return iapp;
+}
+
 void iwdp_ipage_free(iwdp_ipage_t ipage) {
   if (ipage) {
+    mb_remove(MB_PAGES, iwdp_ipage_get_memory(ipage));
     free(ipage->app_id);
     free(ipage->connection_id);
     free(ipage->title);
     free(ipage->url);
     free(ipage->sender_id);
+    free(ipage->clients);
+    iwdp_ipage_remove_routes(ipage, NULL);
+    ht_free(ipage->command_id_to_route);
+    iwdp_ipage_remove_frames(ipage, NULL);
+    ht_free(ipage->session_id_to_frame);
+    rc_free(ipage->replay);
     memset(ipage, 0, sizeof(struct iwdp_ipage_struct));
     free(ipage);
   }
 }
 
+void iwdp_route_free(iwdp_route_t route) {
+  if (route) {
+    free(route->id);
+    memset(route, 0, sizeof(struct iwdp_route_struct));
+    free(route);
+  }
+}
+
+void iwdp_frame_free(iwdp_frame_t frame) {
+  if (frame) {
+    free(frame->clients);
+    memset(frame, 0, sizeof(struct iwdp_frame_struct));
+    free(frame);
+  }
+}
+
 iwdp_ipage_t iwdp_ipage_new() {
   iwdp_ipage_t ipage = (iwdp_ipage_t)malloc(sizeof(struct iwdp_ipage_struct));
   if (ipage) {
@@ -1787,6 +3880,16 @@ iwdp_ipage_t iwdp_ipage_new() {
   return ipage;
 }
 
+// Our page table's share of an ipage, not counting its sender_id, which
+// comes and goes with its client.
+size_t iwdp_ipage_get_memory(iwdp_ipage_t ipage) {
+  return (sizeof(struct iwdp_ipage_struct) +
+      (ipage->app_id ? strlen(ipage->app_id) + 1 : 0) +
+      (ipage->connection_id ? strlen(ipage->connection_id) + 1 : 0) +
+      (ipage->title ? strlen(ipage->title) + 1 : 0) +
+      (ipage->url ? strlen(ipage->url) + 1 : 0));
+}
+
 /*!
  * @result compare by page_num
  */
@@ -1805,13 +3908,43 @@ int iwdp_ipage_cmp(const void *a, const void *b) {
    [{
    "devtoolsFrontendUrl": "/devtools/devtools.html?host=localhost:9222&page=7",
    "faviconUrl": "",
+   "id": "7",
    "thumbnailUrl": "/thumb/http://www.google.com/",
    "title": "Google",
    "url": "http://www.google.com/",
    "webSocketDebuggerUrl": "ws://localhost:9222/devtools/page/7"
    }]
  */
-char *iwdp_ipages_to_text(iwdp_ipage_t *ipages, bool want_json,
+// Append a page's "/json" item.
+// @param frontend_url optional, for the devtoolsFrontendUrl
+int iwdp_ipage_to_json(cb_t out, iwdp_ipage_t ipage,
+    const char *frontend_url, const char *host, int port) {
+  host = (host ? host : "localhost");
+  // the frontend link is "%s?ws=%s:%d/devtools/page/%d"
+  return (jw_puts(out, "{\n   \"devtoolsFrontendUrl\": \"") ||
+      (frontend_url && !ipage->iws &&
+       (jw_escape_json(out, frontend_url) ||
+        jw_puts(out, "?ws=") ||
+        jw_escape_json(out, host) ||
+        jw_printf(out, ":%d/devtools/page/%d", port, ipage->page_num))) ||
+      jw_printf(out, "\",\n"
+        "   \"faviconUrl\": \"\",\n"
+        "   \"id\": \"%d\",\n"
+        "   \"thumbnailUrl\": \"/thumb/", ipage->page_num) ||
+      jw_escape_json(out, ipage->url) ||
+      jw_puts(out, "\",\n   \"title\": \"") ||
+      jw_escape_json(out, ipage->title) ||
+      jw_puts(out, "\",\n   \"url\": \"") ||
+      jw_escape_json(out, ipage->url) ||
+      jw_puts(out, "\",\n   \"webSocketDebuggerUrl\": \"ws://") ||
+      jw_escape_json(out, host) ||
+      jw_printf(out, ":%d/devtools/page/%d\",\n   \"appId\": \"",
+        port, ipage->page_num) ||
+      jw_escape_json(out, ipage->app_id) ||
+      jw_puts(out, "\"\n}"));
+}
+
+int iwdp_ipages_to_text(cb_t out, iwdp_ipage_t *ipages, bool want_json,
     const char *device_id, const char *device_name,
     const char *frontend_url, const char *host, int port) {
   // count pages
@@ -1824,87 +3957,46 @@ char *iwdp_ipages_to_text(iwdp_ipage_t *ipages, bool want_json,
   // sort by page_num
   qsort(ipages, n, sizeof(iwdp_ipage_t), iwdp_ipage_cmp);
 
-  // get each page as text
-  char **items = (char **)calloc(n+1, sizeof(char *));
-  if (!items) {
-    return NULL;
-  }
-  size_t sum_len = 0;
-  char **item = items;
-  for (ipp = ipages; *ipp; ipp++) {
+  host = (host ? host : "localhost");
+  int ret;
+  if (want_json) {
+    ret = jw_puts(out, "[");
+  } else {
+    ret = (jw_puts(out, "<html><head><title>") ||
+        jw_escape_html(out, device_name) ||
+        jw_puts(out, "</title></head><body>Inspectable pages for <a title=\"") ||
+        jw_escape_html(out, device_id) ||
+        jw_puts(out, "\">") ||
+        jw_escape_html(out, device_name) ||
+        jw_puts(out, "</a>:<p><ol>\n"));
+  }
+  for (ipp = ipages; !ret && *ipp; ipp++) {
     iwdp_ipage_t ipage = *ipp;
-    char *href = NULL;
-    if (frontend_url) {
-      if (asprintf(&href, "%s?ws=%s:%d/devtools/page/%d", frontend_url,
-          (host ? host : "localhost"), port, ipage->page_num) < 0) {
-        return NULL;  // asprintf failed
-      }
-    }
-    char *s = NULL;
     if (want_json) {
-      char* escaped_title = iwdp_escape_json_string_val(
-          ipage->title ? ipage->title : "");
-      char* escaped_app_id = iwdp_escape_json_string_val(
-          ipage->app_id ? ipage->app_id : "");
-      char* escaped_page_url = iwdp_escape_json_string_val(
-          ipage->url ? ipage->url : "");
-
-      int res = asprintf(&s,
-          "%s{\n"
-          "   \"devtoolsFrontendUrl\": \"%s\",\n"
-          "   \"faviconUrl\": \"\",\n"
-          "   \"thumbnailUrl\": \"/thumb/%s\",\n"
-          "   \"title\": \"%s\",\n"
-          "   \"url\": \"%s\",\n"
-          "   \"webSocketDebuggerUrl\": \"ws://%s:%d/devtools/page/%d\",\n"
-          "   \"appId\": \"%s\"\n"
-          "}",
-          (sum_len ? "," : ""), (href && !ipage->iws ? href : ""),
-          escaped_page_url, escaped_title, escaped_page_url,
-          (host ? host : "localhost"), port, ipage->page_num, escaped_app_id);
-
-      free(escaped_title);
-      free(escaped_app_id);
-      free(escaped_page_url);
-
-      if (res < 0) {
-        free(href);
-        free(items);
-        return NULL;  // asprintf failed
-      }
+      ret = ((ipp != ipages && jw_puts(out, ",")) ||
+          iwdp_ipage_to_json(out, ipage, frontend_url, host, port));
     } else {
-      if (asprintf(&s,
-          "<li value=\"%d\"><a%s%s%s title=\"%s\">%s</a></li>\n",
-          ipage->page_num,
-          (href ? (ipage->iws ? " alt=\"" : " href=\"") : ""),
-          (href ? href : ""),
-          (href ? "\"" : ""),
-          (ipage->title ? ipage->title : "?"),
-          (ipage->url ? ipage->url : "?")) < 0) { // encodeURI?
-        free(href);
-        free(items);
-        return NULL;  // asprintf failed
-      }
-    }
-    free(href);
-    if (s) {
-      sum_len += strlen(s);
-      *item++ = s;
+      ret = (jw_printf(out, "<li value=\"%d\"><a", ipage->page_num) ||
+          (frontend_url &&
+           (jw_puts(out, (ipage->iws ? " alt=\"" : " href=\"")) ||
+            jw_escape_html(out, frontend_url) ||
+            jw_puts(out, "?ws=") ||
+            jw_escape_html(out, host) ||
+            jw_printf(out, ":%d/devtools/page/%d\"", port,
+              ipage->page_num))) ||
+          jw_puts(out, " title=\"") ||
+          jw_escape_html(out, (ipage->title ? ipage->title : "?")) ||
+          jw_puts(out, "\">") ||
+          jw_escape_html(out, (ipage->url ? ipage->url : "?")) ||
+          jw_puts(out, "</a></li>\n"));
     }
   }
-
-  char *header = (char *)"[";
-  char *footer = (char *)"]";
-  if (!want_json) {
-    if (asprintf(&header,
-        "<html><head><title>%s</title></head>"
-        "<body>Inspectable pages for <a title=\"%s\">%s</a>:<p><ol>\n",
-        device_name, device_id, device_name) < 0) {
-      return NULL;  // asprintf failed
-    }
-    bool is_chrome_dev = (sum_len > 0 && frontend_url &&
-        !strncasecmp(frontend_url, "chrome-devtools://", 18));
-    if (asprintf(&footer, "</ol>%s</body></html>", (is_chrome_dev ?
+  if (ret || want_json) {
+    return (ret ? ret : jw_puts(out, "]"));
+  }
+  bool is_chrome_dev = (n > 0 && frontend_url &&
+      !strncasecmp(frontend_url, "chrome-devtools://", 18));
+  return jw_printf(out, "</ol>%s</body></html>", (is_chrome_dev ?
         "<p><b>Note:</b> Your browser may block<sup><a href=\""
         "https://code.google.com/p/chromium/issues/detail?id=87815"
         "\"1\">1,</a><a href=\""
@@ -1912,31 +4004,7 @@ char *iwdp_ipages_to_text(iwdp_ipage_t *ipages, bool want_json,
         "\">2</a></sup> the above links with JavaScript console error:<br><tt>"
         "&nbsp;&nbsp;Not allowed to load local resource: chrome-devtools://..."
         "</tt><br>To open a link: right-click on the link (control-click on"
-        " Mac), 'Copy Link Address', and paste it into address bar." : "")) < 0) {
-      return NULL;  // asprintf failed
-    }
-  }
-
-  // concat
-  size_t length = strlen(header) + sum_len + strlen(footer);
-  char *ret = (char *)calloc(length+1, sizeof(char));
-  if (ret) {
-    char *tail = ret;
-    strcpy(tail, header);
-    tail += strlen(header);
-    for (item = items; *item; item++) {
-      strcpy(tail, *item);
-      tail += strlen(*item);
-      free(*item);
-    }
-    strcpy(tail, footer);
-  }
-  if (!want_json) {
-    free(header);
-    free(footer);
-  }
-  free(items);
-  return ret;
+        " Mac), 'Copy Link Address', and paste it into address bar." : ""));
 }
 
 int iwdp_update_string(char **old_value, const char *new_value) {
@@ -1946,6 +4014,8 @@ int iwdp_update_string(char **old_value, const char *new_value) {
     }
     free(*old_value);
     *old_value = NULL;
+  } else if (!new_value) {
+    return 0;
   }
   if (new_value) {
     *old_value = strdup(new_value);
@@ -1953,7 +4023,7 @@ int iwdp_update_string(char **old_value, const char *new_value) {
       return -1;
     }
   }
-  return 0;
+  return 1;
 }
 
 iwdp_status iwdp_get_content_type(const char *path, bool is_local,
@@ -45,6 +45,22 @@ struct iwdpm_struct {
   char *frontend;
   char *sim_wi_socket_addr;
   bool is_debug;
+  struct ws_deflate_struct deflate;
+  size_t max_frame_length;
+  size_t ping_interval;
+  size_t ping_timeout;
+  size_t idle_timeout;
+  size_t cork_millis;
+  size_t max_recv_length;
+  size_t max_recv_memory;
+  size_t drop_watermark;
+  size_t drop_sample_rate;
+  size_t batch_millis;
+  size_t listing_millis;
+  size_t max_memory;
+  size_t spill_length;
+  bool multi_client;
+  size_t replay_length;
 
   pc_t pc;
   sm_t sm;
@@ -147,9 +163,31 @@ int iwdpm_listen(iwdp_t iwdp, int port) {
 int iwdpm_connect(iwdp_t iwdp, const char *socket_addr) {
   return sm_connect(socket_addr);
 }
-iwdp_status iwdpm_send(iwdp_t iwdp, int fd, const char *data, size_t length) {
+iwdp_status iwdpm_send(iwdp_t iwdp, int fd, const char *data, size_t length,
+    iwdp_send_flags flags) {
   sm_t sm = ((iwdpm_t)iwdp->state)->sm;
-  return sm->send(sm, fd, data, length, NULL);
+  sm_send_flags sm_flags =
+      ((flags & IWDP_SEND_PRIORITY ? SM_SEND_PRIORITY : 0) |
+       (flags & IWDP_SEND_MORE ? SM_SEND_MORE : 0));
+  return sm->send(sm, fd, data, length, sm_flags, NULL);
+}
+size_t iwdpm_get_send_length(iwdp_t iwdp, int fd) {
+  sm_t sm = ((iwdpm_t)iwdp->state)->sm;
+  struct sm_fd_stats stats;
+  return (sm->get_fd_stats(sm, fd, &stats) ? 0 : stats.send_length);
+}
+iwdp_status iwdpm_get_fd_stats(iwdp_t iwdp, int fd,
+    iwdp_fd_stats_t to_stats) {
+  sm_t sm = ((iwdpm_t)iwdp->state)->sm;
+  struct sm_fd_stats stats;
+  if (sm->get_fd_stats(sm, fd, &stats)) {
+    return IWDP_ERROR;
+  }
+  to_stats->buffer_length = stats.buffer_length;
+  to_stats->recv_bytes = stats.recv_bytes;
+  to_stats->recv_calls = stats.recv_calls;
+  to_stats->max_wait_millis = stats.max_wait_millis;
+  return IWDP_SUCCESS;
 }
 iwdp_status iwdpm_add_fd(iwdp_t iwdp, int fd, void *ssl_session, void *value,
     bool is_server) {
@@ -160,6 +198,14 @@ iwdp_status iwdpm_remove_fd(iwdp_t iwdp, int fd) {
   sm_t sm = ((iwdpm_t)iwdp->state)->sm;
   return sm->remove_fd(sm, fd);
 }
+int iwdpm_add_timer(iwdp_t iwdp, unsigned int delay_millis, void *value) {
+  sm_t sm = ((iwdpm_t)iwdp->state)->sm;
+  return sm->add_timer(sm, delay_millis, value);
+}
+iwdp_status iwdpm_remove_timer(iwdp_t iwdp, int timer_id) {
+  sm_t sm = ((iwdpm_t)iwdp->state)->sm;
+  return sm->remove_timer(sm, timer_id);
+}
 sm_status iwdpm_on_accept(sm_t sm, int s_fd, void *s_value,
     int fd, void **to_value) {
   iwdp_t iwdp = ((iwdpm_t)sm->state)->iwdp;
@@ -174,10 +220,19 @@ sm_status iwdpm_on_recv(sm_t sm, int fd, void *value,
   iwdp_t iwdp = ((iwdpm_t)sm->state)->iwdp;
   return iwdp->on_recv(iwdp, fd, value, buf, length);
 }
+sm_status iwdpm_on_recv_buffer(sm_t sm, int fd, void *value,
+    char **to_buf, size_t *to_length) {
+  iwdp_t iwdp = ((iwdpm_t)sm->state)->iwdp;
+  return iwdp->on_recv_buffer(iwdp, fd, value, to_buf, to_length);
+}
 sm_status iwdpm_on_close(sm_t sm, int fd, void *value, bool is_server) {
   iwdp_t iwdp = ((iwdpm_t)sm->state)->iwdp;
   return iwdp->on_close(iwdp, fd, value, is_server);
 }
+sm_status iwdpm_on_timer(sm_t sm, int timer_id, void *value) {
+  iwdp_t iwdp = ((iwdpm_t)sm->state)->iwdp;
+  return iwdp->on_timer(iwdp, timer_id, value);
+}
 
 void iwdpm_create_bridge(iwdpm_t self) {
   sm_t sm = sm_new(4096);
@@ -194,14 +249,37 @@ void iwdpm_create_bridge(iwdpm_t self) {
   iwdp->listen = iwdpm_listen;
   iwdp->connect = iwdpm_connect;
   iwdp->send = iwdpm_send;
+  iwdp->get_send_length = iwdpm_get_send_length;
+  iwdp->get_fd_stats = iwdpm_get_fd_stats;
   iwdp->add_fd = iwdpm_add_fd;
   iwdp->remove_fd = iwdpm_remove_fd;
+  iwdp->add_timer = iwdpm_add_timer;
+  iwdp->remove_timer = iwdpm_remove_timer;
   iwdp->state = self;
   iwdp->is_debug = &self->is_debug;
+  iwdp->ws_deflate = &self->deflate;
+  iwdp->max_frame_length = self->max_frame_length;
+  iwdp->ping_interval = self->ping_interval;
+  iwdp->ping_timeout = self->ping_timeout;
+  iwdp->idle_timeout = self->idle_timeout;
+  iwdp->drop_watermark = self->drop_watermark;
+  iwdp->drop_sample_rate = self->drop_sample_rate;
+  iwdp->batch_millis = self->batch_millis;
+  iwdp->listing_millis = self->listing_millis;
+  iwdp->max_memory = self->max_memory;
+  iwdp->spill_length = self->spill_length;
+  iwdp->multi_client = self->multi_client;
+  iwdp->replay_length = self->replay_length;
   sm->on_accept = iwdpm_on_accept;
   sm->on_sent = iwdpm_on_sent;
   sm->on_recv = iwdpm_on_recv;
+  sm->on_recv_buffer = iwdpm_on_recv_buffer;
   sm->on_close = iwdpm_on_close;
+  sm->on_timer = iwdpm_on_timer;
+  sm->max_cork_millis = self->cork_millis;
+  sm->max_recv_length = self->max_recv_length;
+  sm->max_recv_memory = self->max_recv_memory;
+  sm->spill_length = self->spill_length;
   sm->state = self;
   sm->is_debug = &self->is_debug;
 }
@@ -229,6 +307,41 @@ iwdpm_t iwdpm_new() {
   return self;
 }
 
+// long-only options
+enum {
+  OPT_DEFLATE = 256,
+  OPT_DEFLATE_WINDOW_BITS,
+  OPT_DEFLATE_NO_CONTEXT_TAKEOVER,
+  OPT_DEFLATE_MIN_LENGTH,
+  OPT_MAX_FRAME_LENGTH,
+  OPT_PING_INTERVAL,
+  OPT_PING_TIMEOUT,
+  OPT_IDLE_TIMEOUT,
+  OPT_CORK_MILLIS,
+  OPT_MAX_RECV_LENGTH,
+  OPT_MAX_RECV_MEMORY,
+  OPT_DROP_WATERMARK,
+  OPT_DROP_SAMPLE_RATE,
+  OPT_BATCH_MILLIS,
+  OPT_MAX_MEMORY,
+  OPT_SPILL_LENGTH,
+  OPT_LISTING_MILLIS,
+  OPT_MULTI_CLIENT,
+  OPT_REPLAY_LENGTH,
+};
+
+// Parses a non-negative decimal option value
+static bool iwdpm_parse_size(const char *val, size_t min, size_t max,
+    size_t *to_size) {
+  char *end = NULL;
+  long long n = strtoll(val, &end, 10);
+  if (end == val || *end || n < (long long)min || n > (long long)max) {
+    return false;
+  }
+  *to_size = n;
+  return true;
+}
+
 int iwdpm_configure(iwdpm_t self, int argc, char **argv) {
 
   static struct option longopts[] = {
@@ -237,6 +350,25 @@ int iwdpm_configure(iwdpm_t self, int argc, char **argv) {
     {"frontend", 1, NULL, 'f'},
     {"no-frontend", 0, NULL, 'F'},
     {"simulator-webinspector", 1, NULL, 's'},
+    {"deflate", 0, NULL, OPT_DEFLATE},
+    {"deflate-window-bits", 1, NULL, OPT_DEFLATE_WINDOW_BITS},
+    {"deflate-no-context-takeover", 0, NULL, OPT_DEFLATE_NO_CONTEXT_TAKEOVER},
+    {"deflate-min-length", 1, NULL, OPT_DEFLATE_MIN_LENGTH},
+    {"max-frame-length", 1, NULL, OPT_MAX_FRAME_LENGTH},
+    {"ping-interval", 1, NULL, OPT_PING_INTERVAL},
+    {"ping-timeout", 1, NULL, OPT_PING_TIMEOUT},
+    {"idle-timeout", 1, NULL, OPT_IDLE_TIMEOUT},
+    {"cork-millis", 1, NULL, OPT_CORK_MILLIS},
+    {"max-recv-length", 1, NULL, OPT_MAX_RECV_LENGTH},
+    {"max-recv-memory", 1, NULL, OPT_MAX_RECV_MEMORY},
+    {"drop-watermark", 1, NULL, OPT_DROP_WATERMARK},
+    {"drop-sample-rate", 1, NULL, OPT_DROP_SAMPLE_RATE},
+    {"batch-millis", 1, NULL, OPT_BATCH_MILLIS},
+    {"max-memory", 1, NULL, OPT_MAX_MEMORY},
+    {"spill-length", 1, NULL, OPT_SPILL_LENGTH},
+    {"listing-millis", 1, NULL, OPT_LISTING_MILLIS},
+    {"multi-client", 0, NULL, OPT_MULTI_CLIENT},
+    {"replay-length", 1, NULL, OPT_REPLAY_LENGTH},
     {"debug", 0, NULL, 'd'},
     {"help", 0, NULL, 'h'},
     {"version", 0, NULL, 'V'},
@@ -251,6 +383,18 @@ int iwdpm_configure(iwdpm_t self, int argc, char **argv) {
   self->config = strdup(DEFAULT_CONFIG);
   self->frontend = strdup(DEFAULT_FRONTEND);
   self->sim_wi_socket_addr = strdup(DEFAULT_SIM_WI_SOCKET_ADDR);
+  self->deflate.window_bits = 15;
+  self->deflate.min_length = 256;
+  self->max_frame_length = 65536;
+  self->drop_sample_rate = 8;
+  self->batch_millis = 20;
+  self->listing_millis = 50;
+  self->spill_length = 8 * 1024 * 1024;
+  self->max_recv_length = 256 * 1024;
+  self->max_recv_memory = 4 * 1024 * 1024;
+  self->replay_length = 4 * 1024 * 1024;
+  self->ping_interval = 30;
+  self->ping_timeout = 10;
 
   int ret = 0;
   while (!ret) {
@@ -309,6 +453,109 @@ int iwdpm_configure(iwdpm_t self, int argc, char **argv) {
       case 'd':
         self->is_debug = true;
         break;
+      case OPT_DEFLATE:
+        self->deflate.is_enabled = true;
+        break;
+      case OPT_DEFLATE_WINDOW_BITS:
+        {
+          size_t bits;
+          if (iwdpm_parse_size(optarg, 9, 15, &bits)) {
+            self->deflate.window_bits = bits;
+          } else {
+            ret = 2;
+          }
+        }
+        break;
+      case OPT_DEFLATE_NO_CONTEXT_TAKEOVER:
+        self->deflate.no_context_takeover = true;
+        break;
+      case OPT_DEFLATE_MIN_LENGTH:
+        if (!iwdpm_parse_size(optarg, 0, SIZE_MAX >> 1,
+              &self->deflate.min_length)) {
+          ret = 2;
+        }
+        break;
+      case OPT_MAX_FRAME_LENGTH:
+        if (!iwdpm_parse_size(optarg, 0, SIZE_MAX >> 1,
+              &self->max_frame_length) ||
+            (self->max_frame_length && self->max_frame_length < 128)) {
+          ret = 2;
+        }
+        break;
+      case OPT_PING_INTERVAL:
+        if (!iwdpm_parse_size(optarg, 0, 86400, &self->ping_interval)) {
+          ret = 2;
+        }
+        break;
+      case OPT_PING_TIMEOUT:
+        if (!iwdpm_parse_size(optarg, 1, 86400, &self->ping_timeout)) {
+          ret = 2;
+        }
+        break;
+      case OPT_IDLE_TIMEOUT:
+        if (!iwdpm_parse_size(optarg, 0, 86400 * 7, &self->idle_timeout)) {
+          ret = 2;
+        }
+        break;
+      case OPT_CORK_MILLIS:
+        if (!iwdpm_parse_size(optarg, 0, 1000, &self->cork_millis)) {
+          ret = 2;
+        }
+        break;
+      case OPT_MAX_RECV_LENGTH:
+        if (!iwdpm_parse_size(optarg, 4096, SIZE_MAX >> 1,
+              &self->max_recv_length)) {
+          ret = 2;
+        }
+        break;
+      case OPT_MAX_RECV_MEMORY:
+        if (!iwdpm_parse_size(optarg, 0, SIZE_MAX >> 1,
+              &self->max_recv_memory)) {
+          ret = 2;
+        }
+        break;
+      case OPT_DROP_WATERMARK:
+        if (!iwdpm_parse_size(optarg, 0, SIZE_MAX >> 1,
+              &self->drop_watermark)) {
+          ret = 2;
+        }
+        break;
+      case OPT_DROP_SAMPLE_RATE:
+        if (!iwdpm_parse_size(optarg, 1, 1000000, &self->drop_sample_rate)) {
+          ret = 2;
+        }
+        break;
+      case OPT_BATCH_MILLIS:
+        if (!iwdpm_parse_size(optarg, 0, 1000, &self->batch_millis)) {
+          ret = 2;
+        }
+        break;
+      case OPT_MAX_MEMORY:
+        if (!iwdpm_parse_size(optarg, 0, SIZE_MAX >> 1, &self->max_memory) ||
+            (self->max_memory && self->max_memory < (1 << 20))) {
+          ret = 2;
+        }
+        break;
+      case OPT_SPILL_LENGTH:
+        if (!iwdpm_parse_size(optarg, 0, SIZE_MAX >> 1,
+              &self->spill_length)) {
+          ret = 2;
+        }
+        break;
+      case OPT_LISTING_MILLIS:
+        if (!iwdpm_parse_size(optarg, 0, 10000, &self->listing_millis)) {
+          ret = 2;
+        }
+        break;
+      case OPT_MULTI_CLIENT:
+        self->multi_client = true;
+        break;
+      case OPT_REPLAY_LENGTH:
+        if (!iwdpm_parse_size(optarg, 0, SIZE_MAX >> 1,
+              &self->replay_length)) {
+          ret = 2;
+        }
+        break;
       default:
         ret = 2;
         break;
@@ -391,6 +638,70 @@ int iwdpm_configure(iwdpm_t self, int argc, char **argv) {
         "            unix:/private/tmp/com.apple.launchd.2j5k1TMh6i/"
         "com.apple.webinspectord_sim.socket\n"
         "\n"
+        "  --deflate\t\tCompress websocket messages to clients that offer\n"
+        "        permessage-deflate (RFC 7692), e.g. remote DevTools.\n"
+        "  --deflate-window-bits BITS\tCompression window, 9 to 15.\n"
+        "        Defaults to 15.\n"
+        "  --deflate-no-context-takeover\tCompress each message\n"
+        "        separately, to save memory per client.\n"
+        "  --deflate-min-length BYTES\tDon't compress shorter messages.\n"
+        "        Defaults to 256.\n"
+        "\n"
+        "  --max-frame-length BYTES\tSplit larger messages to clients into\n"
+        "        websocket fragments, or 0 to never split.  Defaults to 65536.\n"
+        "\n"
+        "  --ping-interval SECS\tPing websocket clients that have been\n"
+        "        quiet this long, or 0 to never ping.  Defaults to 30.\n"
+        "  --ping-timeout SECS\tClose clients that don't answer a ping\n"
+        "        within this time.  Defaults to 10.\n"
+        "  --idle-timeout SECS\tClose clients that haven't sent or\n"
+        "        received a message in this time.  Defaults to 0 (never).\n"
+        "\n"
+        "  --cork-millis MILLIS\tCoalesce each client's small writes until\n"
+        "        the end of each event loop pass, but hold them no longer\n"
+        "        than this.  Defaults to 0 (send immediately).\n"
+        "\n"
+        "  --max-recv-length BYTES\tGrow a busy client's or device's read\n"
+        "        buffer up to this length.  Defaults to 262144.\n"
+        "  --max-recv-memory BYTES\tLimit all grown read buffers to this\n"
+        "        total.  Defaults to 4194304.\n"
+        "\n"
+        "  --drop-watermark BYTES\tWhile a client has more than this\n"
+        "        waiting to be sent, drop its screencast frames and thin its\n"
+        "        high-rate events.  Defaults to 0 (never drop).\n"
+        "  --drop-sample-rate N\tWhen thinning, send one of every N\n"
+        "        events.  Defaults to 8.\n"
+        "\n"
+        "  --batch-millis MILLIS\tHold events for clients that connect\n"
+        "        with \"?remote\" or an \"X-DevTools-Remote\" header, and\n"
+        "        send them together, dropping redundant DOM and CSS updates.\n"
+        "        Defaults to 20, or 0 to send immediately.\n"
+        "\n"
+        "  --max-memory BYTES\tLimit the memory of our buffers and page\n"
+        "        tables, at least 1048576.  When over budget, refuse new\n"
+        "        websocket clients, drop events and reject large client\n"
+        "        messages.\n"
+        "        See /json/memory.  Defaults to 0 (no limit).\n"
+        "  --spill-length BYTES\tJoin larger device messages, e.g. heap\n"
+        "        snapshots, in a temp file, and queue a slow client's output\n"
+        "        past this length there too.  Defaults to 8388608, or 0 to\n"
+        "        keep everything in memory.\n"
+        "\n"
+        "  --listing-millis MILLIS\tWait this long before asking a device\n"
+        "        for an app's pages, so bursts of app updates are coalesced.\n"
+        "        Defaults to 50, or 0 to ask immediately.\n"
+        "\n"
+        "  --multi-client\tLet several clients inspect the same page, e.g.\n"
+        "        automation and a person, instead of a new client taking\n"
+        "        the page.  Events go to every client.\n"
+        "\n"
+        "  --replay-length BYTES\tWith --multi-client, cache up to this\n"
+        "        many bytes of a page's scripts, style sheets or execution\n"
+        "        contexts, to give a client that joins later.  A domain\n"
+        "        that exceeds this isn't cached until the page clears it,\n"
+        "        e.g. navigates, and a late client instead gets a console\n"
+        "        warning.  Defaults to 4194304, or 0 to not cache.\n"
+        "\n"
         "  -d, --debug\t\tEnable debug output.\n"
         "  -h, --help\t\tPrint this usage information.\n"
         "  -V, --version\t\tPrint version information and exit.\n"
@@ -0,0 +1,118 @@
+// Google BSD license https://developers.google.com/google-bsd-license
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "json_scan.h"
+
+
+static const char *js_skip_space(const char *head, const char *tail) {
+  while (head < tail &&
+      (*head == ' ' || *head == '\t' || *head == '\n' || *head == '\r')) {
+    head++;
+  }
+  return head;
+}
+
+// @param head just after a string's opening quote
+// @result the closing quote, or NULL
+static const char *js_find_quote(const char *head, const char *tail) {
+  while (head < tail) {
+    char ch = *head;
+    if (ch == '"') {
+      return head;
+    }
+    head += (ch == '\\' ? 2 : 1);
+  }
+  return NULL;
+}
+
+// @result just after the value that starts at head, or NULL
+static const char *js_skip_value(const char *head, const char *tail) {
+  if (head >= tail) {
+    return NULL;
+  }
+  if (*head == '"') {
+    const char *quote = js_find_quote(head + 1, tail);
+    return (quote ? quote + 1 : NULL);
+  }
+  if (*head != '{' && *head != '[') {
+    // number, true, false or null
+    while (head < tail && *head != ',' && *head != '}' && *head != ']' &&
+        *head != ' ' && *head != '\t' && *head != '\n' && *head != '\r') {
+      head++;
+    }
+    return head;
+  }
+  // we needn't check that the brackets match, just count them
+  size_t depth = 0;
+  while (head < tail) {
+    char ch = *head++;
+    if (ch == '"') {
+      head = js_find_quote(head, tail);
+      if (!head) {
+        return NULL;
+      }
+      head++;
+    } else if (ch == '{' || ch == '[') {
+      depth++;
+    } else if ((ch == '}' || ch == ']') && --depth == 0) {
+      return head;
+    }
+  }
+  return NULL;
+}
+
+int js_find_key(const char *json, size_t length,
+    const char * const *keys, size_t num_keys,
+    const char **to_value, size_t *to_value_length) {
+  const char *tail = json + length;
+  const char *head = js_skip_space(json, tail);
+  if (head >= tail || *head++ != '{') {
+    return -1;
+  }
+  while (1) {
+    head = js_skip_space(head, tail);
+    if (head >= tail || *head != '"') {
+      return -1;  // includes the end of the object
+    }
+    const char *key = head + 1;
+    const char *key_tail = js_find_quote(key, tail);
+    if (!key_tail) {
+      return -1;
+    }
+    head = js_skip_space(key_tail + 1, tail);
+    if (head >= tail || *head++ != ':') {
+      return -1;
+    }
+    const char *value = js_skip_space(head, tail);
+    head = js_skip_value(value, tail);
+    if (!head) {
+      return -1;
+    }
+    size_t key_length = key_tail - key;
+    size_t i;
+    for (i = 0; i < num_keys; i++) {
+      if (strlen(keys[i]) == key_length &&
+          !strncmp(keys[i], key, key_length)) {
+        bool is_string = (*value == '"');
+        if (to_value) {
+          *to_value = value + (is_string ? 1 : 0);
+        }
+        if (to_value_length) {
+          *to_value_length = (head - value) - (is_string ? 2 : 0);
+        }
+        return (int)i;
+      }
+    }
+    head = js_skip_space(head, tail);
+    if (head >= tail || *head != ',') {
+      return -1;
+    }
+    head++;
+  }
+}
@@ -0,0 +1,41 @@
+// Google BSD license https://developers.google.com/google-bsd-license
+
+//
+// A minimal JSON scanner, for peeking at a few top-level fields of the
+// devtools messages that we relay, e.g. to see if a message is a command
+// response or an event, without parsing the whole message.
+//
+
+#ifndef JSON_SCAN_H
+#define	JSON_SCAN_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdlib.h>
+
+
+// Find the first of several keys in a JSON object's top level.
+//
+// We stop at the first match, so the cost depends on where the key is,
+// e.g. an event's "method" is typically first.  Keys are compared as-is,
+// without decoding escapes.
+//
+// @param json a JSON object
+// @param keys the keys to look for
+// @param to_value set to the matched key's value, which is the string's
+//   content (without quotes or unescaping) for a string, otherwise the
+//   value's JSON text
+// @result the index of the matched key, or -1 if none of the keys are
+//   found or the object is invalid
+int js_find_key(const char *json, size_t length,
+    const char * const *keys, size_t num_keys,
+    const char **to_value, size_t *to_value_length);
+
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* JSON_SCAN_H */
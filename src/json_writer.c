@@ -0,0 +1,151 @@
+// Google BSD license https://developers.google.com/google-bsd-license
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "json_writer.h"
+
+
+int jw_write(cb_t out, const char *s, size_t length) {
+  if (!length) {
+    return 0;
+  }
+  if (cb_ensure_capacity(out, length)) {
+    return -1;
+  }
+  memcpy(out->tail, s, length);
+  out->tail += length;
+  return 0;
+}
+
+int jw_puts(cb_t out, const char *s) {
+  return jw_write(out, s, strlen(s));
+}
+
+int jw_printf(cb_t out, const char *format, ...) {
+  // try the space that we already have, which is usually enough
+  size_t avail = (out->begin ? out->end - out->tail : 0);
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf((avail ? out->tail : NULL), avail, format, args);
+  va_end(args);
+  if (length < 0) {
+    return -1;
+  }
+  if ((size_t)length >= avail) {
+    if (cb_ensure_capacity(out, length + 1)) {
+      return -1;
+    }
+    va_start(args, format);
+    vsnprintf(out->tail, length + 1, format, args);
+    va_end(args);
+  }
+  out->tail += length;
+  return 0;
+}
+
+// Word-at-a-time tests, from "Bit Twiddling Hacks":
+//   JW_HAS_LESS(x, n) if any byte of x is < n, for n <= 128
+//   JW_HAS_ZERO(x) if any byte of x is 0
+#define JW_ONES ((uint64_t)0x0101010101010101ULL)
+#define JW_HIGHS ((uint64_t)0x8080808080808080ULL)
+#define JW_HAS_LESS(x, n) (((x) - JW_ONES * (n)) & ~(x) & JW_HIGHS)
+#define JW_HAS_ZERO(x) JW_HAS_LESS(x, 1)
+
+static inline int jw_is_json_special(unsigned char ch) {
+  return (ch < 0x20 || ch == '"' || ch == '\\');
+}
+
+// @result the length of s's prefix that can be copied as-is, i.e. the
+//   offset of the first control char, '"' or '\\', else length.
+static size_t jw_json_span(const char *s, size_t length) {
+  size_t i = 0;
+  // scan 8 bytes at a time until a word has a special char, which the
+  // compiler is free to widen further
+  for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+    uint64_t x;
+    memcpy(&x, s + i, sizeof(x));
+    if (JW_HAS_LESS(x, 0x20) ||
+        JW_HAS_ZERO(x ^ (JW_ONES * '"')) ||
+        JW_HAS_ZERO(x ^ (JW_ONES * '\\'))) {
+      break;
+    }
+  }
+  while (i < length && !jw_is_json_special((unsigned char)s[i])) {
+    i++;
+  }
+  return i;
+}
+
+int jw_escape_json(cb_t out, const char *s) {
+  if (!s) {
+    return 0;
+  }
+  size_t length = strlen(s);
+  // we usually copy in one go, so reserve for that
+  if (cb_ensure_capacity(out, length)) {
+    return -1;
+  }
+  const char *tail = s + length;
+  while (s < tail) {
+    size_t n = jw_json_span(s, tail - s);
+    if (jw_write(out, s, n)) {
+      return -1;
+    }
+    s += n;
+    if (s >= tail) {
+      break;
+    }
+    unsigned char ch = (unsigned char)*s++;
+    char esc;
+    switch (ch) {
+      case '"': esc = '"'; break;
+      case '\\': esc = '\\'; break;
+      case '\b': esc = 'b'; break;
+      case '\f': esc = 'f'; break;
+      case '\n': esc = 'n'; break;
+      case '\r': esc = 'r'; break;
+      case '\t': esc = 't'; break;
+      default: esc = 0; break;
+    }
+    if (esc ? jw_write(out, (char[]){'\\', esc}, 2) :
+        jw_printf(out, "\\u%04x", ch)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int jw_escape_html(cb_t out, const char *s) {
+  if (!s) {
+    return 0;
+  }
+  while (*s) {
+    size_t n = strcspn(s, "&<>\"'");
+    if (jw_write(out, s, n)) {
+      return -1;
+    }
+    s += n;
+    if (!*s) {
+      break;
+    }
+    const char *entity;
+    switch (*s++) {
+      case '&': entity = "&amp;"; break;
+      case '<': entity = "&lt;"; break;
+      case '>': entity = "&gt;"; break;
+      case '"': entity = "&quot;"; break;
+      default: entity = "&#39;"; break;
+    }
+    if (jw_puts(out, entity)) {
+      return -1;
+    }
+  }
+  return 0;
+}
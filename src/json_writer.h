@@ -0,0 +1,47 @@
+// Google BSD license https://developers.google.com/google-bsd-license
+
+//
+// A streaming JSON and HTML writer, which appends text to a char_buffer
+// and escapes strings as they're copied, so a response can be built in
+// one buffer without any intermediate strings, e.g.:
+//    jw_puts(out, "{\"title\": \"") ||
+//        jw_escape_json(out, title) ||
+//        jw_printf(out, "\", \"id\": %d}", id);
+//
+// All functions return 0 on success, or nonzero if out can't grow, which
+// lets a caller chain calls with "||".
+//
+
+#ifndef JSON_WRITER_H
+#define	JSON_WRITER_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdlib.h>
+
+#include "char_buffer.h"
+
+
+int jw_write(cb_t out, const char *s, size_t length);
+
+int jw_puts(cb_t out, const char *s);
+
+// Format in place at the end of out.
+int jw_printf(cb_t out, const char *format, ...);
+
+// Append a JSON string's content, i.e. without the quotes.
+// @param s UTF-8 text, or NULL for ""
+int jw_escape_json(cb_t out, const char *s);
+
+// Append text that's safe within an HTML element or quoted attribute.
+// @param s text, or NULL for ""
+int jw_escape_html(cb_t out, const char *s);
+
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* JSON_WRITER_H */
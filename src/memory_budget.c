@@ -0,0 +1,70 @@
+// Google BSD license https://developers.google.com/google-bsd-license
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+
+#include "memory_budget.h"
+
+
+static size_t mb_usage[MB_NUM_TAGS];
+static size_t mb_total;
+static size_t mb_limit;
+
+static const char *mb_names[MB_NUM_TAGS] = {
+  "other",
+  "sockets",
+  "websocket",
+  "webinspector",
+  "rpc",
+  "pages"
+};
+
+void mb_add(mb_tag tag, size_t length) {
+  if (tag < MB_NUM_TAGS) {
+    mb_usage[tag] += length;
+    mb_total += length;
+  }
+}
+
+void mb_remove(mb_tag tag, size_t length) {
+  if (tag < MB_NUM_TAGS) {
+    size_t n = length;
+    if (n > mb_usage[tag]) {
+      // an accounting bug, e.g. a buffer that was resized before it was
+      // tagged, so say so, but don't let our usage wrap around
+      fprintf(stderr, "memory_budget: removing %zu bytes from \"%s\","
+          " which only has %zu\n", length, mb_names[tag], mb_usage[tag]);
+      n = mb_usage[tag];
+    }
+    mb_usage[tag] -= n;
+    mb_total -= n;
+  }
+}
+
+size_t mb_get_usage(mb_tag tag) {
+  return (tag < MB_NUM_TAGS ? mb_usage[tag] : 0);
+}
+
+size_t mb_get_total() {
+  return mb_total;
+}
+
+const char *mb_get_name(mb_tag tag) {
+  return (tag < MB_NUM_TAGS ? mb_names[tag] : "?");
+}
+
+void mb_set_limit(size_t limit) {
+  mb_limit = limit;
+}
+
+size_t mb_get_limit() {
+  return mb_limit;
+}
+
+bool mb_has_room(size_t length) {
+  return (!mb_limit ||
+      (mb_total <= mb_limit && length <= mb_limit - mb_total));
+}
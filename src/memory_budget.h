@@ -0,0 +1,57 @@
+// Google BSD license https://developers.google.com/google-bsd-license
+
+//
+// Process-wide accounting of our buffer memory, tagged by subsystem, so we
+// can enforce an overall budget and report where our memory went.
+//
+// This only counts the buffers that grow with traffic, e.g. char_buffers,
+// send queues and page tables, not every small allocation.
+//
+
+#ifndef MEMORY_BUDGET_H
+#define	MEMORY_BUDGET_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+
+typedef uint8_t mb_tag;
+#define MB_OTHER         0
+#define MB_SOCKETS       1
+#define MB_WEBSOCKET     2
+#define MB_WEBINSPECTOR  3
+#define MB_RPC           4
+#define MB_PAGES         5
+#define MB_NUM_TAGS      6
+
+void mb_add(mb_tag tag, size_t length);
+
+void mb_remove(mb_tag tag, size_t length);
+
+size_t mb_get_usage(mb_tag tag);
+
+size_t mb_get_total();
+
+// @result e.g. "websocket"
+const char *mb_get_name(mb_tag tag);
+
+// @param limit our total budget in bytes, or 0 for no limit
+void mb_set_limit(size_t limit);
+
+size_t mb_get_limit();
+
+// Check if we can use length more bytes without exceeding our budget.
+// A length of 0 checks if we're currently within our budget.
+bool mb_has_room(size_t length);
+
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* MEMORY_BUDGET_H */
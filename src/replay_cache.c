@@ -0,0 +1,334 @@
+// Google BSD license https://developers.google.com/google-bsd-license
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "hash_table.h"
+#include "json_scan.h"
+#include "memory_budget.h"
+#include "replay_cache.h"
+#include "strndup.h"
+
+
+// The domains whose state we cache
+enum rc_domain {
+  RC_DEBUGGER,
+  RC_CSS,
+  RC_RUNTIME,
+  RC_NUM_DOMAINS
+};
+
+static const char *rc_domain_names[RC_NUM_DOMAINS] = {
+  "Debugger", "CSS", "Runtime"
+};
+
+enum rc_action {
+  RC_ADD,      // cache the event, keyed by its entity's id
+  RC_REMOVE,   // uncache the entity with this id
+  RC_CLEAR,    // uncache the domain
+  RC_NAVIGATE  // uncache everything, unless this is a subframe
+};
+
+struct rc_rule {
+  const char *method;
+  enum rc_action action;
+  enum rc_domain domain;
+  // path within "params" to the entity's id, or, for RC_NAVIGATE, to a
+  // subframe's parentId
+  const char *path[2];
+};
+
+static const struct rc_rule rc_rules[] = {
+  {"Debugger.scriptParsed", RC_ADD, RC_DEBUGGER, {"scriptId", NULL}},
+  {"Debugger.globalObjectCleared", RC_CLEAR, RC_DEBUGGER, {NULL, NULL}},
+  {"CSS.styleSheetAdded", RC_ADD, RC_CSS, {"header", "styleSheetId"}},
+  {"CSS.styleSheetRemoved", RC_REMOVE, RC_CSS, {"styleSheetId", NULL}},
+  {"Runtime.executionContextCreated", RC_ADD, RC_RUNTIME,
+    {"context", "id"}},
+  {"Runtime.executionContextDestroyed", RC_REMOVE, RC_RUNTIME,
+    {"executionContextId", NULL}},
+  {"Runtime.executionContextsCleared", RC_CLEAR, RC_RUNTIME, {NULL, NULL}},
+  {"Page.frameNavigated", RC_NAVIGATE, RC_NUM_DOMAINS,
+    {"frame", "parentId"}},
+  {NULL, RC_ADD, RC_NUM_DOMAINS, {NULL, NULL}}
+};
+
+// A cached event, in a domain's list in the order that we received them
+struct rc_event_struct;
+typedef struct rc_event_struct *rc_event_t;
+struct rc_event_struct {
+  rc_event_t prev;
+  rc_event_t next;
+  char *id;  // key in id_to_event
+  char *data;
+  size_t length;
+};
+
+struct rc_domain_struct {
+  bool is_enabled;
+  bool is_full;  // we gave up until the next clear
+  size_t length;
+  ht_t id_to_event;
+  rc_event_t head;
+  rc_event_t tail;
+};
+
+struct rc_private {
+  struct rc_domain_struct domains[RC_NUM_DOMAINS];
+  size_t memory;
+};
+
+
+static size_t rc_event_get_memory(rc_event_t event) {
+  return sizeof(struct rc_event_struct) + strlen(event->id) + 1 +
+      event->length;
+}
+
+static void rc_event_free(rc_event_t event) {
+  if (event) {
+    free(event->id);
+    free(event->data);
+    memset(event, 0, sizeof(struct rc_event_struct));
+    free(event);
+  }
+}
+
+static void rc_remove_event(rc_private_t my, struct rc_domain_struct *d,
+    rc_event_t event) {
+  ht_remove(d->id_to_event, event->id);
+  if (event->prev) {
+    event->prev->next = event->next;
+  } else {
+    d->head = event->next;
+  }
+  if (event->next) {
+    event->next->prev = event->prev;
+  } else {
+    d->tail = event->prev;
+  }
+  size_t memory = rc_event_get_memory(event);
+  d->length -= memory;
+  my->memory -= memory;
+  mb_remove(MB_PAGES, memory);
+  rc_event_free(event);
+}
+
+static void rc_clear_domain(rc_private_t my, struct rc_domain_struct *d) {
+  while (d->head) {
+    rc_remove_event(my, d, d->head);
+  }
+  d->is_full = false;
+}
+
+rc_t rc_new(size_t max_length) {
+  rc_t self = (rc_t)malloc(sizeof(struct rc_struct));
+  rc_private_t my = (rc_private_t)malloc(sizeof(struct rc_private));
+  if (!self || !my) {
+    free(self);
+    free(my);
+    return NULL;
+  }
+  memset(self, 0, sizeof(struct rc_struct));
+  memset(my, 0, sizeof(struct rc_private));
+  self->max_length = max_length;
+  self->private_state = my;
+  int i;
+  for (i = 0; i < RC_NUM_DOMAINS; i++) {
+    if (!(my->domains[i].id_to_event = ht_new(HT_STRING_KEYS))) {
+      rc_free(self);
+      return NULL;
+    }
+  }
+  return self;
+}
+
+void rc_free(rc_t self) {
+  if (self) {
+    rc_private_t my = self->private_state;
+    if (my) {
+      int i;
+      for (i = 0; i < RC_NUM_DOMAINS; i++) {
+        struct rc_domain_struct *d = my->domains + i;
+        if (d->id_to_event) {
+          rc_clear_domain(my, d);
+          ht_free(d->id_to_event);
+        }
+      }
+      memset(my, 0, sizeof(struct rc_private));
+      free(my);
+    }
+    memset(self, 0, sizeof(struct rc_struct));
+    free(self);
+  }
+}
+
+size_t rc_get_memory(rc_t self) {
+  return (self ? self->private_state->memory : 0);
+}
+
+// @result the cached domain with this name, else NULL
+static struct rc_domain_struct *rc_find_domain(rc_t self,
+    const char *domain, size_t length) {
+  int i;
+  for (i = 0; i < RC_NUM_DOMAINS; i++) {
+    if (strlen(rc_domain_names[i]) == length &&
+        !strncmp(domain, rc_domain_names[i], length)) {
+      return self->private_state->domains + i;
+    }
+  }
+  return NULL;
+}
+
+void rc_set_enabled(rc_t self, const char *domain, size_t length,
+    bool is_enabled) {
+  struct rc_domain_struct *d = rc_find_domain(self, domain, length);
+  if (!d || d->is_enabled == is_enabled) {
+    return;
+  }
+  d->is_enabled = is_enabled;
+  if (!is_enabled) {
+    // the device forgets this domain's state
+    rc_clear_domain(self->private_state, d);
+  }
+}
+
+int rc_replay(rc_t self, const char *domain, size_t length,
+    rc_replay_f on_replay, void *arg) {
+  struct rc_domain_struct *d = rc_find_domain(self, domain, length);
+  if (!d || !d->is_enabled) {
+    return 0;
+  }
+  rc_event_t event;
+  for (event = d->head; event; event = event->next) {
+    int ret = on_replay(arg, event->data, event->length);
+    if (ret) {
+      return ret;
+    }
+  }
+  return 0;
+}
+
+bool rc_is_full(rc_t self, const char *domain, size_t length) {
+  struct rc_domain_struct *d = rc_find_domain(self, domain, length);
+  return (d && d->is_full);
+}
+
+// @result the value at a path within an object, else NULL
+static const char *rc_find_path(const char *json, size_t length,
+    const char * const *path, size_t *to_length) {
+  const char *value = json;
+  size_t value_length = length;
+  int i;
+  for (i = 0; i < 2 && path[i]; i++) {
+    if (js_find_key(value, value_length, path + i, 1,
+          &value, &value_length)) {
+      return NULL;
+    }
+  }
+  *to_length = value_length;
+  return value;
+}
+
+static void rc_add_event(rc_t self, struct rc_domain_struct *d,
+    const char *id, size_t id_length, const char *data, size_t length) {
+  rc_private_t my = self->private_state;
+  rc_event_t event = (rc_event_t)malloc(sizeof(struct rc_event_struct));
+  if (!event) {
+    rc_clear_domain(my, d);
+    d->is_full = true;
+    return;
+  }
+  memset(event, 0, sizeof(struct rc_event_struct));
+  event->id = strndup(id, id_length);
+  event->data = (char *)malloc(length);
+  size_t memory = sizeof(struct rc_event_struct) + id_length + 1 + length;
+  if (!event->id || !event->data ||
+      d->length + memory > self->max_length || !mb_has_room(memory)) {
+    // a partial replay would be worse than none
+    rc_event_free(event);
+    rc_clear_domain(my, d);
+    d->is_full = true;
+    return;
+  }
+  memcpy(event->data, data, length);
+  event->length = length;
+  // the latest event describes the entity
+  rc_event_t old_event = (rc_event_t)ht_get_value(d->id_to_event, event->id);
+  if (old_event) {
+    rc_remove_event(my, d, old_event);
+  }
+  ht_put(d->id_to_event, event->id, event);
+  event->prev = d->tail;
+  if (d->tail) {
+    d->tail->next = event;
+  } else {
+    d->head = event;
+  }
+  d->tail = event;
+  d->length += memory;
+  my->memory += memory;
+  mb_add(MB_PAGES, memory);
+}
+
+void rc_on_event(rc_t self, const char *method, size_t method_length,
+    const char *data, size_t length) {
+  const struct rc_rule *rule;
+  for (rule = rc_rules; rule->method; rule++) {
+    if (strlen(rule->method) == method_length &&
+        !strncmp(method, rule->method, method_length)) {
+      break;
+    }
+  }
+  if (!rule->method) {
+    return;
+  }
+  rc_private_t my = self->private_state;
+  if (rule->action == RC_NAVIGATE) {
+    static const char *params_key[] = {"params"};
+    const char *params;
+    size_t params_length;
+    size_t n;
+    if (js_find_key(data, length, params_key, 1, &params, &params_length) ||
+        rc_find_path(params, params_length, rule->path, &n)) {
+      return;  // a subframe
+    }
+    int i;
+    for (i = 0; i < RC_NUM_DOMAINS; i++) {
+      rc_clear_domain(my, my->domains + i);
+    }
+    return;
+  }
+  struct rc_domain_struct *d = my->domains + rule->domain;
+  if (rule->action == RC_CLEAR) {
+    rc_clear_domain(my, d);
+    return;
+  }
+  if (!d->is_enabled || (rule->action == RC_ADD && d->is_full)) {
+    return;
+  }
+  static const char *params_key[] = {"params"};
+  const char *params;
+  size_t params_length;
+  const char *id;
+  size_t id_length;
+  if (js_find_key(data, length, params_key, 1, &params, &params_length) ||
+      !(id = rc_find_path(params, params_length, rule->path, &id_length))) {
+    return;
+  }
+  if (rule->action == RC_REMOVE) {
+    char *s = strndup(id, id_length);
+    rc_event_t event = (s ? (rc_event_t)ht_get_value(d->id_to_event, s) :
+        NULL);
+    free(s);
+    if (event) {
+      rc_remove_event(my, d, event);
+    }
+    return;
+  }
+  rc_add_event(self, d, id, id_length, data, length);
+}
@@ -0,0 +1,77 @@
+// Google BSD license https://developers.google.com/google-bsd-license
+
+//
+// A page's cache of "state-establishing" devtools events, e.g.
+// Debugger.scriptParsed, which the device only sends when a domain is
+// first enabled.  If several clients share a page's session, the device
+// ignores a late client's "Debugger.enable", so we replay the scripts
+// (and style sheets and execution contexts) that the page still has.
+//
+// We cache the latest event per entity, e.g. per scriptId, drop an entity
+// when the device removes it, and clear a domain when the device clears
+// it, e.g. on Runtime.executionContextsCleared, or all domains when the
+// main frame navigates.
+//
+
+#ifndef REPLAY_CACHE_H
+#define	REPLAY_CACHE_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+
+typedef int (*rc_replay_f)(void *arg, const char *data, size_t length);
+
+struct rc_private;
+typedef struct rc_private *rc_private_t;
+
+struct rc_struct {
+  // The most that we'll cache per domain, after which we give up on that
+  // domain until it's next cleared, so a replay is never partial.
+  size_t max_length;
+
+  rc_private_t private_state;
+};
+typedef struct rc_struct *rc_t;
+
+rc_t rc_new(size_t max_length);
+
+void rc_free(rc_t self);
+
+// Note that our clients have enabled a domain, e.g. "Debugger", so we
+// cache its events, or that none of them has it enabled any more, so the
+// device has forgotten its state and we clear it.  Other domains are
+// ignored.
+void rc_set_enabled(rc_t self, const char *domain, size_t length,
+    bool is_enabled);
+
+// Replay a domain's cached events, e.g. to a client that enables a domain
+// that another client has already enabled.
+// @result the on_replay error, else 0
+int rc_replay(rc_t self, const char *domain, size_t length,
+    rc_replay_f on_replay, void *arg);
+
+// @result true if we gave up on caching a domain, because it exceeded our
+// max_length or the memory budget, so a replay would send nothing
+bool rc_is_full(rc_t self, const char *domain, size_t length);
+
+// Note an event sent by the device, which we may cache or which may
+// remove cached events.
+// @param method the event's method, which is within data
+void rc_on_event(rc_t self, const char *method, size_t method_length,
+    const char *data, size_t length);
+
+// @result the bytes held by our cached events, which we charge to
+// MB_PAGES.
+size_t rc_get_memory(rc_t self);
+
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* REPLAY_CACHE_H */
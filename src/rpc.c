@@ -20,8 +20,36 @@
 #include <uuid/uuid.h>
 #endif
 
+#include "bplist.h"
+#include "char_buffer.h"
+#include "hash_table.h"
 #include "rpc.h"
 
+// Longest app_id or sender_id that we'll read in place, e.g. a UUID
+#define RPC_MAX_ID_LENGTH 256
+
+struct rpc_private {
+  // the message that we're sending
+  bp_t out;
+  // sender_id to rpc_prefix_t, for send_forwardSocketData
+  ht_t sender_id_to_prefix;
+  // messages with a selector that isn't in our rpc_selectors table
+  size_t num_unknown;
+};
+
+// A serialized _rpc_forwardSocketData: up to its WIRSocketDataKey value,
+// which is the same for every message from a given client to its page.
+struct rpc_prefix_struct {
+  char *sender_id;
+  char *connection_id;
+  char *app_id;
+  uint32_t page_id;
+  bp_t bp;
+};
+typedef struct rpc_prefix_struct *rpc_prefix_t;
+rpc_prefix_t rpc_new_prefix();
+void rpc_free_prefix(rpc_prefix_t prefix);
+
 
 rpc_status rpc_parse_app(const plist_t node, rpc_app_t *app);
 void rpc_free_app(rpc_app_t app);
@@ -93,31 +121,55 @@ rpc_status rpc_on_error(rpc_t self, const char *format, ...) {
   return RPC_ERROR;
 }
 
-plist_t rpc_new_args(const char *connection_id) {
-  plist_t ret = plist_new_dict();
-  if (connection_id) {
-    plist_dict_set_item(ret, "WIRConnectionIdentifierKey",
-        plist_new_string(connection_id));
+// Start an rpc in our output buffer, after space for the transport's
+// packet header.
+// @param prefix optional cached start of the rpc
+bp_t rpc_begin_out(rpc_t self, const bp_t prefix) {
+  bp_t bp = self->private_state->out;
+  cb_t out = bp->out;
+  cb_clear(out);
+  if (cb_ensure_capacity(out, RPC_BPLIST_PADDING)) {
+    return NULL;
   }
-  return ret;
+  out->tail += RPC_BPLIST_PADDING;
+  return (bp_begin(bp, prefix) ? NULL : bp);
 }
 
-/*
-   WIRFinalMessageKey
-   __selector
-   __argument
- */
-rpc_status rpc_send_msg(rpc_t self, const char *selector, plist_t args) {
-  if (!selector || !args) {
+// Finish and send our output buffer's rpc.
+rpc_status rpc_send_out(rpc_t self) {
+  bp_t bp = self->private_state->out;
+  if (bp_end(bp, 0) ||
+      cb_ensure_capacity(bp->out, RPC_BPLIST_PADDING)) {
+    return self->on_error(self, "Unable to serialize rpc");
+  }
+  return self->send_bplist(self, bp->out->head + bp->start, bp->length);
+}
+
+// Write the start of an rpc with the given __argument keys, i.e. objects:
+//   0: {#1: #3, #2: #4}
+//   1: "__selector"
+//   2: "__argument"
+//   3: selector
+//   4: {#5: #(5+num_keys), ...}
+//   5..: keys
+// The caller must then write one value per key, in the same order.
+rpc_status rpc_write_msg(bp_t bp, const char *selector,
+    const char **keys, size_t num_keys) {
+  if (!bp || !selector ||
+      bp_write_dict(bp, 2, 1) ||
+      bp_write_string(bp, "__selector") ||
+      bp_write_string(bp, "__argument") ||
+      bp_write_string(bp, selector) ||
+      bp_write_dict(bp, num_keys, 5)) {
     return RPC_ERROR;
   }
-  plist_t rpc_dict = plist_new_dict();
-  plist_dict_set_item(rpc_dict, "__selector",
-      plist_new_string(selector));
-  plist_dict_set_item(rpc_dict, "__argument", plist_copy(args));
-  rpc_status ret = self->send_plist(self, rpc_dict);
-  plist_free(rpc_dict);
-  return ret;
+  size_t i;
+  for (i = 0; i < num_keys; i++) {
+    if (bp_write_string(bp, keys[i])) {
+      return RPC_ERROR;
+    }
+  }
+  return RPC_SUCCESS;
 }
 
 /*
@@ -129,11 +181,13 @@ rpc_status rpc_send_reportIdentifier(rpc_t self, const char *connection_id) {
   if (!connection_id) {
     return RPC_ERROR;
   }
-  const char *selector = "_rpc_reportIdentifier:";
-  plist_t args = rpc_new_args(connection_id);
-  rpc_status ret = rpc_send_msg(self, selector, args);
-  plist_free(args);
-  return ret;
+  const char *keys[] = {"WIRConnectionIdentifierKey"};
+  bp_t bp = rpc_begin_out(self, NULL);
+  if (rpc_write_msg(bp, "_rpc_reportIdentifier:", keys, 1) ||
+      bp_write_string(bp, connection_id)) {
+    return self->on_error(self, "Unable to serialize rpc");
+  }
+  return rpc_send_out(self);
 }
 
 /*
@@ -146,11 +200,13 @@ rpc_status rpc_send_getConnectedApplications(rpc_t self,
   if (!connection_id) {
     return RPC_ERROR;
   }
-  const char *selector = "_rpc_getConnectedApplications:";
-  plist_t args = rpc_new_args(connection_id);
-  rpc_status ret = rpc_send_msg(self, selector, args);
-  plist_free(args);
-  return ret;
+  const char *keys[] = {"WIRConnectionIdentifierKey"};
+  bp_t bp = rpc_begin_out(self, NULL);
+  if (rpc_write_msg(bp, "_rpc_getConnectedApplications:", keys, 1) ||
+      bp_write_string(bp, connection_id)) {
+    return self->on_error(self, "Unable to serialize rpc");
+  }
+  return rpc_send_out(self);
 }
 
 /*
@@ -165,13 +221,15 @@ rpc_status rpc_send_forwardGetListing(rpc_t self, const char *connection_id,
   if (!connection_id || !app_id) {
     return RPC_ERROR;
   }
-  const char *selector = "_rpc_forwardGetListing:";
-  plist_t args = rpc_new_args(connection_id);
-  plist_dict_set_item(args, "WIRApplicationIdentifierKey",
-      plist_new_string(app_id));
-  rpc_status ret = rpc_send_msg(self, selector, args);
-  plist_free(args);
-  return ret;
+  const char *keys[] = {"WIRConnectionIdentifierKey",
+    "WIRApplicationIdentifierKey"};
+  bp_t bp = rpc_begin_out(self, NULL);
+  if (rpc_write_msg(bp, "_rpc_forwardGetListing:", keys, 2) ||
+      bp_write_string(bp, connection_id) ||
+      bp_write_string(bp, app_id)) {
+    return self->on_error(self, "Unable to serialize rpc");
+  }
+  return rpc_send_out(self);
 }
 
 /*
@@ -187,17 +245,18 @@ rpc_status rpc_send_forwardIndicateWebView(rpc_t self, const char *connection_id
   if (!connection_id || !app_id) {
     return RPC_ERROR;
   }
-  const char *selector = "_rpc_forwardIndicateWebView:";
-  plist_t args = rpc_new_args(connection_id);
-  plist_dict_set_item(args, "WIRApplicationIdentifierKey",
-      plist_new_string(app_id));
-  plist_dict_set_item(args, "WIRPageIdentifierKey",
-      plist_new_uint(page_id));
-  plist_dict_set_item(args, "WIRIndicateEnabledKey",
-      plist_new_bool(is_enabled));
-  rpc_status ret = rpc_send_msg(self, selector, args);
-  plist_free(args);
-  return ret;
+  const char *keys[] = {"WIRConnectionIdentifierKey",
+    "WIRApplicationIdentifierKey", "WIRPageIdentifierKey",
+    "WIRIndicateEnabledKey"};
+  bp_t bp = rpc_begin_out(self, NULL);
+  if (rpc_write_msg(bp, "_rpc_forwardIndicateWebView:", keys, 4) ||
+      bp_write_string(bp, connection_id) ||
+      bp_write_string(bp, app_id) ||
+      bp_write_uint(bp, page_id) ||
+      bp_write_bool(bp, is_enabled)) {
+    return self->on_error(self, "Unable to serialize rpc");
+  }
+  return rpc_send_out(self);
 }
 
 /*
@@ -214,19 +273,19 @@ rpc_status rpc_send_forwardSocketSetup(rpc_t self, const char *connection_id,
   if (!connection_id || !app_id || !sender_id) {
     return RPC_ERROR;
   }
-  const char *selector = "_rpc_forwardSocketSetup:";
-  plist_t args = rpc_new_args(connection_id);
-  plist_dict_set_item(args, "WIRApplicationIdentifierKey",
-      plist_new_string(app_id));
-  plist_dict_set_item(args, "WIRAutomaticallyPause",
-      plist_new_bool(false));
-  plist_dict_set_item(args, "WIRPageIdentifierKey",
-      plist_new_uint(page_id));
-  plist_dict_set_item(args, "WIRSenderKey",
-      plist_new_string(sender_id));
-  rpc_status ret = rpc_send_msg(self, selector, args);
-  plist_free(args);
-  return ret;
+  const char *keys[] = {"WIRConnectionIdentifierKey",
+    "WIRApplicationIdentifierKey", "WIRAutomaticallyPause",
+    "WIRPageIdentifierKey", "WIRSenderKey"};
+  bp_t bp = rpc_begin_out(self, NULL);
+  if (rpc_write_msg(bp, "_rpc_forwardSocketSetup:", keys, 5) ||
+      bp_write_string(bp, connection_id) ||
+      bp_write_string(bp, app_id) ||
+      bp_write_bool(bp, false) ||
+      bp_write_uint(bp, page_id) ||
+      bp_write_string(bp, sender_id)) {
+    return self->on_error(self, "Unable to serialize rpc");
+  }
+  return rpc_send_out(self);
 }
 
 /*
@@ -250,19 +309,49 @@ rpc_status rpc_send_forwardSocketData(rpc_t self, const char *connection_id,
   if (!connection_id || !app_id || !sender_id || !data) {
     return RPC_ERROR;
   }
-  const char *selector = "_rpc_forwardSocketData:";
-  plist_t args = rpc_new_args(connection_id);
-  plist_dict_set_item(args, "WIRApplicationIdentifierKey",
-      plist_new_string(app_id));
-  plist_dict_set_item(args, "WIRPageIdentifierKey",
-      plist_new_uint(page_id));
-  plist_dict_set_item(args, "WIRSenderKey",
-      plist_new_string(sender_id));
-  plist_dict_set_item(args, "WIRSocketDataKey",
-      plist_new_data(data, length));
-  rpc_status ret = rpc_send_msg(self, selector, args);
-  plist_free(args);
-  return ret;
+  rpc_private_t my = self->private_state;
+  rpc_prefix_t prefix = (rpc_prefix_t)ht_get_value(my->sender_id_to_prefix,
+      sender_id);
+  if (!prefix || prefix->page_id != page_id ||
+      strcmp(prefix->app_id, app_id) ||
+      strcmp(prefix->connection_id, connection_id)) {
+    if (prefix) {
+      ht_remove(my->sender_id_to_prefix, sender_id);
+      rpc_free_prefix(prefix);
+    }
+    prefix = rpc_new_prefix();
+    const char *keys[] = {"WIRConnectionIdentifierKey",
+      "WIRApplicationIdentifierKey", "WIRPageIdentifierKey",
+      "WIRSenderKey", "WIRSocketDataKey"};
+    if (!prefix ||
+        bp_begin(prefix->bp, NULL) ||
+        rpc_write_msg(prefix->bp, "_rpc_forwardSocketData:", keys, 5) ||
+        bp_write_string(prefix->bp, connection_id) ||
+        bp_write_string(prefix->bp, app_id) ||
+        bp_write_uint(prefix->bp, page_id) ||
+        bp_write_string(prefix->bp, sender_id)) {
+      rpc_free_prefix(prefix);
+      return self->on_error(self, "Unable to serialize rpc");
+    }
+    prefix->sender_id = strdup(sender_id);
+    prefix->connection_id = strdup(connection_id);
+    prefix->app_id = strdup(app_id);
+    prefix->page_id = page_id;
+    ht_put(my->sender_id_to_prefix, prefix->sender_id, prefix);
+  }
+  bp_t bp = rpc_begin_out(self, prefix->bp);
+  if (!bp || bp_write_data(bp, data, length)) {
+    return self->on_error(self, "Unable to serialize rpc");
+  }
+  return rpc_send_out(self);
+}
+
+void rpc_forget_sender(rpc_t self, const char *sender_id) {
+  if (self && sender_id) {
+    rpc_private_t my = self->private_state;
+    rpc_free_prefix((rpc_prefix_t)ht_remove(my->sender_id_to_prefix,
+          sender_id));
+  }
 }
 
 /*
@@ -274,17 +363,19 @@ rpc_status rpc_send_forwardDidClose(rpc_t self, const char *connection_id,
   if (!connection_id || !app_id || !sender_id) {
     return RPC_ERROR;
   }
-  const char *selector = "_rpc_forwardDidClose:";
-  plist_t args = rpc_new_args(connection_id);
-  plist_dict_set_item(args, "WIRApplicationIdentifierKey",
-      plist_new_string(app_id));
-  plist_dict_set_item(args, "WIRPageIdentifierKey",
-      plist_new_uint(page_id));
-  plist_dict_set_item(args, "WIRSenderKey",
-      plist_new_string(sender_id));
-  rpc_status ret = rpc_send_msg(self, selector, args);
-  plist_free(args);
-  return ret;
+  rpc_forget_sender(self, sender_id);
+  const char *keys[] = {"WIRConnectionIdentifierKey",
+    "WIRApplicationIdentifierKey", "WIRPageIdentifierKey",
+    "WIRSenderKey"};
+  bp_t bp = rpc_begin_out(self, NULL);
+  if (rpc_write_msg(bp, "_rpc_forwardDidClose:", keys, 4) ||
+      bp_write_string(bp, connection_id) ||
+      bp_write_string(bp, app_id) ||
+      bp_write_uint(bp, page_id) ||
+      bp_write_string(bp, sender_id)) {
+    return self->on_error(self, "Unable to serialize rpc");
+  }
+  return rpc_send_out(self);
 }
 
 
@@ -479,40 +570,96 @@ rpc_status rpc_recv_applicationUpdated(rpc_t self, const plist_t args) {
   return ret;
 }
 
+/*
+Selector dispatch table, indexed by a perfect hash of the selector's length
+and two of its characters.  All selectors start with "_rpc_", so we look at
+the first character after "_rpc_r" or "_rpc_a" and at the last character
+before the ':'.  A NULL recv means that we expect but ignore the message.
+
+The slots are fixed, so a new selector must be placed (and the hash
+possibly changed) such that no two selectors share a slot, otherwise the
+misplaced one will be counted as unknown.
+ */
+#define RPC_SELECTOR_SLOTS 16
+#define RPC_SELECTOR_HASH(s, length) \
+  (((length) + (uint8_t)(s)[6] + (uint8_t)(s)[(length) - 2]) & \
+   (RPC_SELECTOR_SLOTS - 1))
+#define RPC_SELECTOR(s, recv) {s, sizeof(s) - 1, recv}
+
+struct rpc_selector_struct {
+  const char *selector;
+  size_t length;
+  rpc_status (*recv)(rpc_t self, const plist_t args);
+};
+typedef const struct rpc_selector_struct *rpc_selector_t;
+
+static const struct rpc_selector_struct rpc_selectors[RPC_SELECTOR_SLOTS] = {
+  [1] = RPC_SELECTOR("_rpc_applicationDisconnected:",
+      rpc_recv_applicationDisconnected),
+  [2] = RPC_SELECTOR("_rpc_reportCurrentState:", NULL),
+  [3] = RPC_SELECTOR("_rpc_applicationSentListing:",
+      rpc_recv_applicationSentListing),
+  [6] = RPC_SELECTOR("_rpc_reportSetup:", rpc_recv_reportSetup),
+  [8] = RPC_SELECTOR("_rpc_reportConnectedDriverList:", NULL),
+  [10] = RPC_SELECTOR("_rpc_applicationSentData:",
+      rpc_recv_applicationSentData),
+  [12] = RPC_SELECTOR("_rpc_applicationUpdated:",
+      rpc_recv_applicationUpdated),
+  [13] = RPC_SELECTOR("_rpc_reportConnectedApplicationList:",
+      rpc_recv_reportConnectedApplicationList),
+  [14] = RPC_SELECTOR("_rpc_applicationConnected:",
+      rpc_recv_applicationConnected),
+};
+
+// Check, once, that every selector is in the slot that it hashes to.
+// @result the number of misplaced selectors
+static int rpc_check_selectors() {
+  static int misplaced = -1;
+  if (misplaced < 0) {
+    misplaced = 0;
+    size_t i;
+    for (i = 0; i < RPC_SELECTOR_SLOTS; i++) {
+      rpc_selector_t entry = rpc_selectors + i;
+      if (entry->selector &&
+          RPC_SELECTOR_HASH(entry->selector, entry->length) != i) {
+        fprintf(stderr, "rpc: selector %s is in slot %zu, not %zu\n",
+            entry->selector, i,
+            (size_t)RPC_SELECTOR_HASH(entry->selector, entry->length));
+        misplaced++;
+      }
+    }
+  }
+  return misplaced;
+}
+
+// Find a selector, which needn't be '\0'-terminated.
+rpc_selector_t rpc_find_selector(const char *selector, size_t length) {
+  if (length < 8) {
+    return NULL;
+  }
+  rpc_selector_t entry = rpc_selectors + RPC_SELECTOR_HASH(selector, length);
+  return (entry->length == length &&
+      !memcmp(entry->selector, selector, length) ? entry : NULL);
+}
+
 rpc_status rpc_recv_msg(rpc_t self, const char *selector, const plist_t args) {
   if (!selector) {
     return RPC_ERROR;
   }
 
-  if (!strcmp(selector, "_rpc_reportSetup:")) {
-    if (!rpc_recv_reportSetup(self, args)) {
-      return RPC_SUCCESS;
-    }
-  } else if (!strcmp(selector, "_rpc_reportConnectedApplicationList:")) {
-    if (!rpc_recv_reportConnectedApplicationList(self, args)) {
-      return RPC_SUCCESS;
-    }
-  } else if (!strcmp(selector, "_rpc_applicationConnected:")) {
-    if (!rpc_recv_applicationConnected(self, args)) {
-      return RPC_SUCCESS;
-    }
-  } else if (!strcmp(selector, "_rpc_applicationDisconnected:")) {
-    if (!rpc_recv_applicationDisconnected(self, args)) {
-      return RPC_SUCCESS;
-    }
-  } else if (!strcmp(selector, "_rpc_applicationSentListing:")) {
-    if (!rpc_recv_applicationSentListing(self, args)) {
-      return RPC_SUCCESS;
-    }
-  } else if (!strcmp(selector, "_rpc_applicationSentData:")) {
-    if (!rpc_recv_applicationSentData(self, args)) {
-      return RPC_SUCCESS;
-    }
-  } else if (!strcmp(selector, "_rpc_applicationUpdated:")) {
-    if (!rpc_recv_applicationUpdated(self, args)) {
-      return RPC_SUCCESS;
+  rpc_selector_t entry = rpc_find_selector(selector, strlen(selector));
+  if (!entry) {
+    // Newer devices may send messages that we don't know about, so count
+    // them instead of failing, and only report a few.
+    rpc_private_t my = self->private_state;
+    size_t n = ++my->num_unknown;
+    if (!(n & (n - 1))) {
+      self->on_error(self, "Ignored %zd unknown message%s, e.g. %s",
+          n, (n == 1 ? "" : "s"), selector);
     }
-  } else if (!strcmp(selector, "_rpc_reportConnectedDriverList:") || !strcmp(selector, "_rpc_reportCurrentState:")) {
+    return RPC_SUCCESS;
+  }
+  if (!entry->recv || !entry->recv(self, args)) {
     return RPC_SUCCESS;
   }
 
@@ -529,26 +676,131 @@ rpc_status rpc_recv_plist(rpc_t self, const plist_t rpc_dict) {
   char *selector = NULL;
   plist_get_string_val(plist_dict_get_item(rpc_dict, "__selector"), &selector);
   plist_t args = plist_dict_get_item(rpc_dict, "__argument");
-  return rpc_recv_msg(self, selector, args);
+  rpc_status ret = rpc_recv_msg(self, selector, args);
+  free(selector);
+  return ret;
+}
+
+// Copy a bplist dict's ASCII string value into a '\0'-terminated buffer.
+rpc_status rpc_read_string(bp_reader_t r, uint64_t dict_ref, const char *key,
+    char *to_buf, size_t buf_size) {
+  uint64_t ref;
+  const char *s;
+  size_t length;
+  if (bp_read_dict_item(r, dict_ref, key, &ref) ||
+      bp_read_ascii(r, ref, &s, &length) ||
+      length >= buf_size || memchr(s, '\0', length)) {
+    return RPC_ERROR;
+  }
+  memcpy(to_buf, s, length);
+  to_buf[length] = '\0';
+  return RPC_SUCCESS;
+}
+
+/*
+Nearly all of the device's messages are _rpc_applicationSentData:, so we
+read those in place, without a plist_t tree or any mallocs, and only pass
+the other (or unexpectedly encoded) messages to plist_from_bin.
+ */
+rpc_status rpc_recv_bplist(rpc_t self, const char *rpc_bin, size_t length) {
+  struct bp_reader_struct reader;
+  bp_reader_t r = &reader;
+  uint64_t ref;
+  uint64_t args;
+  const char *selector;
+  size_t selector_length;
+  rpc_selector_t entry;
+  char app_id[RPC_MAX_ID_LENGTH];
+  char dest_id[RPC_MAX_ID_LENGTH];
+  const char *data;
+  size_t data_length;
+  if (!bp_read(r, rpc_bin, length) &&
+      !bp_read_dict_item(r, r->top_ref, "__selector", &ref) &&
+      !bp_read_ascii(r, ref, &selector, &selector_length) &&
+      (entry = rpc_find_selector(selector, selector_length)) &&
+      entry->recv == rpc_recv_applicationSentData &&
+      !bp_read_dict_item(r, r->top_ref, "__argument", &args) &&
+      !rpc_read_string(r, args, "WIRApplicationIdentifierKey",
+        app_id, sizeof(app_id)) &&
+      !rpc_read_string(r, args, "WIRDestinationKey",
+        dest_id, sizeof(dest_id)) &&
+      !bp_read_dict_item(r, args, "WIRMessageDataKey", &ref) &&
+      !bp_read_data(r, ref, &data, &data_length)) {
+    return self->on_applicationSentData(self,
+        app_id, dest_id, data, data_length);
+  }
+
+  plist_t rpc_dict = NULL;
+  if (length <= UINT32_MAX) {
+    plist_from_bin(rpc_bin, (uint32_t)length, &rpc_dict);
+  }
+  if (!rpc_dict) {
+    return self->on_error(self, "Invalid rpc");
+  }
+  rpc_status ret = rpc_recv_plist(self, rpc_dict);
+  plist_free(rpc_dict);
+  return ret;
 }
 
 //
 // STRUCTS
 //
 
+void rpc_private_free(rpc_private_t my) {
+  if (my) {
+    bp_free(my->out);
+    if (my->sender_id_to_prefix) {
+      rpc_prefix_t *prefixes = (rpc_prefix_t *)ht_values(
+          my->sender_id_to_prefix);
+      rpc_prefix_t *p;
+      for (p = prefixes; *p; p++) {
+        rpc_free_prefix(*p);
+      }
+      free(prefixes);
+      ht_free(my->sender_id_to_prefix);
+    }
+    memset(my, 0, sizeof(struct rpc_private));
+    free(my);
+  }
+}
+
+rpc_private_t rpc_private_new() {
+  rpc_private_t my = (rpc_private_t)malloc(sizeof(struct rpc_private));
+  if (!my) {
+    return NULL;
+  }
+  memset(my, 0, sizeof(struct rpc_private));
+  my->out = bp_new();
+  my->sender_id_to_prefix = ht_new(HT_STRING_KEYS);
+  if (!my->out || !my->sender_id_to_prefix) {
+    rpc_private_free(my);
+    return NULL;
+  }
+  return my;
+}
+
 void rpc_free(rpc_t self) {
   if (self) {
+    rpc_private_free(self->private_state);
     memset(self, 0, sizeof(struct rpc_struct));
     free(self);
   }
 }
 
 rpc_t rpc_new() {
+  if (rpc_check_selectors()) {
+    return NULL;
+  }
   rpc_t self = (rpc_t)malloc(sizeof(struct rpc_struct));
   if (!self) {
     return NULL;
   }
   memset(self, 0, sizeof(struct rpc_struct));
+  self->private_state = rpc_private_new();
+  if (!self->private_state) {
+    rpc_free(self);
+    return NULL;
+  }
   self->send_reportIdentifier = rpc_send_reportIdentifier;
   self->send_getConnectedApplications = rpc_send_getConnectedApplications;
   self->send_forwardGetListing = rpc_send_forwardGetListing;
@@ -557,10 +809,36 @@ rpc_t rpc_new() {
   self->send_forwardSocketData = rpc_send_forwardSocketData;
   self->send_forwardDidClose = rpc_send_forwardDidClose;
   self->recv_plist = rpc_recv_plist;
+  self->recv_bplist = rpc_recv_bplist;
   self->on_error = rpc_on_error;
   return self;
 }
 
+rpc_prefix_t rpc_new_prefix() {
+  rpc_prefix_t prefix = (rpc_prefix_t)malloc(sizeof(struct rpc_prefix_struct));
+  if (!prefix) {
+    return NULL;
+  }
+  memset(prefix, 0, sizeof(struct rpc_prefix_struct));
+  prefix->bp = bp_new();
+  if (!prefix->bp) {
+    free(prefix);
+    return NULL;
+  }
+  return prefix;
+}
+
+void rpc_free_prefix(rpc_prefix_t prefix) {
+  if (prefix) {
+    free(prefix->sender_id);
+    free(prefix->connection_id);
+    free(prefix->app_id);
+    bp_free(prefix->bp);
+    memset(prefix, 0, sizeof(struct rpc_prefix_struct));
+    free(prefix);
+  }
+}
+
 rpc_app_t rpc_new_app() {
   rpc_app_t app = (rpc_app_t)malloc(sizeof(struct rpc_app_struct));
   if (app) {
@@ -21,6 +21,10 @@ typedef uint8_t rpc_status;
 #define RPC_ERROR 1
 #define RPC_SUCCESS 0
 
+// Scratch space before and after each rpc that we pass to send_bplist,
+// e.g. for the transport's packet header.
+#define RPC_BPLIST_PADDING 64
+
 // Create a UUID, e.g. "4B2550E4-13D6-4902-A48E-B45D5B23215B".
 rpc_status rpc_new_uuid(char **to_uuid);
 
@@ -47,6 +51,14 @@ typedef struct rpc_struct *rpc_t;
 rpc_t rpc_new();
 void rpc_free(rpc_t self);
 
+// Forget our cached send_forwardSocketData state for a sender that has
+// stopped, e.g. without a send_forwardDidClose because another inspector
+// took its page.
+void rpc_forget_sender(rpc_t self, const char *sender_id);
+
+struct rpc_private;
+typedef struct rpc_private *rpc_private_t;
+
 // WebInspector Remote Procedure Call formatter.
 struct rpc_struct {
 
@@ -57,7 +69,12 @@ struct rpc_struct {
     // Calls on_*.
     rpc_status (*recv_plist)(rpc_t self, const plist_t rpc_dict);
 
-    // Calls send_plist.
+    // Like recv_plist, but for a serialized rpc, which is often read in
+    // place.  The on_applicationSentData data may point into rpc_bin.
+    rpc_status (*recv_bplist)(rpc_t self, const char *rpc_bin,
+            size_t length);
+
+    // Calls send_bplist.
     rpc_status (*send_reportIdentifier)(rpc_t self,
             const char *connection_id);
 
@@ -90,7 +107,9 @@ struct rpc_struct {
     // Set these callbacks:
     //
 
-    rpc_status (*send_plist)(rpc_t self, plist_t rpc_dict);
+    // Send a serialized rpc.  The caller may overwrite the
+    // RPC_BPLIST_PADDING bytes before and after rpc_bin.
+    rpc_status (*send_bplist)(rpc_t self, char *rpc_bin, size_t length);
 
     rpc_status (*on_reportSetup)(rpc_t self);
 
@@ -115,6 +134,7 @@ struct rpc_struct {
 
     // For internal use only:
     rpc_status (*on_error)(rpc_t self, const char *format, ...);
+    rpc_private_t private_state;
 };
 
 
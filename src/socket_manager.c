@@ -7,6 +7,7 @@
 
 #define _GNU_SOURCE
 #include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -14,6 +15,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #ifdef WIN32
 #include <winsock2.h>
@@ -27,10 +29,14 @@
 #include <sys/stat.h>
 #include <sys/un.h>
 #endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include <openssl/ssl.h>
 
 #include "char_buffer.h"
+#include "memory_budget.h"
 #include "socket_manager.h"
 #include "hash_table.h"
 #include "strndup.h"
@@ -43,6 +49,48 @@
 #define RECV_FLAGS MSG_DONTWAIT
 #endif
 
+struct sm_timer;
+typedef struct sm_timer *sm_timer_t;
+struct sm_timer {
+  int id;
+  uint64_t seq;       // add order, which unlike the id doesn't wrap
+  uint64_t deadline;  // in sm_now_millis
+  void *value;        // for on_timer
+  size_t index;       // in my->timers
+};
+
+// a TLS record's maximum plaintext, which SSL_read returns in one call
+#define TLS_RECORD_LENGTH 16384
+
+// shrink a recv buffer after this many consecutive reads that used at most
+// a quarter of it
+#define RECV_SHRINK_COUNT 8
+
+struct sm_fd_info;
+typedef struct sm_fd_info *sm_fd_info_t;
+struct sm_fd_info {
+  char *buf;          // NULL to use my->tmp_buf
+  size_t length;      // buf length, or my->tmp_buf_length
+  size_t min_length;  // what we shrink back to
+  size_t num_small;   // consecutive small reads
+  uint64_t recv_bytes;
+  uint64_t recv_calls;
+  uint64_t ready_millis;  // when we stopped reading, if in my->pending_fds
+  uint64_t max_wait_millis;
+  size_t sendq_length;    // bytes in our fd_to_sendq entries
+  // corked output, see sm_send
+  char *cork;
+  size_t cork_length;
+  size_t cork_size;
+  bool is_cork_more;     // our last corked send had SM_SEND_MORE
+  int cork_recv_fd;      // the my->curr_recv_fd of our first corked send
+  uint64_t cork_millis;  // when our first corked send was made
+  // queued output past spill_length, see sm_sendq_spill
+  FILE *spill;
+  off_t spill_end;
+  size_t num_spilled;    // sendq entries in our spill file
+};
+
 struct sm_private {
   struct timeval timeout;
   // fds:
@@ -58,15 +106,37 @@ struct sm_private {
   ht_t fd_to_value;
   // fd to blocked sm_sendq_t, often empty
   ht_t fd_to_sendq;
-  // temp recv buffer, for use in sm_select:
+  // fd to sm_fd_info_t, for non-server fds
+  ht_t fd_to_info;
+  // temp recv buffer, for use in sm_select by fds without their own buffer:
   char *tmp_buf;
   size_t tmp_buf_length;
+  // total length of the sm_fd_info bufs
+  size_t recv_memory;
+  // fds with corked output
+  fd_set *cork_fds;
+  int num_corked;
+  // fds that used up their max_recv_per_pass and may have more to read
+  fd_set *pending_fds;
+  int num_pending;
+  // when select last returned
+  uint64_t select_millis;
+  // where our next select pass starts, to take turns
+  int first_fd;
   // temp fd sets, for use in sm_select:
   fd_set *tmp_send_fds;
   fd_set *tmp_recv_fds;
   fd_set *tmp_fail_fds;
   // current sm_select on_recv fd, only set when in sm_select loop
   int curr_recv_fd;
+  // pending timers, a binary min-heap ordered by deadline
+  sm_timer_t *timers;
+  size_t num_timers;
+  size_t max_timers;
+  // timer_id to sm_timer_t
+  ht_t id_to_timer;
+  int next_timer_id;
+  uint64_t next_timer_seq;
 };
 
 struct sm_sendq;
@@ -74,14 +144,24 @@ typedef struct sm_sendq *sm_sendq_t;
 struct sm_sendq {
   void *value;  // for on_sent
   int recv_fd;  // the my->recv_fd that caused this blocked send
+  sm_send_flags flags;
   char *begin;  // sm_send data
   char *head;
   char *tail;   // begin + sm_send length
+  // or, if is_spilled, the data's range in our fd's spill file
+  bool is_spilled;
+  off_t spill_head;
+  off_t spill_tail;
   sm_sendq_t next;
 };
-sm_sendq_t sm_sendq_new(int recv_fd, void *value, const char *data,
-    size_t length);
+sm_sendq_t sm_sendq_new(int recv_fd, sm_send_flags flags, void *value,
+    const char *data, size_t length);
 void sm_sendq_free(sm_sendq_t sendq);
+void sm_unblock(sm_t self, int recv_fd);
+void sm_fd_info_free(sm_private_t my, sm_fd_info_t info);
+sm_status sm_uncork(sm_t self, int fd, sm_fd_info_t info);
+sm_sendq_t sm_sendq_spill(sm_t self, sm_fd_info_t info, int recv_fd,
+    sm_send_flags flags, const char *data, size_t length);
 
 
 int sm_listen(int port) {
@@ -294,6 +374,16 @@ int sm_connect(const char *socket_addr) {
 }
 
 
+uint64_t sm_now_millis() {
+#ifdef WIN32
+  return GetTickCount64();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+#endif
+}
+
 sm_status sm_on_debug(sm_t self, const char *format, ...) {
   if (self->is_debug && *self->is_debug) {
     va_list args;
@@ -305,6 +395,92 @@ sm_status sm_on_debug(sm_t self, const char *format, ...) {
   return SM_SUCCESS;
 }
 
+// Set an fd's recv buffer length, within our limits.
+sm_status sm_resize_recv(sm_t self, sm_fd_info_t info, size_t length) {
+  sm_private_t my = self->private_state;
+  if (length > self->max_recv_length) {
+    length = self->max_recv_length;
+  }
+  if (length < my->tmp_buf_length) {
+    length = my->tmp_buf_length;
+  }
+  if (length == info->length) {
+    return SM_SUCCESS;
+  }
+  size_t old_memory = (info->buf ? info->length : 0);
+  size_t new_memory = (length > my->tmp_buf_length ? length : 0);
+  if (new_memory > old_memory &&
+      my->recv_memory - old_memory + new_memory > self->max_recv_memory) {
+    return SM_ERROR;
+  }
+  char *buf = NULL;
+  if (new_memory) {
+    // we needn't keep the old contents, so don't realloc
+    buf = (char *)malloc(new_memory);
+    if (!buf) {
+      return SM_ERROR;
+    }
+  }
+  free(info->buf);
+  info->buf = buf;
+  info->length = length;
+  my->recv_memory += new_memory;
+  my->recv_memory -= old_memory;
+  mb_add(MB_SOCKETS, new_memory);
+  mb_remove(MB_SOCKETS, old_memory);
+  sm_on_debug(self, "ss.recv_buffer length=%zd total=%zd", length,
+      my->recv_memory);
+  return SM_SUCCESS;
+}
+
+// Adapt an fd's recv buffer to its last read.
+void sm_adapt_recv(sm_t self, sm_fd_info_t info, size_t read_bytes) {
+  if (read_bytes >= info->length) {
+    // there's likely more, so read more per call
+    info->num_small = 0;
+    sm_resize_recv(self, info, 2 * info->length);
+  } else if (read_bytes <= info->length / 4 &&
+      info->length > info->min_length) {
+    if (++info->num_small >= RECV_SHRINK_COUNT) {
+      info->num_small = 0;
+      size_t length = info->length / 2;
+      sm_resize_recv(self, info,
+          (length > info->min_length ? length : info->min_length));
+    }
+  } else {
+    info->num_small = 0;
+  }
+}
+
+// Shrink all recv buffers back to their minimum.
+void sm_trim_recv(sm_t self) {
+  sm_private_t my = self->private_state;
+  if (!my->recv_memory) {
+    return;
+  }
+  sm_fd_info_t *infos = (sm_fd_info_t *)ht_values(my->fd_to_info);
+  sm_fd_info_t *info;
+  for (info = infos; *info; info++) {
+    (*info)->num_small = 0;
+    sm_resize_recv(self, *info, (*info)->min_length);
+  }
+  free(infos);
+}
+
+sm_status sm_get_fd_stats(sm_t self, int fd, sm_fd_stats_t to_stats) {
+  sm_private_t my = self->private_state;
+  sm_fd_info_t info = (sm_fd_info_t)ht_get_value(my->fd_to_info, HT_KEY(fd));
+  if (!info) {
+    return SM_ERROR;
+  }
+  to_stats->buffer_length = info->length;
+  to_stats->recv_bytes = info->recv_bytes;
+  to_stats->recv_calls = info->recv_calls;
+  to_stats->max_wait_millis = info->max_wait_millis;
+  to_stats->send_length = info->sendq_length + info->cork_length;
+  return SM_SUCCESS;
+}
+
 sm_status sm_add_fd(sm_t self, int fd, void *ssl_session, void *value,
     bool is_server) {
   sm_private_t my = self->private_state;
@@ -318,6 +494,22 @@ sm_status sm_add_fd(sm_t self, int fd, void *ssl_session, void *value,
   if (ssl_session != NULL && ht_put(my->fd_to_ssl, HT_KEY(fd), ssl_session)) {
     return SM_ERROR;
   }
+  if (!is_server) {
+    sm_fd_info_t info = (sm_fd_info_t)malloc(sizeof(struct sm_fd_info));
+    if (!info) {
+      return SM_ERROR;
+    }
+    memset(info, 0, sizeof(struct sm_fd_info));
+    info->length = my->tmp_buf_length;
+    info->min_length = my->tmp_buf_length;
+    if (ssl_session && info->min_length < TLS_RECORD_LENGTH) {
+      // read a whole record per SSL_read, if we can afford it
+      if (!sm_resize_recv(self, info, TLS_RECORD_LENGTH)) {
+        info->min_length = TLS_RECORD_LENGTH;
+      }
+    }
+    sm_fd_info_free(my, ht_put(my->fd_to_info, HT_KEY(fd), info));
+  }
   // is_server == getsockopt(..., SO_ACCEPTCONN, ...)?
   sm_on_debug(self, "ss.add%s_fd(%d)", (is_server ? "_server" : ""), fd);
   FD_SET(fd, my->all_fds);
@@ -340,12 +532,22 @@ sm_status sm_remove_fd(sm_t self, int fd) {
   if (!FD_ISSET(fd, my->all_fds)) {
     return SM_ERROR;
   }
+  if (FD_ISSET(fd, my->cork_fds)) {
+    // try to send our corked output, e.g. a websocket close frame, while
+    // a TLS fd still has its session to encrypt it
+    sm_uncork(self, fd, ht_get_value(my->fd_to_info, HT_KEY(fd)));
+  }
   SSL *ssl_session = (SSL *)ht_put(my->fd_to_ssl, HT_KEY(fd), NULL);
   if (ssl_session) {
     SSL_shutdown(ssl_session);
     SSL_free(ssl_session);
   }
   void *value = ht_put(my->fd_to_value, HT_KEY(fd), NULL);
+  if (FD_ISSET(fd, my->pending_fds)) {
+    FD_CLR(fd, my->pending_fds);
+    my->num_pending--;
+  }
+  sm_fd_info_free(my, ht_remove(my->fd_to_info, HT_KEY(fd)));
   bool is_server = FD_ISSET(fd, my->server_fds);
   sm_on_debug(self, "ss.remove%s_fd(%d)", (is_server ? "_server" : ""), fd);
   sm_status ret = self->on_close(self, fd, value, is_server);
@@ -368,6 +570,17 @@ sm_status sm_remove_fd(sm_t self, int fd) {
       my->max_fd--;
     }
   }
+  // drop our unsent data, otherwise it would block the next user of this fd
+  // number, and the recv_fds that it blocked would never be re-enabled
+  sm_sendq_t sendq = (sm_sendq_t)ht_remove(my->fd_to_sendq, HT_KEY(fd));
+  while (sendq) {
+    sm_sendq_t nextq = sendq->next;
+    int recv_fd = sendq->recv_fd;
+    sm_on_debug(self, "ss.sendq<%p> abort fd=%d", sendq, fd);
+    sm_sendq_free(sendq);
+    sm_unblock(self, recv_fd);
+    sendq = nextq;
+  }
   if (ht_size(my->fd_to_sendq)) {
     sm_sendq_t *qs = (sm_sendq_t *)ht_values(my->fd_to_sendq);
     sm_sendq_t *q;
@@ -386,8 +599,8 @@ sm_status sm_remove_fd(sm_t self, int fd) {
   return ret;
 }
 
-sm_status sm_send(sm_t self, int fd, const char *data, size_t length,
-    void* value) {
+sm_status sm_send_now(sm_t self, int fd, const char *data, size_t length,
+    sm_send_flags flags, void* value) {
   sm_private_t my = self->private_state;
   sm_sendq_t sendq = (sm_sendq_t)ht_get_value(my->fd_to_sendq, HT_KEY(fd));
   const char *head = data;
@@ -432,8 +645,28 @@ sm_status sm_send(sm_t self, int fd, const char *data, size_t length,
   }
   // we can't send this now, so queue it
   int curr_recv_fd = my->curr_recv_fd;
-  sm_sendq_t newq = sm_sendq_new(curr_recv_fd, value, head, tail - head);
-  if (sendq) {
+  sm_fd_info_t info = (sm_fd_info_t)ht_get_value(my->fd_to_info, HT_KEY(fd));
+  sm_sendq_t newq = NULL;
+  if (info && self->spill_length && !value &&
+      info->sendq_length + (tail - head) > self->spill_length) {
+    newq = sm_sendq_spill(self, info, curr_recv_fd, flags, head,
+        tail - head);
+  }
+  if (!newq) {
+    newq = sm_sendq_new(curr_recv_fd, flags, value, head, tail - head);
+  }
+  if (sendq && (flags & SM_SEND_PRIORITY)) {
+    // skip the rest of the message that we're sending, which may be
+    // partially sent, then the priority sends that were queued before us
+    while (sendq->next && (sendq->flags & SM_SEND_MORE)) {
+      sendq = sendq->next;
+    }
+    while (sendq->next && (sendq->next->flags & SM_SEND_PRIORITY)) {
+      sendq = sendq->next;
+    }
+    newq->next = sendq->next;
+    sendq->next = newq;
+  } else if (sendq) {
     while (sendq->next) {
       sendq = sendq->next;
     }
@@ -442,6 +675,9 @@ sm_status sm_send(sm_t self, int fd, const char *data, size_t length,
     ht_put(my->fd_to_sendq, HT_KEY(fd), newq);
     FD_SET(fd, my->send_fds);
   }
+  if (info) {
+    info->sendq_length += tail - head;
+  }
   sm_on_debug(self, "ss.sendq<%p> new fd=%d recv_fd=%d length=%zd"
       ", prev=<%p>", newq, fd, curr_recv_fd, tail - head, sendq);
   if (curr_recv_fd && FD_ISSET(curr_recv_fd, my->recv_fds)) {
@@ -456,6 +692,210 @@ sm_status sm_send(sm_t self, int fd, const char *data, size_t length,
   return SM_SUCCESS;
 }
 
+// Send an fd's corked output.
+sm_status sm_uncork(sm_t self, int fd, sm_fd_info_t info) {
+  sm_private_t my = self->private_state;
+  if (!FD_ISSET(fd, my->cork_fds)) {
+    return SM_SUCCESS;
+  }
+  FD_CLR(fd, my->cork_fds);
+  my->num_corked--;
+  size_t length = info->cork_length;
+  info->cork_length = 0;
+  sm_on_debug(self, "ss.uncork fd=%d len=%zd", fd, length);
+  // if this blocks, it should block the recv_fd that caused it
+  int curr_recv_fd = my->curr_recv_fd;
+  my->curr_recv_fd = info->cork_recv_fd;
+  sm_status ret = sm_send_now(self, fd, info->cork, length,
+      (info->is_cork_more ? SM_SEND_MORE : 0), NULL);
+  my->curr_recv_fd = curr_recv_fd;
+  return ret;
+}
+
+// Send all corked output, at the end of our select pass.
+void sm_uncork_all(sm_t self) {
+  sm_private_t my = self->private_state;
+  int fd;
+  for (fd = 0; fd <= my->max_fd && my->num_corked > 0; fd++) {
+    if (FD_ISSET(fd, my->cork_fds)) {
+      sm_fd_info_t info = (sm_fd_info_t)ht_get_value(my->fd_to_info,
+          HT_KEY(fd));
+      if (sm_uncork(self, fd, info)) {
+        self->remove_fd(self, fd);
+      }
+    }
+  }
+}
+
+sm_status sm_send(sm_t self, int fd, const char *data, size_t length,
+    sm_send_flags flags, void* value) {
+  sm_private_t my = self->private_state;
+  sm_fd_info_t info = (sm_fd_info_t)ht_get_value(my->fd_to_info, HT_KEY(fd));
+  if (!info || !self->max_cork_millis || value ||
+      (flags & SM_SEND_PRIORITY)) {
+    // keep our output in order
+    if (info && sm_uncork(self, fd, info)) {
+      return SM_ERROR;
+    }
+    return sm_send_now(self, fd, data, length, flags, value);
+  }
+  if (info->cork_length + length > self->max_cork_length) {
+    if (sm_uncork(self, fd, info)) {
+      return SM_ERROR;
+    }
+    if (length >= self->max_cork_length) {
+      return sm_send_now(self, fd, data, length, flags, value);
+    }
+  }
+  if (info->cork_length + length > info->cork_size) {
+    size_t size = (info->cork_size ? 2 * info->cork_size : 4096);
+    while (size < info->cork_length + length) {
+      size *= 2;
+    }
+    char *cork = (char *)realloc(info->cork, size);
+    if (!cork) {
+      return SM_ERROR;
+    }
+    mb_add(MB_SOCKETS, size - info->cork_size);
+    info->cork = cork;
+    info->cork_size = size;
+  }
+  memcpy(info->cork + info->cork_length, data, length);
+  info->cork_length += length;
+  info->is_cork_more = (flags & SM_SEND_MORE ? true : false);
+  uint64_t now = sm_now_millis();
+  if (!FD_ISSET(fd, my->cork_fds)) {
+    FD_SET(fd, my->cork_fds);
+    my->num_corked++;
+    info->cork_recv_fd = my->curr_recv_fd;
+    info->cork_millis = now;
+  } else if (now - info->cork_millis >= self->max_cork_millis) {
+    // this select pass is taking a while, so don't wait for it
+    return sm_uncork(self, fd, info);
+  }
+  return SM_SUCCESS;
+}
+
+//
+// TIMERS
+//
+
+void sm_timer_swap(sm_private_t my, size_t i, size_t j) {
+  sm_timer_t t = my->timers[i];
+  my->timers[i] = my->timers[j];
+  my->timers[j] = t;
+  my->timers[i]->index = i;
+  my->timers[j]->index = j;
+}
+
+void sm_timer_sift(sm_private_t my, size_t i) {
+  // move up
+  while (i > 0 &&
+      my->timers[i]->deadline < my->timers[(i - 1) / 2]->deadline) {
+    sm_timer_swap(my, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+  // move down
+  while (1) {
+    size_t min = i;
+    size_t child = 2 * i + 1;
+    if (child < my->num_timers &&
+        my->timers[child]->deadline < my->timers[min]->deadline) {
+      min = child;
+    }
+    child++;
+    if (child < my->num_timers &&
+        my->timers[child]->deadline < my->timers[min]->deadline) {
+      min = child;
+    }
+    if (min == i) {
+      break;
+    }
+    sm_timer_swap(my, i, min);
+    i = min;
+  }
+}
+
+int sm_add_timer(sm_t self, unsigned int delay_millis, void *value) {
+  sm_private_t my = self->private_state;
+  if (my->num_timers >= my->max_timers) {
+    size_t new_max = (my->max_timers ? 2 * my->max_timers : 16);
+    sm_timer_t *new_timers = (sm_timer_t *)realloc(my->timers,
+        new_max * sizeof(sm_timer_t));
+    if (!new_timers) {
+      return -1;
+    }
+    my->timers = new_timers;
+    my->max_timers = new_max;
+  }
+  sm_timer_t timer = (sm_timer_t)malloc(sizeof(struct sm_timer));
+  if (!timer) {
+    return -1;
+  }
+  do {
+    timer->id = my->next_timer_id;
+    // ids are positive, so wrap back to 1 rather than overflow
+    my->next_timer_id = (my->next_timer_id < INT_MAX ?
+        my->next_timer_id + 1 : 1);
+  } while (ht_get_value(my->id_to_timer, HT_KEY(timer->id)));
+  timer->seq = my->next_timer_seq++;
+  timer->deadline = sm_now_millis() + delay_millis;
+  timer->value = value;
+  timer->index = my->num_timers++;
+  my->timers[timer->index] = timer;
+  ht_put(my->id_to_timer, HT_KEY(timer->id), timer);
+  sm_timer_sift(my, timer->index);
+  sm_on_debug(self, "ss.add_timer(%d) delay=%u", timer->id, delay_millis);
+  return timer->id;
+}
+
+sm_status sm_remove_timer(sm_t self, int timer_id) {
+  sm_private_t my = self->private_state;
+  sm_timer_t timer = (sm_timer_t)ht_remove(my->id_to_timer,
+      HT_KEY(timer_id));
+  if (!timer) {
+    return SM_ERROR;
+  }
+  size_t i = timer->index;
+  size_t last = --my->num_timers;
+  if (i != last) {
+    sm_timer_swap(my, i, last);
+    sm_timer_sift(my, i);
+  }
+  free(timer);
+  return SM_SUCCESS;
+}
+
+// @result millis until the next timer is due, or -1 if there are no timers
+int64_t sm_next_timeout(sm_t self) {
+  sm_private_t my = self->private_state;
+  if (!my->num_timers) {
+    return -1;
+  }
+  uint64_t now = sm_now_millis();
+  uint64_t deadline = my->timers[0]->deadline;
+  return (deadline > now ? (int64_t)(deadline - now) : 0);
+}
+
+void sm_fire_timers(sm_t self) {
+  sm_private_t my = self->private_state;
+  uint64_t now = sm_now_millis();
+  // timers added by our on_timer callbacks must wait for the next select,
+  // otherwise a zero-delay timer that re-adds itself would spin forever
+  uint64_t end_seq = my->next_timer_seq;
+  while (my->num_timers) {
+    sm_timer_t timer = my->timers[0];
+    if (timer->deadline > now || timer->seq >= end_seq) {
+      break;
+    }
+    int timer_id = timer->id;
+    void *value = timer->value;
+    sm_remove_timer(self, timer_id);
+    sm_on_debug(self, "ss.timer(%d)", timer_id);
+    self->on_timer(self, timer_id, value);
+  }
+}
+
 void sm_accept(sm_t self, int fd) {
   sm_private_t my = self->private_state;
   while (1) {
@@ -493,11 +933,159 @@ void sm_accept(sm_t self, int fd) {
   }
 }
 
+// Re-enable a recv_fd that was blocked by a sendq, if no other sendq's
+// still match it.
+void sm_unblock(sm_t self, int recv_fd) {
+  sm_private_t my = self->private_state;
+  if (!recv_fd || !FD_ISSET(recv_fd, my->all_fds)) {
+    return;
+  }
+  bool found = false;
+  if (ht_size(my->fd_to_sendq)) {
+    sm_sendq_t *qs = (sm_sendq_t *)ht_values(my->fd_to_sendq);
+    sm_sendq_t *q;
+    for (q = qs; *q && !found; q++) {
+      sm_sendq_t sq;
+      for (sq = *q; sq && !found; sq = sq->next) {
+        found |= (sq->recv_fd == recv_fd);
+      }
+    }
+    free(qs);
+  }
+  if (!found) {
+    sm_on_debug(self, "ss.sendq re-enable recv_fd=%d", recv_fd);
+    FD_SET(recv_fd, my->recv_fds);
+    // don't FD_SET(tmp_recv_fds), since maybe there was no input
+    // instead, let the next select loop pick it up
+  }
+}
+
+// Queue a send in the fd's spill file, instead of in memory, because the
+// fd already has spill_length bytes queued, e.g. a slow client that's
+// pulling a heap snapshot.
+// @result the new sendq, or NULL to queue the data in memory after all
+sm_sendq_t sm_sendq_spill(sm_t self, sm_fd_info_t info, int recv_fd,
+    sm_send_flags flags, const char *data, size_t length) {
+#ifdef WIN32
+  return NULL;
+#else
+  if (!info->spill) {
+    info->spill = tmpfile();
+    if (!info->spill) {
+      perror("Unable to create spill file");
+      return NULL;
+    }
+    info->spill_end = 0;
+  }
+  int spill_fd = fileno(info->spill);
+  size_t written = 0;
+  while (written < length) {
+    ssize_t n = pwrite(spill_fd, data + written, length - written,
+        info->spill_end + written);
+    if (n <= 0) {
+      perror("Unable to write spill file");
+      return NULL;
+    }
+    written += n;
+  }
+  sm_sendq_t ret = (sm_sendq_t)malloc(sizeof(struct sm_sendq));
+  if (!ret) {
+    return NULL;
+  }
+  memset(ret, 0, sizeof(struct sm_sendq));
+  ret->recv_fd = recv_fd;
+  ret->flags = flags;
+  ret->is_spilled = true;
+  ret->spill_head = info->spill_end;
+  ret->spill_tail = info->spill_end + length;
+  info->spill_end += length;
+  info->num_spilled++;
+  sm_on_debug(self, "ss.spill length=%zd file=%zd", length,
+      (size_t)info->spill_end);
+  return ret;
+#endif
+}
+
+// Send as much as we can of a spilled sendq, straight from its file.
+sm_status sm_resend_spilled(sm_t self, int fd, void *ssl_session,
+    sm_fd_info_t info, sm_sendq_t sendq) {
+#ifdef WIN32
+  return SM_ERROR;
+#else
+  if (!info || !info->spill) {
+    return SM_ERROR;
+  }
+  int spill_fd = fileno(info->spill);
+  while (sendq->spill_head < sendq->spill_tail) {
+    size_t length = sendq->spill_tail - sendq->spill_head;
+    ssize_t sent_bytes;
+#ifdef __linux__
+    if (ssl_session == NULL) {
+      off_t offset = sendq->spill_head;
+      sent_bytes = sendfile(fd, spill_fd, &offset, length);
+    } else
+#endif
+    {
+      char buf[TLS_RECORD_LENGTH];
+      if (length > sizeof(buf)) {
+        length = sizeof(buf);
+      }
+      ssize_t read_bytes = pread(spill_fd, buf, length, sendq->spill_head);
+      if (read_bytes <= 0) {
+        perror("Unable to read spill file");
+        return SM_ERROR;
+      }
+      if (ssl_session == NULL) {
+        sent_bytes = send(fd, buf, read_bytes, 0);
+      } else {
+        sent_bytes = SSL_write((SSL *)ssl_session, buf, read_bytes);
+        if (sent_bytes <= 0) {
+          int err = SSL_get_error(ssl_session, sent_bytes);
+          if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+            perror("ssl spill send failed");
+            return SM_ERROR;
+          }
+          break;
+        }
+      }
+    }
+    if (sent_bytes <= 0) {
+      if (sent_bytes && errno != EWOULDBLOCK) {
+        perror("spill send failed");
+        return SM_ERROR;
+      }
+      break;
+    }
+    sendq->spill_head += sent_bytes;
+    info->sendq_length -= sent_bytes;
+  }
+  return SM_SUCCESS;
+#endif
+}
+
 void sm_resend(sm_t self, int fd) {
   sm_private_t my = self->private_state;
   sm_sendq_t sendq = ht_get_value(my->fd_to_sendq, HT_KEY(fd));
   void *ssl_session = ht_get_value(my->fd_to_ssl, HT_KEY(fd));
+  sm_fd_info_t info = (sm_fd_info_t)ht_get_value(my->fd_to_info, HT_KEY(fd));
   while (sendq) {
+    if (sendq->is_spilled) {
+      if (sm_resend_spilled(self, fd, ssl_session, info, sendq)) {
+        self->remove_fd(self, fd);
+        return;
+      }
+      if (sendq->spill_head < sendq->spill_tail) {
+        sm_on_debug(self, "ss.sendq<%p> defer spilled len=%zd", sendq,
+            (size_t)(sendq->spill_tail - sendq->spill_head));
+        break;
+      }
+      if (info && !--info->num_spilled) {
+        // our file is empty, so release its disk space
+        fclose(info->spill);
+        info->spill = NULL;
+        info->spill_end = 0;
+      }
+    }
     char *head = sendq->head;
     char *tail = sendq->tail;
     // send as much as we can without blocking
@@ -534,6 +1122,9 @@ void sm_resend(sm_t self, int fd) {
         }
       }
       head += sent_bytes;
+      if (info) {
+        info->sendq_length -= sent_bytes;
+      }
     }
     sendq->head = head;
     if (head < tail) {
@@ -548,29 +1139,9 @@ void sm_resend(sm_t self, int fd) {
       FD_CLR(fd, my->send_fds);
     }
     int recv_fd = sendq->recv_fd;
-    if (recv_fd && FD_ISSET(recv_fd, my->all_fds)) {
-      // if no other sendq's match this blocked recv_fd, re-enable it
-      bool found = false;
-      if (ht_size(my->fd_to_sendq)) {
-        sm_sendq_t *qs = (sm_sendq_t *)ht_values(my->fd_to_sendq);
-        sm_sendq_t *q;
-        for (q = qs; *q && !found; q++) {
-          sm_sendq_t sq;
-          for (sq = *q; sq && !found; sq = sq->next) {
-            found |= (sq->recv_fd == recv_fd);
-          }
-        }
-        free(qs);
-      }
-      if (!found) {
-        sm_on_debug(self, "ss.sendq<%p> re-enable recv_fd=%d", sendq, recv_fd);
-        FD_SET(recv_fd, my->recv_fds);
-        // don't FD_SET(tmp_recv_fds), since maybe there was no input
-        // instead, let the next select loop pick it up
-      }
-    }
     sm_on_debug(self, "ss.sendq<%p> free, next=<%p>", sendq, nextq);
     sm_sendq_free(sendq);
+    sm_unblock(self, recv_fd);
     sendq = nextq;
   }
 }
@@ -579,10 +1150,46 @@ void sm_recv(sm_t self, int fd) {
   sm_private_t my = self->private_state;
   my->curr_recv_fd = fd;
   void *ssl_session = ht_get_value(my->fd_to_ssl, HT_KEY(fd));
+  void *value = ht_get_value(my->fd_to_value, HT_KEY(fd));
+  sm_fd_info_t info = (sm_fd_info_t)ht_get_value(my->fd_to_info, HT_KEY(fd));
+  if (info) {
+    // see how long we've kept this fd waiting
+    uint64_t ready_millis = my->select_millis;
+    if (FD_ISSET(fd, my->pending_fds)) {
+      FD_CLR(fd, my->pending_fds);
+      my->num_pending--;
+      ready_millis = info->ready_millis;
+    }
+    uint64_t now = sm_now_millis();
+    uint64_t wait_millis = (now > ready_millis ? now - ready_millis : 0);
+    if (wait_millis > info->max_wait_millis) {
+      info->max_wait_millis = wait_millis;
+      sm_on_debug(self, "ss.recv fd=%d max_wait=%llums", fd,
+          (unsigned long long)wait_millis);
+    }
+  }
+  size_t total_bytes = 0;
   while (1) {
+    info = (sm_fd_info_t)ht_get_value(my->fd_to_info, HT_KEY(fd));
+    char *buf = (info && info->buf ? info->buf : my->tmp_buf);
+    size_t buf_length = (info ? info->length : my->tmp_buf_length);
+    bool is_ours = true;
+    if (self->on_recv_buffer) {
+      char *recv_buf = NULL;
+      size_t recv_length = 0;
+      if (self->on_recv_buffer(self, fd, value, &recv_buf, &recv_length)) {
+        self->remove_fd(self, fd);
+        break;
+      }
+      if (recv_buf && recv_length) {
+        buf = recv_buf;
+        buf_length = recv_length;
+        is_ours = false;
+      }
+    }
     ssize_t read_bytes;
     if (ssl_session == NULL) {
-      read_bytes = recv(fd, my->tmp_buf, my->tmp_buf_length, RECV_FLAGS);
+      read_bytes = recv(fd, buf, buf_length, RECV_FLAGS);
       if (read_bytes < 0) {
 #ifdef WIN32
         if (WSAGetLastError() != WSAEWOULDBLOCK) {
@@ -596,7 +1203,7 @@ void sm_recv(sm_t self, int fd) {
         break;
       }
     } else {
-      read_bytes = SSL_read((SSL *)ssl_session, my->tmp_buf, my->tmp_buf_length);
+      read_bytes = SSL_read((SSL *)ssl_session, buf, (int)buf_length);
       if (read_bytes <= 0) {
         if (SSL_get_error(ssl_session, read_bytes) != SSL_ERROR_WANT_READ &&
             SSL_get_error(ssl_session, read_bytes) != SSL_ERROR_WANT_WRITE) {
@@ -606,13 +1213,30 @@ void sm_recv(sm_t self, int fd) {
         break;
       }
     }
-    sm_on_debug(self, "ss.recv fd=%d len=%zd", fd, read_bytes);
-    void *value = ht_get_value(my->fd_to_value, HT_KEY(fd));
+    sm_on_debug(self, "ss.recv fd=%d len=%zd buf=%zd", fd, read_bytes,
+        buf_length);
     if (read_bytes == 0 ||
-        self->on_recv(self, fd, value, my->tmp_buf, read_bytes)) {
+        self->on_recv(self, fd, value, buf, read_bytes)) {
       self->remove_fd(self, fd);
       break;
     }
+    // on_recv may have removed our fd, so look up our info again
+    info = (sm_fd_info_t)ht_get_value(my->fd_to_info, HT_KEY(fd));
+    if (info) {
+      info->recv_bytes += read_bytes;
+      info->recv_calls++;
+      if (is_ours) {
+        sm_adapt_recv(self, info, read_bytes);
+      }
+      total_bytes += read_bytes;
+      if (self->max_recv_per_pass && total_bytes >= self->max_recv_per_pass) {
+        // give the other fds a turn, and come back in our next pass
+        FD_SET(fd, my->pending_fds);
+        my->num_pending++;
+        info->ready_millis = sm_now_millis();
+        break;
+      }
+    }
   }
   my->curr_recv_fd = 0;
 }
@@ -624,7 +1248,29 @@ int sm_select(sm_t self, int timeout_secs) {
     return -1;
   }
 
-  my->timeout.tv_sec = timeout_secs;
+  // send anything that was corked outside of our last pass
+  sm_uncork_all(self);
+
+  // wake up in time for our next timer
+  int64_t timeout_millis = (int64_t)timeout_secs * 1000;
+  int64_t timer_millis = sm_next_timeout(self);
+  if (timer_millis >= 0 && timer_millis < timeout_millis) {
+    timeout_millis = timer_millis;
+  }
+  if (my->num_pending) {
+    // don't wait if we already have more to read, but not for the pending
+    // fds that a blocked send has disabled, which would make us spin until
+    // that send is done
+    int fd;
+    for (fd = 0; fd <= my->max_fd; fd++) {
+      if (FD_ISSET(fd, my->pending_fds) && FD_ISSET(fd, my->recv_fds)) {
+        timeout_millis = 0;
+        break;
+      }
+    }
+  }
+  my->timeout.tv_sec = timeout_millis / 1000;
+  my->timeout.tv_usec = (timeout_millis % 1000) * 1000;
 
   // copy into tmp
   memcpy(my->tmp_send_fds, my->send_fds, SIZEOF_FD_SET);
@@ -632,9 +1278,29 @@ int sm_select(sm_t self, int timeout_secs) {
   memcpy(my->tmp_fail_fds, my->all_fds, SIZEOF_FD_SET);
   int num_ready = select(my->max_fd + 1, my->tmp_recv_fds,
       my->tmp_send_fds, my->tmp_fail_fds, &my->timeout);
+  my->select_millis = sm_now_millis();
+
+  if (num_ready >= 0 && my->num_pending) {
+    // add the fds that we left unfinished in our last pass, unless a blocked
+    // send has since disabled them
+    int fd;
+    for (fd = 0; fd <= my->max_fd; fd++) {
+      if (FD_ISSET(fd, my->pending_fds) && FD_ISSET(fd, my->recv_fds) &&
+          !FD_ISSET(fd, my->tmp_recv_fds)) {
+        FD_SET(fd, my->tmp_recv_fds);
+        if (!FD_ISSET(fd, my->tmp_send_fds) &&
+            !FD_ISSET(fd, my->tmp_fail_fds)) {
+          num_ready++;
+        }
+      }
+    }
+  }
 
-  // see if any sockets are readable
   if (num_ready == 0) {
+    // we're idle, so release our grown recv buffers
+    sm_trim_recv(self);
+    sm_fire_timers(self);
+    sm_uncork_all(self);
     return 0; // timeout, select again
   }
   if (num_ready < 0) {
@@ -652,12 +1318,20 @@ int sm_select(sm_t self, int timeout_secs) {
       return -errno;
     }
 #endif
+    sm_fire_timers(self);
+    sm_uncork_all(self);
     return 0;
   }
 
+  // see if any sockets are readable, starting where our last pass did, so
+  // the fds take turns at going first
   int num_left = num_ready;
-  int fd;
-  for (fd = 0; fd <= my->max_fd && num_left > 0; fd++) {
+  int num_fds = my->max_fd + 1;
+  int first_fd = (my->first_fd < num_fds ? my->first_fd : 0);
+  my->first_fd = first_fd + 1;
+  int i;
+  for (i = 0; i < num_fds && num_left > 0; i++) {
+    int fd = (first_fd + i) % num_fds;
     bool can_send = FD_ISSET(fd, my->tmp_send_fds);
     bool can_recv = FD_ISSET(fd, my->tmp_recv_fds);
     bool is_fail = FD_ISSET(fd, my->tmp_fail_fds);
@@ -678,6 +1352,8 @@ int sm_select(sm_t self, int timeout_secs) {
       }
     }
   }
+  sm_fire_timers(self);
+  sm_uncork_all(self);
   return num_ready;
 }
 
@@ -689,6 +1365,10 @@ sm_status sm_cleanup(sm_t self) {
       self->remove_fd(self, fd);
     }
   }
+  // drop any timers that our on_close callbacks didn't remove
+  while (my->num_timers) {
+    sm_remove_timer(self, my->timers[0]->id);
+  }
   return SM_SUCCESS;
 }
 
@@ -705,9 +1385,26 @@ void sm_private_free(sm_private_t my) {
     free(my->tmp_send_fds);
     free(my->tmp_recv_fds);
     free(my->tmp_fail_fds);
+    free(my->cork_fds);
+    free(my->pending_fds);
     ht_free(my->fd_to_ssl);
     ht_free(my->fd_to_value);
     ht_free(my->fd_to_sendq);
+    if (my->fd_to_info) {
+      sm_fd_info_t *infos = (sm_fd_info_t *)ht_values(my->fd_to_info);
+      sm_fd_info_t *info;
+      for (info = infos; info && *info; info++) {
+        sm_fd_info_free(my, *info);
+      }
+      free(infos);
+      ht_free(my->fd_to_info);
+    }
+    size_t i;
+    for (i = 0; i < my->num_timers; i++) {
+      free(my->timers[i]);
+    }
+    free(my->timers);
+    ht_free(my->id_to_timer);
     free(my->tmp_buf);
     memset(my, 0, sizeof(struct sm_private));
     free(my);
@@ -727,14 +1424,20 @@ sm_private_t sm_private_new(size_t buf_length) {
   my->tmp_send_fds = (fd_set *)malloc(SIZEOF_FD_SET);
   my->tmp_recv_fds = (fd_set *)malloc(SIZEOF_FD_SET);
   my->tmp_fail_fds = (fd_set *)malloc(SIZEOF_FD_SET);
+  my->cork_fds = (fd_set *)malloc(SIZEOF_FD_SET);
+  my->pending_fds = (fd_set *)malloc(SIZEOF_FD_SET);
   my->fd_to_ssl = ht_new(HT_INT_KEYS);
   my->fd_to_value = ht_new(HT_INT_KEYS);
   my->fd_to_sendq = ht_new(HT_INT_KEYS);
+  my->fd_to_info = ht_new(HT_INT_KEYS);
+  my->id_to_timer = ht_new(HT_INT_KEYS);
   my->tmp_buf = (char *)calloc(buf_length, sizeof(char *));
   if (!my->tmp_buf || !my->all_fds || !my->server_fds ||
       !my->send_fds || !my->recv_fds ||
       !my->tmp_send_fds || !my->tmp_recv_fds || !my->tmp_fail_fds ||
-      !my->fd_to_ssl || !my->fd_to_value || !my->fd_to_sendq) {
+      !my->cork_fds || !my->pending_fds ||
+      !my->fd_to_ssl || !my->fd_to_value || !my->fd_to_sendq ||
+      !my->fd_to_info || !my->id_to_timer) {
     sm_private_free(my);
     return NULL;
   }
@@ -745,21 +1448,26 @@ sm_private_t sm_private_new(size_t buf_length) {
   FD_ZERO(my->tmp_send_fds);
   FD_ZERO(my->tmp_recv_fds);
   FD_ZERO(my->tmp_fail_fds);
+  FD_ZERO(my->cork_fds);
+  FD_ZERO(my->pending_fds);
   my->max_fd = -1;
   my->timeout.tv_sec = 5;
   my->timeout.tv_usec = 0;
   my->tmp_buf_length = buf_length;
+  my->next_timer_id = 1;
   return my;
 }
 
-sm_sendq_t sm_sendq_new(int recv_fd, void *value, const char *data,
-    size_t length) {
+sm_sendq_t sm_sendq_new(int recv_fd, sm_send_flags flags, void *value,
+    const char *data, size_t length) {
   sm_sendq_t ret = (sm_sendq_t)malloc(sizeof(struct sm_sendq));
   memset(ret, 0, sizeof(struct sm_sendq));
   ret->recv_fd = recv_fd;
+  ret->flags = flags;
   ret->value = value;
   ret->begin = (char *)malloc(length);
   memcpy(ret->begin, data, length);
+  mb_add(MB_SOCKETS, length);
   ret->head = ret->begin;
   ret->tail = ret->begin + length;
   return ret;
@@ -767,12 +1475,30 @@ sm_sendq_t sm_sendq_new(int recv_fd, void *value, const char *data,
 
 void sm_sendq_free(sm_sendq_t sendq) {
   if (sendq) {
+    mb_remove(MB_SOCKETS, sendq->tail - sendq->begin);
     free(sendq->begin);
     memset(sendq, 0, sizeof(struct sm_sendq));
     free(sendq);
   }
 }
 
+void sm_fd_info_free(sm_private_t my, sm_fd_info_t info) {
+  if (info) {
+    if (info->buf) {
+      my->recv_memory -= info->length;
+      mb_remove(MB_SOCKETS, info->length);
+      free(info->buf);
+    }
+    mb_remove(MB_SOCKETS, info->cork_size);
+    free(info->cork);
+    if (info->spill) {
+      fclose(info->spill);
+    }
+    memset(info, 0, sizeof(struct sm_fd_info));
+    free(info);
+  }
+}
+
 sm_t sm_new(size_t buf_length) {
   sm_private_t my = sm_private_new(buf_length);
   if (!my) {
@@ -787,8 +1513,15 @@ sm_t sm_new(size_t buf_length) {
   self->add_fd = sm_add_fd;
   self->remove_fd = sm_remove_fd;
   self->send = sm_send;
+  self->add_timer = sm_add_timer;
+  self->remove_timer = sm_remove_timer;
   self->select = sm_select;
   self->cleanup = sm_cleanup;
+  self->get_fd_stats = sm_get_fd_stats;
+  self->max_recv_length = 256 * 1024;
+  self->max_recv_memory = 4 * 1024 * 1024;
+  self->max_cork_length = 64 * 1024;
+  self->max_recv_per_pass = 256 * 1024;
   self->private_state = my;
   return self;
 }
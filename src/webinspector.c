@@ -19,6 +19,7 @@
 #include <winsock2.h>
 #else
 #include <sys/fcntl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #endif
@@ -29,6 +30,7 @@
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
 
+#include "bplist.h"
 #include "char_buffer.h"
 #include "idevice_ext.h"
 #include "webinspector.h"
@@ -42,10 +44,35 @@
 // some arbitrarly limit, to catch bad packets
 #define MAX_BODY_LENGTH 1<<26
 
+// where a WIRPartialMessageKey's data is, relative to wi_private.keep
+struct wi_chunk {
+  size_t offset;
+  size_t length;
+};
+
 struct wi_private {
   bool partials_supported;
   cb_t in;
+  // Partial messages are left in our input buffer, from keep to keep +
+  // keep_length, and only joined when the final message arrives.
+  const char *keep;
+  size_t keep_length;
+  struct wi_chunk *chunks;
+  size_t num_chunks;
+  size_t max_chunks;
+  // the keep_length of our last joined message, to pre-size "in" for the
+  // next one
+  size_t keep_hint;
+  size_t chunks_length;  // bytes in our chunks
+  // or, once they pass spill_length, in a temp file, see wi_spill
+  FILE *spill;
+  size_t spilled_length;
+  char *spill_map;  // the joined message, while we pass it on
   cb_t partial;
+  // for send_plist
+  cb_t out;
+  // for send_bplist's partial/final message wrappers
+  bp_t wrapper;
   bool has_length;
   size_t body_length;
 };
@@ -231,78 +258,95 @@ wi_status wi_on_debug(wi_t self, const char *message,
   return WI_SUCCESS;
 }
 
+// Send a packet body, which has space for our 4-byte header before it.
+wi_status wi_send_body(wi_t self, char *body, size_t body_length) {
+  char *packet = body - 4;
+  // write big-endian int
+  packet[0] = ((body_length >> 24) & 0xFF);
+  packet[1] = ((body_length >> 16) & 0xFF);
+  packet[2] = ((body_length >> 8) & 0xFF);
+  packet[3] = (body_length & 0xFF);
+  size_t length = body_length + 4;
+  wi_on_debug(self, "wi.send_packet", packet, length);
+  return self->send_packet(self, packet, length);
+}
+
 /*
    WIRFinalMessageKey
    __selector
    __argument
  */
-wi_status wi_send_plist(wi_t self, plist_t rpc_dict) {
+wi_status wi_send_bplist(wi_t self, char *rpc_bin, size_t rpc_len) {
   wi_private_t my = self->private_state;
-  char *rpc_bin = NULL;
-  uint32_t rpc_len = 0;
-  plist_to_bin(rpc_dict, &rpc_bin, &rpc_len);
+  if (!my->partials_supported) {
+    return wi_send_body(self, rpc_bin, rpc_len);
+  }
   // if our message is <8k, we'll send a single final_msg,
-  // otherwise we'll send <8k partial_msg "chunks" then a final_msg "chunk"
-  wi_status ret = WI_ERROR;
-  uint32_t i;
-  for (i = 0; ; i += MAX_RPC_LEN) {
-    bool is_partial = false;
-    char *data = NULL;
-    uint32_t data_len = 0;
-    if (!my->partials_supported) {
-      data = rpc_bin;
-      data_len = rpc_len;
-      rpc_bin = NULL;
-    } else {
-      is_partial = (rpc_len - i > MAX_RPC_LEN);
-      plist_t wi_dict = plist_new_dict();
-      plist_t wi_rpc = plist_new_data(rpc_bin + i,
-          (is_partial ? MAX_RPC_LEN : rpc_len - i));
-      plist_dict_set_item(wi_dict,
-          (is_partial ? "WIRPartialMessageKey" : "WIRFinalMessageKey"), wi_rpc);
-      plist_to_bin(wi_dict, &data, &data_len);
-      plist_free(wi_dict);
-      wi_dict = NULL;
-      wi_rpc = NULL; // freed by wi_dict
-      if (!data) {
-        break;
-      }
+  // otherwise we'll send <8k partial_msg "chunks" then a final_msg "chunk".
+  //
+  // We wrap each chunk in place:
+  //   [packet header][wrapper prefix][chunk][wrapper suffix]
+  // where the prefix overwrites our padding or the tail of the previous
+  // (already sent) chunk, and the suffix overwrites our padding or the
+  // head of the next chunk, which we restore after the send.
+  bp_t bp = my->wrapper;
+  size_t i = 0;
+  while (1) {
+    bool is_partial = (rpc_len - i > MAX_RPC_LEN);
+    size_t chunk_len = (is_partial ? MAX_RPC_LEN : rpc_len - i);
+    char *chunk = rpc_bin + i;
+
+    cb_clear(bp->out);
+    if (bp_begin(bp, NULL) ||
+        bp_write_dict(bp, 1, 1) ||
+        bp_write_string(bp,
+          (is_partial ? "WIRPartialMessageKey" : "WIRFinalMessageKey")) ||
+        bp_write_data(bp, NULL, chunk_len)) {
+      return self->on_error(self, "Unable to wrap rpc");
     }
-
-    size_t length = data_len + 4;
-    char *out_head = (char*)malloc(length * sizeof(char));
-    if (!out_head) {
-      if (my->partials_supported) {
-        free(data);
-      }
-      break;
+    size_t prefix_len = bp->out->tail - bp->out->head;
+    if (bp_end(bp, 0)) {
+      return self->on_error(self, "Unable to wrap rpc");
     }
-    char *out_tail = out_head;
-
-    // write big-endian int
-    *out_tail++ = ((data_len >> 24) & 0xFF);
-    *out_tail++ = ((data_len >> 16) & 0xFF);
-    *out_tail++ = ((data_len >> 8) & 0xFF);
-    *out_tail++ = (data_len & 0xFF);
-
-    // write data
-    memcpy(out_tail, data, data_len);
-    free(data);
-
-    wi_on_debug(self, "wi.send_packet", out_head, length);
-    wi_status not_sent = self->send_packet(self, out_head, length);
-    free(out_head);
-    if (not_sent) {
-      break;
+    const char *suffix = bp->out->head + prefix_len;
+    size_t suffix_len = bp->out->tail - suffix;
+    if (prefix_len + 4 > WI_BPLIST_PADDING ||
+        suffix_len > WI_BPLIST_PADDING) {
+      return self->on_error(self, "Invalid rpc wrapper");
     }
 
-    if (!is_partial) {
-      ret = WI_SUCCESS;
-      break;
+    char saved[WI_BPLIST_PADDING];
+    memcpy(chunk - prefix_len, bp->out->head, prefix_len);
+    memcpy(saved, chunk + chunk_len, suffix_len);
+    memcpy(chunk + chunk_len, suffix, suffix_len);
+    wi_status ret = wi_send_body(self, chunk - prefix_len,
+        prefix_len + chunk_len + suffix_len);
+    memcpy(chunk + chunk_len, saved, suffix_len);
+    if (ret || !is_partial) {
+      return ret;
     }
+    i += chunk_len;
+  }
+}
+
+wi_status wi_send_plist(wi_t self, const plist_t rpc_dict) {
+  wi_private_t my = self->private_state;
+  char *rpc_bin = NULL;
+  uint32_t rpc_len = 0;
+  plist_to_bin(rpc_dict, &rpc_bin, &rpc_len);
+  if (!rpc_bin) {
+    return self->on_error(self, "plist_to_bin failed");
+  }
+  cb_t out = my->out;
+  cb_clear(out);
+  if (cb_ensure_capacity(out, rpc_len + 2 * WI_BPLIST_PADDING)) {
+    free(rpc_bin);
+    return self->on_error(self, "Out of memory");
   }
+  char *body = out->tail + WI_BPLIST_PADDING;
+  memcpy(body, rpc_bin, rpc_len);
   free(rpc_bin);
-  return ret;
+  return wi_send_bplist(self, body, rpc_len);
 }
 
 //
@@ -330,73 +374,193 @@ wi_status wi_parse_length(wi_t self, const char *buf, size_t *to_length) {
   return WI_SUCCESS;
 }
 
-wi_status wi_parse_plist(wi_t self, const char *from_buf, size_t length,
-    plist_t *to_rpc_dict, bool *to_is_partial) {
+#ifndef WIN32
+// Append a partial message's data to our spill file, first moving the
+// partial messages that we've kept in our input buffer, so a huge message,
+// e.g. a heap snapshot, is joined on disk instead of in memory.
+wi_status wi_spill(wi_t self, const char *data, size_t length) {
   wi_private_t my = self->private_state;
-  *to_is_partial = false;
-  *to_rpc_dict = NULL;
+  if (!my->spill) {
+    my->spill = tmpfile();
+    if (!my->spill) {
+      return self->on_error(self, "Unable to create spill file");
+    }
+    my->spilled_length = 0;
+    size_t i;
+    for (i = 0; i < my->num_chunks; i++) {
+      struct wi_chunk *chunk = my->chunks + i;
+      if (fwrite(my->keep + chunk->offset, 1, chunk->length, my->spill) !=
+          chunk->length) {
+        return self->on_error(self, "Unable to write spill file");
+      }
+      my->spilled_length += chunk->length;
+    }
+    // wi_recv_loop can now discard them
+    my->num_chunks = 0;
+    my->chunks_length = 0;
+  }
+  if (length && fwrite(data, 1, length, my->spill) != length) {
+    return self->on_error(self, "Unable to write spill file");
+  }
+  my->spilled_length += length;
+  return WI_SUCCESS;
+}
+#endif
+
+// Discard our spilled message, if any.
+void wi_end_spill(wi_t self) {
+#ifndef WIN32
+  wi_private_t my = self->private_state;
+  if (my->spill_map) {
+    munmap(my->spill_map, my->spilled_length);
+    my->spill_map = NULL;
+  }
+  if (my->spill) {
+    fclose(my->spill);
+    my->spill = NULL;
+  }
+  my->spilled_length = 0;
+#endif
+}
+
+// Find the rpc in a packet body, unwrapping and joining partial messages.
+// @param from_buf a packet body in our input buffer, which we'll keep if
+//   it's a partial message
+// @param to_rpc_bin set to the full rpc, which is either in from_buf or our
+//   partial buffer, or NULL if this is a partial message
+wi_status wi_parse_rpc(wi_t self, const char *from_buf, size_t length,
+    const char **to_rpc_bin, size_t *to_rpc_len) {
+  wi_private_t my = self->private_state;
+  *to_rpc_bin = NULL;
+  *to_rpc_len = 0;
 
   if (!my->partials_supported) {
-    plist_from_bin(from_buf, length, to_rpc_dict);
-  } else {
-    plist_t wi_dict = NULL;
-    plist_from_bin(from_buf, length, &wi_dict);
-    if (!wi_dict) {
+    *to_rpc_bin = from_buf;
+    *to_rpc_len = length;
+    return WI_SUCCESS;
+  }
+
+  // read the {WIR*MessageKey: <data>} wrapper in place
+  struct bp_reader_struct reader;
+  bp_reader_t r = &reader;
+  uint64_t ref;
+  bool is_partial = false;
+  if (bp_read(r, from_buf, length)) {
+    return WI_ERROR;
+  }
+  if (bp_read_dict_item(r, r->top_ref, "WIRFinalMessageKey", &ref)) {
+    if (bp_read_dict_item(r, r->top_ref, "WIRPartialMessageKey", &ref)) {
       return WI_ERROR;
     }
-    plist_t wi_rpc = plist_dict_get_item(wi_dict, "WIRFinalMessageKey");
-    if (!wi_rpc) {
-      wi_rpc = plist_dict_get_item(wi_dict, "WIRPartialMessageKey");
-      if (!wi_rpc) {
-        return WI_ERROR;
-      }
-      *to_is_partial = true;
-    }
+    is_partial = true;
+  }
+  const char *rpc_bin;
+  size_t rpc_len;
+  if (bp_read_data(r, ref, &rpc_bin, &rpc_len)) {
+    return WI_ERROR;
+  }
+  // assert rpc_len < MAX_RPC_LEN?
 
-    uint64_t rpc_len = 0;
-    char *rpc_bin = NULL;
-    plist_get_data_val(wi_rpc, &rpc_bin, &rpc_len);
-    plist_free(wi_dict); // also frees wi_rpc
-    if (!rpc_bin) {
+#ifndef WIN32
+  if (my->spill ||
+      (is_partial && self->spill_length &&
+       my->chunks_length + rpc_len > self->spill_length)) {
+    if (wi_spill(self, rpc_bin, rpc_len)) {
       return WI_ERROR;
     }
-    // assert rpc_len < MAX_RPC_LEN?
+    if (is_partial) {
+      return WI_SUCCESS;
+    }
+    // map the joined message, so its pages are backed by our file
+    if (fflush(my->spill)) {
+      return self->on_error(self, "Unable to write spill file");
+    }
+    void *map = mmap(NULL, my->spilled_length, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE, fileno(my->spill), 0);
+    if (map == MAP_FAILED) {
+      return self->on_error(self, "Unable to map spill file");
+    }
+    my->spill_map = (char *)map;
+    *to_rpc_bin = my->spill_map;
+    *to_rpc_len = my->spilled_length;
+    return WI_SUCCESS;
+  }
+#endif
 
-    size_t p_length = my->partial->tail - my->partial->head;
-    if (*to_is_partial || p_length) {
-      if (cb_ensure_capacity(my->partial, rpc_len)) {
+  if (is_partial) {
+    // record the slice, wi_recv_loop will keep the packet
+    if (!my->num_chunks) {
+      my->keep = from_buf - 4;
+    }
+    if (my->num_chunks >= my->max_chunks) {
+      size_t new_max = (my->max_chunks ? 2 * my->max_chunks : 16);
+      struct wi_chunk *new_chunks = (struct wi_chunk *)realloc(my->chunks,
+          new_max * sizeof(struct wi_chunk));
+      if (!new_chunks) {
         return self->on_error(self, "Out of memory");
       }
-      memcpy(my->partial->tail, rpc_bin, rpc_len);
-      my->partial->tail += rpc_len;
-      p_length += rpc_len;
-      free(rpc_bin);
-      if (*to_is_partial) {
-        return WI_SUCCESS;
-      }
+      my->chunks = new_chunks;
+      my->max_chunks = new_max;
     }
-
-    if (p_length) {
-      plist_from_bin(my->partial->head, (uint32_t)p_length, to_rpc_dict);
-      cb_clear(my->partial);
-    } else {
-      plist_from_bin(rpc_bin, (uint32_t)rpc_len, to_rpc_dict);
-      free(rpc_bin);
+    struct wi_chunk *chunk = my->chunks + my->num_chunks++;
+    chunk->offset = rpc_bin - my->keep;
+    chunk->length = rpc_len;
+    my->chunks_length += rpc_len;
+    return WI_SUCCESS;
+  }
+  if (my->num_chunks) {
+    // join the slices, copying each byte once into an exact-size buffer
+    size_t total = rpc_len;
+    size_t i;
+    for (i = 0; i < my->num_chunks; i++) {
+      total += my->chunks[i].length;
+    }
+    cb_clear(my->partial);
+    if (cb_ensure_capacity(my->partial, total)) {
+      return self->on_error(self, "Out of memory");
     }
+    for (i = 0; i < my->num_chunks; i++) {
+      memcpy(my->partial->tail, my->keep + my->chunks[i].offset,
+          my->chunks[i].length);
+      my->partial->tail += my->chunks[i].length;
+    }
+    memcpy(my->partial->tail, rpc_bin, rpc_len);
+    my->partial->tail += rpc_len;
+    my->keep_hint = (from_buf + length) - my->keep;
+    my->num_chunks = 0;
+    my->chunks_length = 0;
+    rpc_bin = my->partial->head;
+    rpc_len = total;
   }
+  *to_rpc_bin = rpc_bin;
+  *to_rpc_len = rpc_len;
+  return WI_SUCCESS;
+}
 
-  return (*to_rpc_dict ? WI_SUCCESS : WI_ERROR);
+wi_status wi_recv_rpc(wi_t self, const char *rpc_bin, size_t rpc_len) {
+  if (self->recv_bplist) {
+    return self->recv_bplist(self, rpc_bin, rpc_len);
+  }
+  plist_t rpc_dict = NULL;
+  plist_from_bin(rpc_bin, (uint32_t)rpc_len, &rpc_dict);
+  if (!rpc_dict) {
+    return self->on_error(self, "Invalid rpc");
+  }
+  wi_status ret = self->recv_plist(self, rpc_dict);
+  plist_free(rpc_dict);
+  return ret;
 }
 
 wi_status wi_recv_packet(wi_t self, const char *packet, ssize_t length) {
+  wi_private_t my = self->private_state;
   wi_on_debug(self, "wi.recv_packet", packet, length);
 
   size_t body_length = 0;
-  plist_t rpc_dict = NULL;
-  bool is_partial = false;
+  const char *rpc_bin = NULL;
+  size_t rpc_len = 0;
   if (!packet || length < 4 || wi_parse_length(self, packet, &body_length) ||
       //TODO (body_length != length - 4) ||
-      wi_parse_plist(self, packet + 4, body_length, &rpc_dict, &is_partial)) {
+      wi_parse_rpc(self, packet + 4, body_length, &rpc_bin, &rpc_len)) {
     // invalid packet
     char *text = NULL;
     if (body_length != length - 4) {
@@ -411,11 +575,12 @@ wi_status wi_recv_packet(wi_t self, const char *packet, ssize_t length) {
     return ret;
   }
 
-  if (is_partial) {
-    return WI_SUCCESS;
+  if (!rpc_bin) {
+    return WI_SUCCESS;  // partial
   }
-  wi_status ret = self->recv_plist(self, rpc_dict);
-  plist_free(rpc_dict);
+  wi_status ret = wi_recv_rpc(self, rpc_bin, rpc_len);
+  cb_clear(my->partial);
+  wi_end_spill(self);
   return ret;
 }
 
@@ -424,6 +589,11 @@ wi_status wi_recv_loop(wi_t self) {
   wi_status ret;
   const char *in_head = my->in->in_head;
   const char *in_tail = my->in->in_tail;
+  if (my->num_chunks) {
+    // skip the partial messages that we've already read
+    my->keep = in_head;
+    in_head += my->keep_length;
+  }
   while (1) {
     size_t in_length = in_tail - in_head;
     if (!my->has_length && in_length >= 4) {
@@ -452,6 +622,19 @@ wi_status wi_recv_loop(wi_t self) {
       break;
     }
   }
+  if (ret) {
+    my->num_chunks = 0;
+    my->chunks_length = 0;
+    wi_end_spill(self);
+  }
+  if (my->num_chunks) {
+    // leave the partial messages in our buffer
+    my->keep_length = in_head - my->keep;
+    in_head = my->keep;
+  } else {
+    my->keep_length = 0;
+  }
+  my->keep = NULL;
   my->in->in_head = in_head;
   return ret;
 }
@@ -471,17 +654,65 @@ wi_status wi_on_recv(wi_t self, const char *buf, ssize_t length) {
   if (cb_end_input(my->in)) {
     return self->on_error(self, "end_input buffer error");
   }
+  if (my->num_chunks) {
+    // make room for the rest of the message, if it's like the last one
+    size_t in_length = my->in->tail - my->in->head;
+    if (my->keep_hint > in_length &&
+        cb_ensure_capacity(my->in, my->keep_hint - in_length)) {
+      return self->on_error(self, "Out of memory");
+    }
+  }
   return ret;
 }
 
+size_t wi_get_memory(wi_t self) {
+  wi_private_t my = self->private_state;
+  return (cb_get_capacity(my->in) + cb_get_capacity(my->partial) +
+      cb_get_capacity(my->out) + cb_get_capacity(my->wrapper->out) +
+      my->max_chunks * sizeof(struct wi_chunk));
+}
+
+wi_status wi_on_recv_buffer(wi_t self, char **to_buf, size_t *to_length) {
+  wi_private_t my = self->private_state;
+  *to_buf = NULL;
+  *to_length = 0;
+  if (!my->has_length) {
+    return WI_SUCCESS;
+  }
+  // our buffer holds any kept partial messages, then the current packet
+  size_t in_length = (my->in->tail - my->in->head) - my->keep_length;
+  size_t packet_length = my->body_length + 4;
+  if (packet_length <= in_length) {
+    return WI_SUCCESS;
+  }
+  size_t needed = packet_length - in_length;
+  if (cb_ensure_capacity(my->in, needed)) {
+    return self->on_error(self, "Out of memory");
+  }
+  *to_buf = my->in->tail;
+  *to_length = needed;
+  return WI_SUCCESS;
+}
+
 //
 // STRUCTS
 //
 
 void wi_private_free(wi_private_t my) {
   if (my) {
+#ifndef WIN32
+    if (my->spill_map) {
+      munmap(my->spill_map, my->spilled_length);
+    }
+    if (my->spill) {
+      fclose(my->spill);
+    }
+#endif
     cb_free(my->in);
     cb_free(my->partial);
+    free(my->chunks);
+    cb_free(my->out);
+    bp_free(my->wrapper);
     memset(my, 0, sizeof(struct wi_private));
     free(my);
   }
@@ -493,10 +724,15 @@ wi_private_t wi_private_new() {
     memset(my, 0, sizeof(struct wi_private));
     my->in = cb_new();
     my->partial = cb_new();
-    if (!my->in || !my->partial) {
+    my->out = cb_new();
+    my->wrapper = bp_new();
+    if (!my->in || !my->partial || !my->out || !my->wrapper) {
       wi_private_free(my);
       return NULL;
     }
+    my->in->tag = MB_WEBINSPECTOR;
+    my->partial->tag = MB_WEBINSPECTOR;
+    my->out->tag = MB_WEBINSPECTOR;
   }
   return my;
 }
@@ -516,7 +752,10 @@ wi_t wi_new(bool partials_supported) {
   }
   memset(self, 0, sizeof(struct wi_struct));
   self->on_recv = wi_on_recv;
+  self->on_recv_buffer = wi_on_recv_buffer;
+  self->get_memory = wi_get_memory;
   self->send_plist = wi_send_plist;
+  self->send_bplist = wi_send_bplist;
   self->recv_packet = wi_recv_packet;
   self->on_error = wi_on_error;
   self->private_state = wi_private_new();
@@ -11,9 +11,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <zlib.h>
 
 #include "websocket.h"
 #include "char_buffer.h"
+#include "memory_budget.h"
 
 #include "base64.h"
 #include "sha1.h"
@@ -31,6 +33,15 @@ typedef int8_t ws_state;
 #define STATE_READ_FRAME 6
 #define STATE_CLOSED 7
 
+// Limit on an inflated message, to protect us from "zip bombs"
+#define MAX_INFLATED_LENGTH (1 << 26)
+
+#define MAX_FRAME_HEADER_LENGTH 14
+
+// While we're over our memory budget, still accept frames up to this long,
+// e.g. a client's command that might free memory
+#define OVER_BUDGET_FRAME_LENGTH 4096
+
 
 struct ws_private {
   ws_state state;
@@ -52,10 +63,35 @@ struct ws_private {
   char *sec_answer;
 
   size_t needed_length;
+
+  // the frame that we're reading, see ws_read_frame_length
+  bool frame_is_fin;
+  uint8_t frame_opcode;
+  bool frame_is_masking;
+  unsigned char frame_mask[4];
   size_t frame_length;
+  size_t frame_offset;
+  char control[125];
+  size_t control_length;
 
   uint8_t continued_opcode;
+  uint8_t sent_continued_opcode;
+  unsigned int sent_utf8_state;
   bool sent_close;
+
+  // permessage-deflate, if negotiated by ws_read_extensions
+  char *extensions;
+  bool is_deflate;
+  int deflate_window_bits;
+  bool deflate_no_context_takeover;
+  size_t deflate_min_length;
+  z_stream *deflater;
+  z_stream *inflater;
+  bool is_deflating;
+  bool is_inflating;
+  cb_t zin;
+  size_t zlib_memory;  // our deflater and inflater state, see ws_zalloc
+  unsigned int utf8_state;
 };
 
 
@@ -215,7 +251,8 @@ ws_status ws_send_upgrade(ws_t self) {
   }
 
   size_t needed = (1024 + strlen(my->sec_answer) +
-      (my->protocol ? strlen(my->protocol) : 0));
+      (my->protocol ? strlen(my->protocol) : 0) +
+      (my->extensions ? strlen(my->extensions) : 0));
   cb_clear(my->out);
   if (cb_ensure_capacity(my->out, needed)) {
     return self->on_error(self, "Out of memory");
@@ -230,6 +267,10 @@ ws_status ws_send_upgrade(ws_t self) {
     out_tail += sprintf(out_tail, "Sec-WebSocket-Protocol: %s\r\n",
         my->protocol);
   }
+  if (my->extensions) {
+    out_tail += sprintf(out_tail, "Sec-WebSocket-Extensions: %s\r\n",
+        my->extensions);
+  }
   out_tail += sprintf(out_tail, "Sec-WebSocket-Accept: %s\r\n",
       my->sec_answer);
   out_tail += sprintf(out_tail, "\r\n");
@@ -241,6 +282,91 @@ ws_status ws_send_upgrade(ws_t self) {
   return ret;
 }
 
+// zlib allocators, which charge our (de)compression state to our memory
+// budget.  Each block is prefixed with its length, for ws_zfree.
+static voidpf ws_zalloc(voidpf opaque, uInt items, uInt size) {
+  ws_private_t my = (ws_private_t)opaque;
+  size_t length = (size_t)items * size;
+  size_t *block = (size_t *)malloc(sizeof(size_t) + length);
+  if (!block) {
+    return Z_NULL;
+  }
+  *block = length;
+  my->zlib_memory += length;
+  mb_add(MB_WEBSOCKET, length);
+  return block + 1;
+}
+
+static void ws_zfree(voidpf opaque, voidpf address) {
+  ws_private_t my = (ws_private_t)opaque;
+  if (address) {
+    size_t *block = (size_t *)address - 1;
+    my->zlib_memory -= *block;
+    mb_remove(MB_WEBSOCKET, *block);
+    free(block);
+  }
+}
+
+// Compresses a message fragment into my->out, after the first "offset"
+// bytes, which the caller reserves for the frame header.
+static ws_status ws_deflate(ws_t self, const char *data, size_t length,
+    bool is_fin, size_t offset, size_t *to_length) {
+  ws_private_t my = self->private_state;
+  z_stream *z = my->deflater;
+  if (!z) {
+    z = (z_stream *)calloc(1, sizeof(z_stream));
+    if (z) {
+      z->zalloc = ws_zalloc;
+      z->zfree = ws_zfree;
+      z->opaque = my;
+    }
+    if (!z || deflateInit2(z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+          -my->deflate_window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      free(z);
+      return self->on_error(self, "Unable to create deflater");
+    }
+    my->deflater = z;
+  }
+
+  // Only flush at the end of the message, otherwise a fin fragment with
+  // no new input wouldn't produce the empty block that we strip below.
+  int flush = (is_fin ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+  z->next_in = (Bytef *)data;
+  z->avail_in = length;
+  size_t out_length = 0;
+  size_t avail = length / 2 + 64;
+  while (1) {
+    if (cb_ensure_capacity(my->out, offset + out_length + avail)) {
+      return self->on_error(self, "Out of memory");
+    }
+    z->next_out = (Bytef *)(my->out->tail + offset + out_length);
+    z->avail_out = avail;
+    int ret = deflate(z, flush);
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      return self->on_error(self, "deflate failed: %d", ret);
+    }
+    out_length += avail - z->avail_out;
+    if (z->avail_out) {
+      break;
+    }
+    avail = out_length + 1024;
+  }
+
+  if (is_fin) {
+    // RFC 7692 7.2.1: remove the trailing 00 00 ff ff
+    const char *out_tail = my->out->tail + offset + out_length;
+    if (out_length < 4 || memcmp(out_tail - 4, "\x00\x00\xff\xff", 4)) {
+      return self->on_error(self, "Missing deflate tail");
+    }
+    out_length -= 4;
+    if (my->deflate_no_context_takeover) {
+      deflateReset(z);
+    }
+  }
+  *to_length = out_length;
+  return WS_SUCCESS;
+}
+
 ws_status ws_send_frame(ws_t self,
     bool is_fin, uint8_t opcode, bool is_masking,
     const char *payload_data, size_t payload_length) {
@@ -271,18 +397,20 @@ ws_status ws_send_frame(ws_t self,
   }
 
   uint8_t opcode2 = opcode;
-  if (!is_control && my->continued_opcode) {
-    if (my->continued_opcode != opcode) {
+  if (!is_control && my->sent_continued_opcode) {
+    if (my->sent_continued_opcode != opcode) {
       return self->on_error(self, "Expecting continue of 0x%x not 0x%x",
-          my->continued_opcode, opcode);
+          my->sent_continued_opcode, opcode);
     }
     opcode2 = OPCODE_CONTINUATION;
   }
 
+  // fragments can split a character
   size_t i;
-  bool is_utf8 = (opcode2 == OPCODE_TEXT ? true : false);
+  bool is_utf8 = (opcode == OPCODE_TEXT ? true : false);
   if (is_utf8) {
-    unsigned int utf8_state = UTF8_VALID;
+    unsigned int utf8_state = (opcode2 == OPCODE_CONTINUATION ?
+        my->sent_utf8_state : UTF8_VALID);
     const char *payload_head = payload_data;
     for (i = 0; i < payload_length; i++) {
       unsigned char ch = *payload_head++;
@@ -294,55 +422,91 @@ ws_status ws_send_frame(ws_t self,
             payload_head-1 - payload_data);
       }
     }
+    if (is_fin && utf8_state != UTF8_VALID) {
+      return self->on_error(self, "Truncated UTF8 character");
+    }
+    my->sent_utf8_state = utf8_state;
   }
 
-  int8_t payload_n = (payload_length < 126 ? 0 :
-      payload_length < UINT16_MAX ? 2 : 8);
+  // The first frame decides if the whole message is compressed
+  bool is_compressed = false;
+  if (!is_control && my->is_deflate) {
+    if (opcode2 != OPCODE_CONTINUATION) {
+      my->is_deflating = (payload_length > 0 &&
+          (!is_fin || payload_length >= my->deflate_min_length));
+    }
+    is_compressed = my->is_deflating;
+  }
 
-  size_t needed = (2 + payload_n + (is_masking ? 4 : 0) + payload_length);
+  // Compress before writing the header, since the header holds the
+  // compressed length, so reserve room for the largest header.
+  size_t length = payload_length;
   cb_clear(my->out);
-  if (cb_ensure_capacity(my->out, needed)) {
-    return self->on_error(self, "Out of memory");
+  if (is_compressed && ws_deflate(self, payload_data, payload_length,
+        is_fin, MAX_FRAME_HEADER_LENGTH, &length)) {
+    return WS_ERROR;
   }
-  char *out_tail = my->out->tail;
 
-  *out_tail++ = ((is_fin ? 0x80 : 0) | (opcode2 & 0x0F));
+  char header[MAX_FRAME_HEADER_LENGTH];
+  char *header_tail = header;
 
-  *out_tail++ = ((is_masking ? 0x80 : 0) | (!payload_n ? payload_length :
-        payload_n == 2 ? 126: 127));
+  *header_tail++ = ((is_fin ? 0x80 : 0) |
+      (is_compressed && opcode2 != OPCODE_CONTINUATION ? 0x40 : 0) |
+      (opcode2 & 0x0F));
 
+  int8_t payload_n = (length < 126 ? 0 : length < UINT16_MAX ? 2 : 8);
+  *header_tail++ = ((is_masking ? 0x80 : 0) | (!payload_n ? length :
+        payload_n == 2 ? 126: 127));
 
   int8_t j;
-  int8_t payload_mem_size = sizeof(payload_length);
+  int8_t payload_mem_size = sizeof(length);
   for (j = payload_n - 1; j >= 0; j--) {
-    *out_tail++ = j >= payload_mem_size ? 0 : (unsigned char)((payload_length >> (j<<3)) & 0xFF);
+    *header_tail++ = j >= payload_mem_size ? 0 : (unsigned char)((length >> (j<<3)) & 0xFF);
   }
 
+  char mask[4];
   if (is_masking) {
-    char mask[4];
     ws_random_buf(mask, 4);
     for (i = 0; i < 4; i++) {
-      *out_tail++ = (is_masking ? mask[i] : 0);
+      *header_tail++ = mask[i];
     }
-    const char *payload_head = payload_data;
+  }
+
+  size_t header_length = header_tail - header;
+  char *out_head;
+  if (is_compressed) {
+    out_head = my->out->tail + MAX_FRAME_HEADER_LENGTH - header_length;
+  } else {
+    if (cb_ensure_capacity(my->out, header_length + length)) {
+      return self->on_error(self, "Out of memory");
+    }
+    out_head = my->out->tail;
+  }
+  memcpy(out_head, header, header_length);
+  char *out_tail = out_head + header_length;
+
+  const char *payload_head = (is_compressed ? out_tail : payload_data);
+  if (is_masking) {
     uint32_t mask_offset = 0;
-    for (i = 0; i < payload_length; i++) {
+    for (i = 0; i < length; i++) {
       unsigned char ch = *payload_head++;
       ch = (ch ^ mask[mask_offset++ & 3]);
       *out_tail++ = ch;
     }
   } else {
-    memcpy(out_tail, payload_data, payload_length);
-    out_tail += payload_length;
+    if (!is_compressed) {
+      memcpy(out_tail, payload_data, length);
+    }
+    out_tail += length;
   }
 
-  if (!is_fin && !my->continued_opcode) {
-    my->continued_opcode = opcode;
+  if (!is_control) {
+    my->sent_continued_opcode = (is_fin ? 0 : opcode);
   }
 
-  size_t out_length = out_tail - my->out->tail;
-  ws_on_debug(self, "ws.sending_frame", my->out->tail, out_length);
-  ws_status ret = self->send_data(self, my->out->tail, out_length);
+  size_t out_length = out_tail - out_head;
+  ws_on_debug(self, "ws.sending_frame", out_head, out_length);
+  ws_status ret = self->send_data(self, out_head, out_length);
   if (!ret && opcode == OPCODE_CLOSE) {
     my->sent_close = true;
   }
@@ -368,6 +532,18 @@ ws_status ws_send_close(ws_t self, ws_close close_code, const char *reason) {
   return ret;
 }
 
+bool ws_can_reorder(ws_t self) {
+  ws_private_t my = self->private_state;
+  return (!my->is_deflate || my->deflate_no_context_takeover);
+}
+
+size_t ws_get_memory(ws_t self) {
+  ws_private_t my = self->private_state;
+  return (cb_get_capacity(my->in) + cb_get_capacity(my->out) +
+      cb_get_capacity(my->data) + cb_get_capacity(my->zin) +
+      my->zlib_memory);
+}
+
 
 //
 // RECV
@@ -442,6 +618,131 @@ ws_status ws_read_http_header(ws_t self,
   return WS_SUCCESS;
 }
 
+static int ws_parse_window_bits(const char *val) {
+  char *end = NULL;
+  long bits = strtol(val, &end, 10);
+  return (end != val && !*end && bits >= 8 && bits <= 15 ? bits : 0);
+}
+
+// Accepts a permessage-deflate offer if we support all of its params, e.g.:
+//   permessage-deflate; client_max_window_bits; server_max_window_bits=10
+static bool ws_accept_deflate(ws_t self, const char *offer, size_t length) {
+  ws_private_t my = self->private_state;
+  ws_deflate_t deflate = self->deflate;
+
+  bool is_valid = true;
+  bool is_first = true;
+  bool server_no_context_takeover = false;
+  bool client_no_context_takeover = false;
+  int server_max_window_bits = 0;
+  bool client_max_window_bits = false;
+  const char *end = offer + length;
+  const char *head;
+  const char *param_end;
+  for (head = offer; head < end && is_valid; head = param_end + 1) {
+    param_end = (const char *)memchr(head, ';', end - head);
+    if (!param_end) {
+      param_end = end;
+    }
+    // copy the param, dropping whitespace and quotes
+    char param[64];
+    size_t n = 0;
+    const char *s;
+    for (s = head; s < param_end && is_valid; s++) {
+      if (*s != ' ' && *s != '\t' && *s != '"') {
+        is_valid = (n + 1 < sizeof(param));
+        param[n++] = *s;
+      }
+    }
+    if (!is_valid) {
+      break;
+    }
+    param[n] = '\0';
+    char *val = strchr(param, '=');
+    if (val) {
+      *val++ = '\0';
+    }
+
+    if (is_first) {
+      is_first = false;
+      is_valid = (!val && !strcasecmp(param, "permessage-deflate"));
+    } else if (!strcasecmp(param, "server_no_context_takeover")) {
+      is_valid = (!val && !server_no_context_takeover);
+      server_no_context_takeover = true;
+    } else if (!strcasecmp(param, "client_no_context_takeover")) {
+      is_valid = (!val && !client_no_context_takeover);
+      client_no_context_takeover = true;
+    } else if (!strcasecmp(param, "server_max_window_bits")) {
+      is_valid = (val && !server_max_window_bits);
+      server_max_window_bits = (is_valid ? ws_parse_window_bits(val) : 0);
+      is_valid = (server_max_window_bits > 0);
+    } else if (!strcasecmp(param, "client_max_window_bits")) {
+      // we always inflate with the max window, so we don't reply to this
+      is_valid = (!client_max_window_bits &&
+          (!val || ws_parse_window_bits(val)));
+      client_max_window_bits = true;
+    } else {
+      is_valid = false;
+    }
+  }
+  if (!is_valid || is_first) {
+    return false;
+  }
+
+  int window_bits = deflate->window_bits;
+  window_bits = (window_bits < 9 ? 9 : window_bits > 15 ? 15 : window_bits);
+  if (server_max_window_bits) {
+    if (server_max_window_bits < 9) {
+      // zlib can't deflate with a 256-byte window
+      return false;
+    }
+    if (window_bits > server_max_window_bits) {
+      window_bits = server_max_window_bits;
+    }
+  }
+  bool no_context_takeover = (deflate->no_context_takeover ||
+      server_no_context_takeover);
+
+  char bits_param[40] = "";
+  if (server_max_window_bits || window_bits < 15) {
+    sprintf(bits_param, "; server_max_window_bits=%d", window_bits);
+  }
+  free(my->extensions);
+  if (asprintf(&my->extensions, "permessage-deflate%s%s",
+        (no_context_takeover ? "; server_no_context_takeover" : ""),
+        bits_param) < 0) {
+    my->extensions = NULL;
+    return false;
+  }
+  my->is_deflate = true;
+  my->deflate_window_bits = window_bits;
+  my->deflate_no_context_takeover = no_context_takeover;
+  my->deflate_min_length = deflate->min_length;
+  return true;
+}
+
+// Accepts the first permessage-deflate offer that we support, if any
+static void ws_read_extensions(ws_t self, const char *val) {
+  ws_private_t my = self->private_state;
+  if (!self->deflate || !self->deflate->is_enabled || my->is_deflate) {
+    return;
+  }
+  const char *head = val;
+  while (*head) {
+    while (*head == ' ' || *head == ',') {
+      head++;
+    }
+    const char *offer_end = strchr(head, ',');
+    if (!offer_end) {
+      offer_end = head + strlen(head);
+    }
+    if (head < offer_end && ws_accept_deflate(self, head, offer_end - head)) {
+      break;
+    }
+    head = offer_end;
+  }
+}
+
 ws_status ws_read_headers(ws_t self) {
   ws_private_t my = self->private_state;
 
@@ -466,6 +767,8 @@ ws_status ws_read_headers(ws_t self) {
     } else if (!strcasecmp(key, "Sec-WebSocket-Key")) {
       free(my->sec_key);
       my->sec_key = strdup(val);
+    } else if (!strcasecmp(key, "Sec-WebSocket-Extensions")) {
+      ws_read_extensions(self, val);
     } else if (!strcasecmp(key, "Host")) {
       free(my->req_host);
       char *p = strrchr(val, ':');
@@ -488,7 +791,6 @@ ws_status ws_read_frame_length(ws_t self) {
   size_t in_length = my->in->in_tail - in_head;
 
   my->needed_length = 0;
-  my->frame_length = 0;
 
   if (in_length < 2) {
     my->needed_length = 2;
@@ -496,10 +798,17 @@ ws_status ws_read_frame_length(ws_t self) {
   }
 
   bool is_fin = ((*in_head & 0x80) ? true : false);
+  bool is_compressed = ((*in_head & 0x40) ? true : false);
   uint8_t reserved_flags = (*in_head & 0x70);
   uint8_t opcode = (*in_head & 0x0F);
   bool is_control = (opcode >= OPCODE_CLOSE ? true : false);
 
+  // RSV1 marks the first frame of a compressed message
+  if (reserved_flags == 0x40 && my->is_deflate && !is_control &&
+      opcode != OPCODE_CONTINUATION) {
+    reserved_flags = 0;
+  }
+
   // error check
   if (reserved_flags) {
     return self->on_error(self, "Reserved flags 0x%x in 0x%x",
@@ -536,8 +845,9 @@ ws_status ws_read_frame_length(ws_t self) {
 
   uint8_t payload_n = (payload_length < 126 ? 0 :
       payload_length < 127 ? 2 : 8);
-  if (in_length < 2 + payload_n) {
-    my->needed_length = 2 + payload_n;
+  size_t header_length = 2 + payload_n + (is_masking ? 4 : 0);
+  if (in_length < header_length) {
+    my->needed_length = header_length;
     return WS_SUCCESS;
   }
   if (payload_n > 0) {
@@ -548,99 +858,195 @@ ws_status ws_read_frame_length(ws_t self) {
       payload_length |= (unsigned char)*in_head++;
     }
   }
-  my->frame_length = 2 + payload_n + (is_masking ? 4 : 0) + payload_length;
-
-  // don't advance my->in->in_head yet
-  return WS_SUCCESS;
-}
-
-ws_status ws_read_frame(ws_t self,
-    bool *to_is_fin, uint8_t *to_opcode, bool *to_is_masking) {
-  ws_private_t my = self->private_state;
-  const char *in_head = my->in->in_head;
-  size_t in_length = my->in->in_tail - in_head;
-  ws_on_debug(self, "ws.recv_frame", in_head, in_length);
-
-  size_t frame_length = my->frame_length;
-  if (my->needed_length || !frame_length || in_length < frame_length) {
-    return self->on_error(self, "Invalid partial frame");
-  }
-
-  // the above "ws_read_frame_length" checks the opcode,
-  // control flags, etc, so we won't repeat that here.
-
-  bool is_fin = ((*in_head & 0x80) ? true : false);
-  uint8_t opcode = (*in_head & 0x0F);
-  //bool is_control = (opcode >= OPCODE_CLOSE ? true : false);
-
-  bool is_continue = (opcode == OPCODE_CONTINUATION ? true : false);
-  uint8_t opcode2 = (is_continue ? my->continued_opcode : opcode);
-  in_head++;
-
-  bool is_masking = ((*in_head & 0x80) ? true : false);
-  size_t payload_length = (*in_head & 0x7f);
-  in_head++;
-
-  int payload_n = (payload_length < 126 ? 0 : payload_length < 127 ? 2 : 8);
-  if (payload_n > 0) {
-    payload_length = frame_length - (2 + (is_masking ? 4 : 0) + payload_n);
-    in_head += payload_n;
+  if (!is_control && mb_get_limit() &&
+      (payload_length > mb_get_limit() ||
+       (payload_length > OVER_BUDGET_FRAME_LENGTH &&
+        !mb_has_room(payload_length)))) {
+    self->send_close(self, CLOSE_SIZE_ERROR, "Over memory budget");
+    return self->on_error(self, "Frame payload_length %zd exceeds our"
+        " memory budget", payload_length);
   }
 
   // the "on_frame" callback will assert (is_masking == is_client)
-  size_t i;
-  unsigned char mask[4];
   if (is_masking) {
     is_masking = false;
+    size_t i;
     for (i = 0; i < 4; i++) {
       if (*in_head) {
         is_masking = true;
       }
-      mask[i] = *in_head++;
+      my->frame_mask[i] = *in_head++;
     }
   }
 
-  if (cb_ensure_capacity(my->data, payload_length)) {
-    return self->on_error(self,
-        "Payload %zd exceeds buffer capacity", payload_length);
+  // control frames may be interleaved with a fragmented message
+  if (!is_control && opcode != OPCODE_CONTINUATION) {
+    my->is_inflating = is_compressed;
+    my->utf8_state = UTF8_VALID;
   }
-  char *data_tail = my->data->tail;
 
-  // no extension, so no extension data
+  my->frame_is_fin = is_fin;
+  my->frame_opcode = opcode;
+  my->frame_is_masking = is_masking;
+  my->frame_length = payload_length;
+  my->frame_offset = 0;
+  my->control_length = 0;
 
-  if (is_masking) {
-    uint32_t mask_offset = 0;
-    for (i = 0; i < payload_length; i++) {
-      unsigned char ch = *in_head++;
-      ch = (ch ^ mask[mask_offset++ & 3]);
-      *data_tail++ = ch;
+  // the payload is read by ws_read_frame, as it arrives
+  my->in->in_head = in_head;
+  return WS_SUCCESS;
+}
+
+// Inflates a message fragment onto my->data
+static ws_status ws_inflate(ws_t self, const char *payload,
+    size_t payload_length, bool is_fin) {
+  ws_private_t my = self->private_state;
+  z_stream *z = my->inflater;
+  if (!z) {
+    z = (z_stream *)calloc(1, sizeof(z_stream));
+    if (z) {
+      z->zalloc = ws_zalloc;
+      z->zfree = ws_zfree;
+      z->opaque = my;
     }
-  } else {
-    memcpy(data_tail, in_head, payload_length);
-    data_tail += payload_length;
+    if (!z || inflateInit2(z, -15) != Z_OK) {
+      free(z);
+      return self->on_error(self, "Unable to create inflater");
+    }
+    my->inflater = z;
+  }
+
+  // RFC 7692 7.2.2: append the 00 00 ff ff that the sender removed
+  static const char tail[4] = {0x00, 0x00, (char)0xff, (char)0xff};
+  const char *ins[2] = {payload, tail};
+  size_t in_lengths[2] = {payload_length, sizeof(tail)};
+  int k;
+  for (k = 0; k < (is_fin ? 2 : 1); k++) {
+    z->next_in = (Bytef *)ins[k];
+    z->avail_in = in_lengths[k];
+    do {
+      size_t avail = my->data->end - my->data->tail;
+      if (!my->data->begin || avail < 1024) {
+        size_t used = my->data->tail - my->data->begin;
+        if (cb_ensure_capacity(my->data,
+              (used > z->avail_in ? used : z->avail_in) + 1024)) {
+          return self->on_error(self, "Out of memory");
+        }
+        avail = my->data->end - my->data->tail;
+      }
+      z->next_out = (Bytef *)my->data->tail;
+      z->avail_out = (avail < UINT32_MAX ? avail : UINT32_MAX);
+      size_t avail_out = z->avail_out;
+      int ret = inflate(z, Z_SYNC_FLUSH);
+      if (ret == Z_STREAM_END) {
+        // the client set BFINAL, so expect a new stream
+        inflateReset(z);
+      } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        return self->on_error(self, "Invalid compressed data: %s",
+            (z->msg ? z->msg : "?"));
+      }
+      my->data->tail += avail_out - z->avail_out;
+      if (my->data->tail - my->data->begin > MAX_INFLATED_LENGTH) {
+        return self->on_error(self, "Inflated message exceeds %d bytes",
+            MAX_INFLATED_LENGTH);
+      }
+    } while (z->avail_in || !z->avail_out);
   }
-  my->in->in_head = in_head;
+  return WS_SUCCESS;
+}
 
+static void ws_unmask(char *to, const char *from, size_t length,
+    const unsigned char *mask, size_t mask_offset) {
+  size_t i;
+  for (i = 0; i < length; i++) {
+    to[i] = (from[i] ^ mask[(mask_offset + i) & 3]);
+  }
+}
+
+// Reads whatever part of the current frame's payload is in my->in, onto
+// my->data, or onto my->control if it's a control frame.
+ws_status ws_read_frame(ws_t self) {
+  ws_private_t my = self->private_state;
+  const char *in_head = my->in->in_head;
+  size_t in_length = my->in->in_tail - in_head;
+
+  size_t length = my->frame_length - my->frame_offset;
+  if (length > in_length) {
+    length = in_length;
+  }
+  ws_on_debug(self, "ws.recv_frame", in_head, length);
+
+  uint8_t opcode = my->frame_opcode;
+  bool is_control = (opcode >= OPCODE_CLOSE ? true : false);
+  bool is_masking = my->frame_is_masking;
+  bool is_last = (my->frame_offset + length == my->frame_length);
+
+  if (is_control) {
+    // read_frame_length checked that this fits
+    char *control_tail = my->control + my->control_length;
+    if (is_masking) {
+      ws_unmask(control_tail, in_head, length, my->frame_mask,
+          my->frame_offset);
+    } else {
+      memcpy(control_tail, in_head, length);
+    }
+    my->control_length += length;
+    my->frame_offset += length;
+    my->in->in_head = in_head + length;
+    return WS_SUCCESS;
+  }
+
+  // a compressed payload is unmasked into my->zin, then inflated
+  bool is_inflating = my->is_inflating;
+  size_t data_offset = my->data->tail - my->data->begin;
+  const char *payload = in_head;
+  if (is_masking || !is_inflating) {
+    cb_t unmasked = (is_inflating ? my->zin : my->data);
+    if (is_inflating) {
+      cb_clear(unmasked);
+    }
+    if (cb_ensure_capacity(unmasked, length)) {
+      return self->on_error(self,
+          "Payload %zd exceeds buffer capacity", length);
+    }
+    if (is_masking) {
+      ws_unmask(unmasked->tail, in_head, length, my->frame_mask,
+          my->frame_offset);
+    } else {
+      memcpy(unmasked->tail, in_head, length);
+    }
+    payload = unmasked->tail;
+    unmasked->tail += length;
+  }
+  if (is_inflating && ws_inflate(self, payload, length,
+        my->frame_is_fin && is_last)) {
+    return WS_ERROR;
+  }
+  my->frame_offset += length;
+  my->in->in_head = in_head + length;
+
+  // messages can be split mid-character, by the client or by inflate
+  bool is_continue = (opcode == OPCODE_CONTINUATION ? true : false);
+  uint8_t opcode2 = (is_continue ? my->continued_opcode : opcode);
   bool is_utf8 = (opcode2 == OPCODE_TEXT ? true : false);
   if (is_utf8) {
-    unsigned int utf8_state = UTF8_VALID;
-    char *dt = my->data->tail;
-    for (i = 0; i < payload_length; i++) {
-      unsigned char ch = *dt++;
+    unsigned int utf8_state = my->utf8_state;
+    const char *dt = my->data->begin + data_offset;
+    for (; dt < my->data->tail; dt++) {
+      unsigned char ch = *dt;
       utf8_state = validate_utf8[utf8_state + ch];
       if (utf8_state == UTF8_INVALID) {
         return self->on_error(self,
             "Invalid %sUTF8 character 0x%x at %zd",
             (is_masking ? "masked " :""), ch,
-            dt-1 - my->data->tail);
+            dt - (my->data->begin + data_offset));
       }
     }
+    if (my->frame_is_fin && is_last && utf8_state != UTF8_VALID) {
+      return self->on_error(self, "Truncated UTF8 character");
+    }
+    my->utf8_state = utf8_state;
   }
-
-  *to_is_fin = is_fin;
-  *to_opcode = opcode2;
-  *to_is_masking = is_masking;
-  my->data->tail = data_tail;
   return WS_SUCCESS;
 }
 
@@ -702,7 +1108,7 @@ ws_state ws_recv_frame_length(ws_t self) {
   if (ws_read_frame_length(self)) {
     return STATE_ERROR;
   }
-  if (my->needed_length || !my->frame_length) {
+  if (my->needed_length) {
     return -1;
   }
   return STATE_READ_FRAME;
@@ -711,37 +1117,52 @@ ws_state ws_recv_frame_length(ws_t self) {
 ws_state ws_recv_frame(ws_t self) {
   ws_private_t my = self->private_state;
 
-  if (my->needed_length || !my->frame_length ||
-      my->in->in_tail - my->in->in_head < my->frame_length) {
+  bool is_empty = (my->in->in_tail == my->in->in_head);
+  if (is_empty && my->frame_offset < my->frame_length) {
     return -1;
   }
 
-  bool is_fin;
-  uint8_t opcode;
-  bool is_masking;
-  if (ws_read_frame(self, &is_fin, &opcode, &is_masking)) {
+  if (ws_read_frame(self)) {
     return STATE_ERROR;
   }
+  bool is_complete = (my->frame_offset == my->frame_length);
 
+  uint8_t opcode = my->frame_opcode;
+  bool is_control = (opcode >= OPCODE_CLOSE ? true : false);
   bool should_keep = 1;
-  if (self->on_frame(self, is_fin, opcode, is_masking,
-        my->data->begin, my->data->tail - my->data->begin,
-        &should_keep)) {
-    return STATE_ERROR;
+  if (is_control) {
+    if (!is_complete) {
+      return -1;
+    }
+    if (self->on_frame(self, true, opcode, my->frame_is_masking,
+          my->control, my->control_length, &should_keep)) {
+      return STATE_ERROR;
+    }
+    return (opcode == OPCODE_CLOSE ? STATE_CLOSED : STATE_READ_FRAME_LENGTH);
   }
-  if (is_fin || !should_keep) {
-    cb_clear(my->data);
+
+  bool is_continue = (opcode == OPCODE_CONTINUATION ? true : false);
+  uint8_t opcode2 = (is_continue ? my->continued_opcode : opcode);
+  bool is_fin = (my->frame_is_fin && is_complete);
+  if (is_complete || self->is_streaming) {
+    if (self->on_frame(self, is_fin, opcode2, my->frame_is_masking,
+          my->data->begin, my->data->tail - my->data->begin,
+          &should_keep)) {
+      return STATE_ERROR;
+    }
+    if (is_fin || !should_keep) {
+      cb_clear(my->data);
+    }
+  }
+  if (!is_complete) {
+    return -1;
   }
 
-  if (is_fin) {
+  if (my->frame_is_fin) {
     my->continued_opcode = 0;
-  } else if (opcode != OPCODE_CONTINUATION) {
+  } else if (!is_continue) {
     my->continued_opcode = opcode;
   }
-
-  if (opcode == OPCODE_CLOSE) {
-    return STATE_CLOSED;
-  }
   return STATE_READ_FRAME_LENGTH;
 }
 
@@ -784,9 +1205,7 @@ ws_status ws_recv_loop(ws_t self) {
     if (new_state == STATE_CLOSED || new_state == STATE_ERROR) {
       return WS_ERROR;
     }
-    if (my->in->in_tail == my->in->in_head) {
-      return WS_SUCCESS;
-    }
+    // keep going even if our input is empty, e.g. for a zero-length frame
   }
 }
 
@@ -813,22 +1232,21 @@ ws_status ws_on_recv(ws_t self, const char *buf, ssize_t length) {
 // STRUCTS
 //
 
-ws_private_t ws_private_new() {
-  ws_private_t my = (ws_private_t)malloc(sizeof(struct ws_private));
-  if (my) {
-    memset(my, 0, sizeof(struct ws_private));
-    my->in = cb_new();
-    my->out = cb_new();
-    my->data = cb_new();
-    my->state = STATE_READ_HTTP_REQUEST;
-  }
-  return my;
-}
 void ws_private_free(ws_private_t my) {
   if (my) {
     cb_free(my->in);
     cb_free(my->out);
     cb_free(my->data);
+    cb_free(my->zin);
+    if (my->deflater) {
+      deflateEnd(my->deflater);
+      free(my->deflater);
+    }
+    if (my->inflater) {
+      inflateEnd(my->inflater);
+      free(my->inflater);
+    }
+    free(my->extensions);
     free(my->method);
     free(my->resource);
     free(my->http_version);
@@ -840,6 +1258,26 @@ void ws_private_free(ws_private_t my) {
     free(my);
   }
 }
+ws_private_t ws_private_new() {
+  ws_private_t my = (ws_private_t)malloc(sizeof(struct ws_private));
+  if (my) {
+    memset(my, 0, sizeof(struct ws_private));
+    my->in = cb_new();
+    my->out = cb_new();
+    my->data = cb_new();
+    my->zin = cb_new();
+    if (!my->in || !my->out || !my->data || !my->zin) {
+      ws_private_free(my);
+      return NULL;
+    }
+    my->in->tag = MB_WEBSOCKET;
+    my->out->tag = MB_WEBSOCKET;
+    my->data->tag = MB_WEBSOCKET;
+    my->zin->tag = MB_WEBSOCKET;
+    my->state = STATE_READ_HTTP_REQUEST;
+  }
+  return my;
+}
 
 ws_t ws_new() {
   ws_private_t my = ws_private_new();
@@ -857,6 +1295,8 @@ ws_t ws_new() {
   self->send_frame = ws_send_frame;
   self->send_close = ws_send_close;
   self->on_recv = ws_on_recv;
+  self->can_reorder = ws_can_reorder;
+  self->get_memory = ws_get_memory;
   self->on_error = ws_on_error;
   self->private_state = my;
   return self;